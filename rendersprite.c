@@ -1,36 +1,330 @@
+// clock_gettime() is POSIX rather than C99, so strict builds have
+// to ask for it before anything is included.
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include "rendersprite.h"
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#ifdef RS_HEADLESS
+#include <GL/osmesa.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Threads, locks and condition variables, from pthreads or
+// from Win32, whichever the platform has.
+#ifdef _WIN32
+typedef HANDLE RS_Thread;
+typedef CRITICAL_SECTION RS_Mutex;
+typedef CONDITION_VARIABLE RS_Cond;
+#else
+typedef pthread_t RS_Thread;
+typedef pthread_mutex_t RS_Mutex;
+typedef pthread_cond_t RS_Cond;
+#endif
+
+#ifdef _WIN32
+/*
+	What a Win32 thread needs to call a pthreads-style entry point.
+*/
+typedef struct
+{
+	void * (*entry)(void *);
+	void * data;
+} RS_ThreadStart;
+
+static DWORD WINAPI threadTrampoline(LPVOID data)
+{
+	RS_ThreadStart start = *(RS_ThreadStart *)data;
+	free(data);
+	start.entry(start.data);
+	return 0;
+}
+#endif
+
+/*
+	Starts a thread running entry(data). Returns 1 if it started.
+*/
+static int startThread(RS_Thread * thread, void * (*entry)(void *), void * data)
+{
+	#ifdef _WIN32
+	RS_ThreadStart * start = malloc(sizeof(RS_ThreadStart));
+	start->entry = entry;
+	start->data = data;
+	*thread = CreateThread(NULL, 0, threadTrampoline, start, 0, NULL);
+	if(*thread == NULL) free(start);
+	return *thread != NULL;
+	#else
+	return pthread_create(thread, NULL, entry, data) == 0;
+	#endif
+}
+
+/*
+	Waits for a thread started by startThread() to finish.
+*/
+static void joinThread(RS_Thread thread)
+{
+	#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	#else
+	pthread_join(thread, NULL);
+	#endif
+}
+
+static void initMutex(RS_Mutex * mutex)
+{
+	#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+	#else
+	pthread_mutex_init(mutex, NULL);
+	#endif
+}
+
+static void destroyMutex(RS_Mutex * mutex)
+{
+	#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+	#else
+	pthread_mutex_destroy(mutex);
+	#endif
+}
+
+static void lockMutex(RS_Mutex * mutex)
+{
+	#ifdef _WIN32
+	EnterCriticalSection(mutex);
+	#else
+	pthread_mutex_lock(mutex);
+	#endif
+}
+
+static void unlockMutex(RS_Mutex * mutex)
+{
+	#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+	#else
+	pthread_mutex_unlock(mutex);
+	#endif
+}
+
+static void initCond(RS_Cond * cond)
+{
+	#ifdef _WIN32
+	InitializeConditionVariable(cond);
+	#else
+	pthread_cond_init(cond, NULL);
+	#endif
+}
+
+#ifdef _WIN32
+// Win32 condition variables hold nothing to free.
+#define destroyCond(cond)
+#else
+static void destroyCond(RS_Cond * cond)
+{
+	pthread_cond_destroy(cond);
+}
+#endif
+
+static void waitCond(RS_Cond * cond, RS_Mutex * mutex)
+{
+	#ifdef _WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+	#else
+	pthread_cond_wait(cond, mutex);
+	#endif
+}
+
+static void wakeAll(RS_Cond * cond)
+{
+	#ifdef _WIN32
+	WakeAllConditionVariable(cond);
+	#else
+	pthread_cond_broadcast(cond);
+	#endif
+}
+
+/*
+	Stores value in *target and returns what was there, as one
+	atomic step that orders memory both ways.
+*/
+static int exchangeAtomic(int * target, int value)
+{
+	#ifdef _WIN32
+	return (int)InterlockedExchange((volatile LONG *)target, (LONG)value);
+	#else
+	return __atomic_exchange_n(target, value, __ATOMIC_ACQ_REL);
+	#endif
+}
+
+/*
+	Reads *source atomically, seeing everything written before
+	whatever last stored it.
+*/
+static int loadAtomic(int * source)
+{
+	#ifdef _WIN32
+	// Win32 has no plain acquiring load, but a compare-exchange
+	// that never changes anything does the job.
+	return (int)InterlockedCompareExchange((volatile LONG *)source, 0, 0);
+	#else
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+	#endif
+}
+
+/*
+	Returns how many cores are online, or 1 if that can't be told.
+*/
+static unsigned int numCores(void)
+{
+	#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+	#else
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores < 1 ? 1 : (unsigned int)cores;
+	#endif
+}
+
+/*
+	Returns a steady clock reading in seconds, for timing.
+*/
+static double clockSeconds(void)
+{
+	#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart/frequency.QuadPart;
+	#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec+now.tv_nsec/1e9;
+	#endif
+}
 
-// Our handle to the shader object on the GPU.
-static GLuint shader;
 // Source code for the shader program.
 static char * vertSource = "shaders/rendersprite.vert";
 static char * fragSource = "shaders/rendersprite.frag";
+// The loaded shader source, kept around so that variants can be
+// compiled from it as they're needed.
+static char * vertText;
+static char * fragText;
+
+// The feature bits that pick a shader variant. See rendersprite.frag.
+#define RS_VARIANT_CANVAS 1			// Mix with the canvas image.
+#define RS_VARIANT_TINT 2			// Apply the tint.
+#define RS_VARIANT_PALETTE_SHIFT 2	// Two bits: 0, 1 or 2 palettes,
+									// or 3 for a band table.
+#define RS_VARIANT_BANDS 3
+#define RS_VARIANT_SIZE_SHIFT 4		// Two bits: the palette size class.
+#define RS_VARIANT_LINE_OFFSETS 64	// Shift the medium's lines.
+#define RS_NUM_SHADER_VARIANTS 128
 
-// Position of the vertex attributes in the shader.
-static GLuint posAttrib;
-static GLuint uvAttrib;
-
-// Position of the uniform variables in the shader.
-static GLuint canvasFrameOffsetUniform; // 2D vector
-static GLuint mediumFrameOffsetUniform; // 2D vector
-static GLuint canvasFrameSizeUniform; // 2D vector
-static GLuint mediumFrameSizeUniform; // 2D vector
-static GLuint canvasImageSizeUniform; // 2D vector
-static GLuint mediumImageSizeUniform; // 2D vector
-static GLuint rotationUniform; 	// Float
-static GLuint scaleUniform; 	// 2D vector
-static GLuint positionUniform;	// 2D vector
-static GLuint tintUniform;		// 4D vector
-static GLuint mixUniform;		// Float
-static GLuint paletteAKeysUniform;		// 4D vector array
-static GLuint paletteAEntriesUniform;	// 4D vector array
-static GLuint numPaletteAUniform;		// Unsigned integer
-static GLuint paletteBKeysUniform;		// 4D vector array
-static GLuint paletteBEntriesUniform;	// 4D vector array
-static GLuint numPaletteBUniform;	// Unsigned integer
-static GLuint swapHeightUniform;	// Float.
-static GLuint canvasTextureUniform; // Integer, referring to a texture object.
-static GLuint mediumTextureUniform;	// Integer, referring to a texture object.
+// The palette array lengths of each size class. A palette is drawn
+// with the smallest class that holds it.
+static const GLuint paletteSizeClasses[] = {16, 64, RS_MAX_PALETTE_ENTRIES};
+#define RS_NUM_PALETTE_SIZE_CLASSES 3
+
+// Uniform components set aside for everything but the palettes
+// when working out how long the palette arrays can be.
+#define RS_RESERVED_UNIFORM_COMPONENTS 64
+
+// Frames whose hulls would cover more than this much of them
+// are drawn with quads anyway.
+#define RS_HULL_QUAD_COVERAGE .9
+
+/*
+	A compiled variant of the RenderSprite shader, and the
+	locations of everything in it. Locations of things a variant
+	doesn't have are -1, which OpenGL quietly ignores.
+	
+	Members:
+	program (GLuint)			The shader program.
+	paletteCapacity (GLuint)	The length of each palette array.
+	The rest are attribute and uniform locations.
+*/
+typedef struct
+{
+	GLuint program;
+	GLuint paletteCapacity;
+	
+	// Position of the vertex attributes in the shader.
+	GLint posAttrib;
+	GLint uvAttrib;
+	
+	// Position of the uniform variables in the shader.
+	GLint canvasFrameOffsetUniform; // 2D vector
+	GLint mediumFrameOffsetUniform; // 2D vector
+	GLint canvasFrameSizeUniform; // 2D vector
+	GLint mediumFrameSizeUniform; // 2D vector
+	GLint canvasImageSizeUniform; // 2D vector
+	GLint mediumImageSizeUniform; // 2D vector
+	GLint mediumQuadUniform;	// 4D vector
+	GLint mediumTrimUniform;	// 4D vector
+	GLint canvasTrimUniform;	// 4D vector
+	GLint rotationUniform; 	// Float
+	GLint scaleUniform; 	// 2D vector
+	GLint positionUniform;	// 2D vector
+	GLint toScreenUniform;	// Boolean
+	GLint tintUniform;		// 4D vector
+	GLint mixUniform;		// Float
+	GLint paletteAKeysUniform;		// 4D vector array
+	GLint paletteAEntriesUniform;	// 4D vector array
+	GLint numPaletteAUniform;		// Unsigned integer
+	GLint paletteBKeysUniform;		// 4D vector array
+	GLint paletteBEntriesUniform;	// 4D vector array
+	GLint numPaletteBUniform;	// Unsigned integer
+	GLint swapHeightUniform;	// Float.
+	GLint paletteTableUniform;	// Integer, referring to a texture object.
+	GLint paletteBandsUniform;	// Integer, referring to a texture object.
+	GLint bandLinesUniform;		// Float
+	GLint bandsInSpriteUniform;	// Boolean
+	GLint lineOffsetsUniform;	// Integer, referring to a texture object.
+	GLint offsetLinesUniform;	// Float
+	GLint canvasTextureUniform; // Integer, referring to a texture object.
+	GLint mediumTextureUniform;	// Integer, referring to a texture object.
+} RS_Program;
+
+// The low resolution render target screen draws go to, when
+// a virtual resolution is set.
+static RS_Sprite * virtualScreen;
+
+// The target RS_renderBatch() draws jobs in, grown to fit
+// the largest job so far.
+static RS_Sprite * batchTarget;
+
+#ifdef RS_HEADLESS
+// The context RS_initHeadless() made, and the buffer it
+// draws the screen into.
+static OSMesaContext headlessContext;
+static unsigned char * headlessPixels;
+#endif
+
+// Every shader variant, indexed by its feature bits. Each is
+// compiled the first time a draw needs it.
+static RS_Program programs[RS_NUM_SHADER_VARIANTS];
+// The variant the current draw is using.
+static RS_Program * program;
+// How many uniform components fragment shaders get on this driver.
+static GLint maxFragmentUniforms;
 
 // The handle to the GPU-side data buffer storing
 // all the vertex data.
@@ -40,6 +334,88 @@ static GLuint vertexBuffer;
 // the drawing of vertex data in the vertex buffer.
 static GLuint indexBuffer;
 
+// A single transparent black texel, standing in for the image of
+// canvases that don't have one yet.
+static GLuint blankTex;
+
+// Running totals of the texture memory held by every sprite,
+// reported through RS_getMemoryStats().
+static size_t textureBytes;			// Sprite images.
+static size_t attachmentBytes;		// Framebuffer color attachments.
+static size_t deferredAttachmentBytes;	// Attachments not (yet) allocated.
+
+// The texture cache. Images loaded from files are shared between
+// every sprite made from the same file, hashed by their contents.
+static RS_CachedTexture * textureCache[RS_TEXTURE_CACHE_BUCKETS];
+static unsigned int cacheHits;
+static unsigned int cacheMisses;
+static size_t cacheSavedBytes;	// What duplicate uploads would have cost.
+static size_t maskBytes;	// System memory held by alpha masks.
+
+// Fill totals, comparing what draws shaded with hulls against
+// what whole quads would have.
+static double quadPixels;
+static double shadedPixels;
+static unsigned int blits;	// Draws done as plain copies.
+
+// Residency management. Cached textures are kept in a list
+// ordered from most to least recently drawn, and the least recent
+// are evicted when the budget is exceeded.
+static RS_CachedTexture * lruHead;
+static RS_CachedTexture * lruTail;
+static size_t textureBudget;	// Zero means unlimited.
+static unsigned int evictions;
+static unsigned int reloads;
+// Every static layer, so that chunks off screen can be given up
+// to stay within the budget.
+static RS_StaticLayer * staticLayers;
+
+// Each thread reads PNG files into its own scratch buffer, which
+// grows as needed and is reused from one load to the next.
+#ifdef _MSC_VER
+#define RS_THREAD_LOCAL __declspec(thread)
+#else
+#define RS_THREAD_LOCAL __thread
+#endif
+static RS_THREAD_LOCAL unsigned char * scratch;
+static RS_THREAD_LOCAL size_t scratchSize;
+
+/*
+	A sprite image with a palette's color replacements already
+	applied, so it can be drawn without the shader doing them.
+	
+	Members:
+	image (void*)		What the source image is identified by; the
+						cached texture when the image is shared,
+						or else the sprite itself.
+	palette (RS_Palette*)	The palette that was baked in.
+	version (unsigned int)	The version of the palette that was baked.
+	tex (GLuint)		The baked texture, or RS_NULL_TEXTURE if the
+						pair has only been seen once so far.
+	bytes (size_t)		The size of the baked texture.
+	lastUse (unsigned int)	When the variant was last drawn, for LRU.
+*/
+typedef struct
+{
+	void * image;
+	RS_Palette * palette;
+	unsigned int version;
+	GLuint tex;
+	size_t bytes;
+	unsigned int lastUse;
+} RS_BakedPalette;
+
+// Baked palette variants, and the clock used to age them.
+static RS_BakedPalette bakedPalettes[RS_MAX_BAKED_PALETTES];
+static unsigned int bakeClock;
+static unsigned int bakeHits;
+static unsigned int bakeMisses;
+static size_t bakedBytes;
+
+// Every change to a palette gives it a fresh version number
+// from here, so stale bakes can never be mistaken for current.
+static unsigned int paletteVersions;
+
 /*
 	Generates vertex, color, UV, and normal information for a square,
 	inserting it homologated into the given vertex data array. It
@@ -67,18 +443,18 @@ static void generateSquare(GLfloat * vertexData, GLubyte * indexData)
 	// Top right vertex.	
 	vertexData[4] = 1.0;	// X
 	vertexData[5] = 0.0;	// Y
-	vertexData[6] = 0.0;	// U
+	vertexData[6] = 1.0;	// U
 	vertexData[7] = 0.0;	// V
 	// Bottom left vertex.
 	vertexData[8] = 0.0;	// X
 	vertexData[9] = 1.0;	// Y
 	vertexData[10] = 0.0;	// U
-	vertexData[11] = 0.0;	// V
+	vertexData[11] = 1.0;	// V
 	// Bottom right vertex.	
-	vertexData[12] = 0.0;	// X
+	vertexData[12] = 1.0;	// X
 	vertexData[13] = 1.0;	// Y
-	vertexData[14] = 0.0;	// U
-	vertexData[15] = 0.0;	// V
+	vertexData[14] = 1.0;	// U
+	vertexData[15] = 1.0;	// V
 	
 	// This isn't pretty either.
 	indexData[0] = 2;	// Bottom left
@@ -123,58 +499,66 @@ static void initSquare(void)
 }
 
 /*
-	Draws the square that was set up, assuming the existence of a shader,
-	in use when this function is called, with 2D position, 4D color, and 
-	2D UV attributes available.
+	Feeds the position and UV attributes from a vertex buffer laid
+	out like the square's: X, Y, U and V for each vertex.
 */
-static void drawSquare(void)
+static void feedVertexAttributes(GLuint buffer)
 {
-	// Bind to the vertex buffer objects so that they will
-	// be used in place of an explicitly sourced array of data
-	// in glVertexAttribPointer().
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
 
 	// Enable all the vertex attributes so that they will
 	// be usable in the vertex shader.
-	glEnableVertexAttribArray(posAttrib);
-	glEnableVertexAttribArray(uvAttrib);
+	glEnableVertexAttribArray(program->posAttrib);
+	glEnableVertexAttribArray(program->uvAttrib);
 	
 	// Set up data feeding to those vertex attributes.
 	// Remember how we homologated both UV and position
 	// data into the same buffer? Here's where we tell
 	// OpenGL how to dig through it.
-	glVertexAttribPointer(posAttrib, // State which attribute this buffer will be fed to.
+	glVertexAttribPointer(program->posAttrib, // State which attribute this buffer will be fed to.
 						2, 	// Specify the number of components per vertex for this attribute.
 						GL_FLOAT, 	// Specify the type of these components.
 						GL_FALSE, 	// Should these be normalized? Nope.
-						RS_NUM_SQUARE_COMPONENTS*sizeof(GLfloat),	// Byte offset between
+						4*sizeof(GLfloat),	// Byte offset between
 													// consecutive occurrences of this attribute.
 						0);	// "If a non-zero named buffer object is bound to the GL_ARRAY_BUFFER 
 							// target (see glBindBuffer) while a generic vertex attribute array 
 							// is specified, pointer is treated as a byte offset into the buffer
 							// object's data store." (From the OpenGL man pages.)
-	GLint offset = sizeof(GLfloat)*2;
-	glVertexAttribPointer(uvAttrib,
+	glVertexAttribPointer(program->uvAttrib,
 						2,	// This directly how the incoming vectors are set up for the vertex shader.
 						GL_FLOAT,
 						GL_FALSE,	// Normalization is best when dealing with integer data values.
 									// All values are divided by the largest.
-						RS_NUM_SQUARE_COMPONENTS*sizeof(GLfloat), 
-						&offset);	// The number of bytes to traverse to get to the first
+						4*sizeof(GLfloat), 
+						(GLvoid*)(sizeof(GLfloat)*2));	// The number of bytes to traverse to get to the first
 											// occurrence of this attribute in the buffer. Since
 											// we have to over come two floats to pass the first
 											// position...
+}
+
+/*
+	Draws the square that was set up, assuming the existence of a shader,
+	in use when this function is called, with 2D position, 4D color, and 
+	2D UV attributes available.
+*/
+static void drawSquare(void)
+{
+	// Bind to the vertex buffer objects so that they will
+	// be used in place of an explicitly sourced array of data
+	// in glVertexAttribPointer().
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	feedVertexAttributes(vertexBuffer);
 		
 	// Now that buffer feeding is set up, we can tell OpenGL draw the 
 	// geometry. Hopefully the desired shader is being used and all 
 	// desired uniforms are set up by this point.
-	glDrawElements(GL_TRIANGLES, RS_NUM_SQUARE_INDICES, GL_UNSIGNED_BYTE, 0);
+	glDrawElements(GL_TRIANGLE_STRIP, RS_NUM_SQUARE_INDICES, GL_UNSIGNED_BYTE, 0);
 
 	// Now that we're all done with this draw call, we should disable
 	// these attributes to prevent GL state discontinuity.
-	glDisableVertexAttribArray(posAttrib);
-	glDisableVertexAttribArray(uvAttrib);
+	glDisableVertexAttribArray(program->posAttrib);
+	glDisableVertexAttribArray(program->uvAttrib);
 	
 	// Now remember children, unbind so you
 	// don't accidentally do something, and
@@ -186,51 +570,40 @@ static void drawSquare(void)
 }
 
 /*
-	Loads shader source code from the given filename.
+	Loads shader source code from the given filename, returning
+	it as a null-terminated string, or NULL if it couldn't be read.
 */
 static char * loadShaderSource(char * filename)
 {
-	// Create a character to store the next element in the
-	// file.
-	char next;
-	// A counter of how many elements we've loaded.
-	// We start at one for safe keeping of the null
-	// terminator.
-	unsigned int chars = 1;
-	// Create a character array to store the input data.
-	char * elements = calloc(chars, sizeof(int));
+	long length;
+	char * elements;
 	// Open the file.
-	FILE* f = fopen(filename, "r");
+	FILE* f = fopen(filename, "rb");
 	if(f == NULL)
 	{
 		#ifdef RS_DB_ERRORS
 		printf("Could not open shader file\n");
-		return;
 		#endif
+		return NULL;
 	}
-	// Get the first character in the file stream.
-	next = fgetc(f);
-	// While that next character is not the end of
-	// file marker, we...
-	while( next != EOF )
-	{
-		// store the character,
-		elements[chars-1] = next;
-		// and gently expand our storage array.
-		// If this realloc ever fails, things will
-		// crash pretty fast.
-		elements = realloc(elements, ++chars*sizeof(int));
-		//memset(&elements[chars], 0, sizeof(int));
-		// get the new next character.
-		next = fgetc(f);
-	}
+	// Find out how much there is, and read it all in at once,
+	// leaving room for the null terminator.
+	fseek(f, 0, SEEK_END);
+	length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	elements = malloc(length+1);
+	length = fread(elements, 1, length, f);
+	elements[length] = '\0';
+	fclose(f);
 	return elements;
 }
 
 /*
 	Compiles shader and returns a reference to the compiled shader object.
+	The given defines are slipped in right after the source's #version
+	line, which has to stay first.
 */
-static GLint compileShader(const GLchar * source, GLenum type)
+static GLint compileShader(const GLchar * source, const GLchar * defines, GLenum type)
 {
 	// Make sure the user passes a valid shader type.
 	if(type != GL_VERTEX_SHADER && type != GL_FRAGMENT_SHADER)
@@ -238,9 +611,19 @@ static GLint compileShader(const GLchar * source, GLenum type)
 		
 	// Create the shader on the GPU.
 	GLuint shader = glCreateShader(type);
-	// Pass in the shader source.
-	GLint length = strlen(source);
-	glShaderSource(shader, 1, &source, &length);
+	// Pass in the shader source, in three parts: the #version line,
+	// the defines, and then everything else.
+	const GLchar * rest = strchr(source, '\n');
+	rest = rest ? rest+1 : source+strlen(source);
+	const GLchar * parts[3];
+	GLint lengths[3];
+	parts[0] = source;
+	lengths[0] = rest-source;
+	parts[1] = defines;
+	lengths[1] = strlen(defines);
+	parts[2] = rest;
+	lengths[2] = strlen(rest);
+	glShaderSource(shader, 3, parts, lengths);
 	// Compile that shader on the GPU.
 	glCompileShader(shader);
 	
@@ -286,10 +669,11 @@ static GLint linkShaderProgram(GLint vert, GLint frag)
 	
 	// Now that we've tried to link the program, the
 	// shader objects themselves are no longer needed.
-	/*glDetachShader(program, vert);
+	// There'll be dozens of these, so let's not leak them.
+	glDetachShader(program, vert);
 	glDeleteShader(vert);
 	glDetachShader(program, frag);
-	glDeleteShader(frag);*/
+	glDeleteShader(frag);
 	
 	// Report failure.
 	#ifdef RS_DB_ERRORS
@@ -302,29 +686,191 @@ static GLint linkShaderProgram(GLint vert, GLint frag)
 }
 
 /*
-	Loads a vertex and fragment shader from source, compiles, and links
-	them, returning a pointer to the final shader program.
+	Returns the number of bytes a single texel of the given
+	format occupies on the GPU.
 */
-static GLint createShaderProgram(char * vertFile, char * fragFile)
+static size_t formatBytes(GLuint format)
 {
-	// Load shader source code.
-	char * vertSource = loadShaderSource(vertFile);
-	char * fragSource = loadShaderSource(fragFile);
-	
-	// Compile shaders.
-	GLint vert = compileShader(vertSource, GL_VERTEX_SHADER);
-	GLint frag = compileShader(fragSource, GL_FRAGMENT_SHADER);
+	switch(format)
+	{
+		case RS_LUMINANCE: return 1;
+		case RS_LUMINANCE_ALPHA: return 2;
+		case RS_RGB: return 3;
+		default: return 4;
+	}
+}
+
+/*
+	Returns the number of bytes an image of the given size and
+	format occupies on the GPU.
+*/
+static size_t numTexelBytes(GLuint width, GLuint height, GLuint format)
+{
+	return (size_t)width*height*formatBytes(format);
+}
+
+/*
+	Returns a storage format the driver can actually provide, in
+	place of the one asked for. Compressed formats need their
+	extensions, and fall back to the image's own format.
+*/
+static GLuint usableStore(GLuint store)
+{
+	int supported;
+	switch(store)
+	{
+		case RS_STORE_DXT1:
+		case RS_STORE_DXT5: supported = GLEW_EXT_texture_compression_s3tc; break;
+		case RS_STORE_BPTC: supported = GLEW_ARB_texture_compression_bptc; break;
+		default: supported = store < RS_NUM_STORES;
+	}
+	#ifdef RS_DB_ERRORS
+	if(!supported)
+		printf("Storage format %u is unsupported; keeping images as decoded.\n", store);
+	#endif
+	return supported ? store : RS_STORE_NATIVE;
+}
+
+/*
+	Returns 1 if images kept with the given storage sample back
+	with the colors they were decoded with, so palette keys still
+	match. Packed, mask and compressed stores all round colors off.
+*/
+static int storeKeepsColors(GLuint store)
+{
+	return store == RS_STORE_NATIVE || store == RS_STORE_RGBA8 || store == RS_STORE_RGB8;
+}
+
+/*
+	Returns the internal format an image of the given format is
+	kept in on the GPU, with the given storage.
+*/
+static GLuint storeInternalFormat(GLuint format, GLuint store)
+{
+	switch(store)
+	{
+		case RS_STORE_RGBA8: return GL_RGBA8;
+		case RS_STORE_RGB8: return GL_RGB8;
+		case RS_STORE_RGB5_A1: return GL_RGB5_A1;
+		case RS_STORE_RGBA4: return GL_RGBA4;
+		case RS_STORE_ALPHA8: return GL_ALPHA8;
+		case RS_STORE_DXT1: return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+		case RS_STORE_DXT5: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		case RS_STORE_BPTC: return GL_COMPRESSED_RGBA_BPTC_UNORM_ARB;
+		default: return format;
+	}
+}
+
+/*
+	Returns the number of bytes an image of the given size and
+	format occupies on the GPU with the given storage. Compressed
+	images are stored in whole 4x4 blocks.
+*/
+static size_t storedTexelBytes(GLuint width, GLuint height, GLuint format, GLuint store)
+{
+	size_t blocks = (size_t)((width+3)/4)*((height+3)/4);
+	switch(store)
+	{
+		case RS_STORE_RGBA8: return numTexelBytes(width, height, RS_RGBA);
+		case RS_STORE_RGB8: return numTexelBytes(width, height, RS_RGB);
+		case RS_STORE_RGB5_A1:
+		case RS_STORE_RGBA4: return (size_t)width*height*2;
+		case RS_STORE_ALPHA8: return (size_t)width*height;
+		case RS_STORE_DXT1: return blocks*8;
+		case RS_STORE_DXT5:
+		case RS_STORE_BPTC: return blocks*16;
+		default: return numTexelBytes(width, height, format);
+	}
+}
+
+/*
+	Reads a texel of any of the decoded formats as RGBA.
+*/
+static void texelRGBA(unsigned char * texel, GLuint format, unsigned char * rgba)
+{
+	switch(format)
+	{
+		case RS_LUMINANCE:
+			rgba[0] = rgba[1] = rgba[2] = texel[0];
+			rgba[3] = 255;
+			break;
+		case RS_LUMINANCE_ALPHA:
+			rgba[0] = rgba[1] = rgba[2] = texel[0];
+			rgba[3] = texel[1];
+			break;
+		case RS_RGB:
+			rgba[0] = texel[0];
+			rgba[1] = texel[1];
+			rgba[2] = texel[2];
+			rgba[3] = 255;
+			break;
+		default:
+			rgba[0] = texel[0];
+			rgba[1] = texel[1];
+			rgba[2] = texel[2];
+			rgba[3] = texel[3];
+	}
+}
+
+/*
+	Converts decoded image data into what gets uploaded for the
+	given storage, so the driver has nothing left to convert.
+	16-bit storage is packed here, and alpha masks keep only the
+	alpha term. Everything else is uploaded as decoded. Returns
+	the data to upload, which the caller frees if it isn't the
+	data it passed in.
+*/
+static unsigned char * convertForStore(unsigned char * data, GLuint width, GLuint height, GLuint format, GLuint store,
+									GLuint * uploadFormat, GLuint * uploadType)
+{
+	size_t i, n = (size_t)width*height;
+	GLuint texelBytes = formatBytes(format);
+	unsigned char rgba[4];
+	*uploadFormat = format;
+	*uploadType = GL_UNSIGNED_BYTE;
+	if(!data) return data;
 	
-	// Link together the shader program and return it.
-	return linkShaderProgram(vert, frag);
+	if(store == RS_STORE_RGB5_A1 || store == RS_STORE_RGBA4)
+	{
+		GLushort * packed = malloc(n*sizeof(GLushort));
+		for(i = 0; i < n; i++)
+		{
+			texelRGBA(&data[i*texelBytes], format, rgba);
+			if(store == RS_STORE_RGB5_A1)
+				packed[i] = (GLushort)(((rgba[0]*31+127)/255) << 11 | ((rgba[1]*31+127)/255) << 6 |
+										((rgba[2]*31+127)/255) << 1 | (rgba[3] >= 128));
+			else
+				packed[i] = (GLushort)(((rgba[0]*15+127)/255) << 12 | ((rgba[1]*15+127)/255) << 8 |
+										((rgba[2]*15+127)/255) << 4 | ((rgba[3]*15+127)/255));
+		}
+		*uploadFormat = GL_RGBA;
+		*uploadType = store == RS_STORE_RGB5_A1 ? GL_UNSIGNED_SHORT_5_5_5_1 : GL_UNSIGNED_SHORT_4_4_4_4;
+		return (unsigned char *)packed;
+	}
+	if(store == RS_STORE_ALPHA8)
+	{
+		unsigned char * alpha = malloc(n);
+		for(i = 0; i < n; i++)
+		{
+			texelRGBA(&data[i*texelBytes], format, rgba);
+			alpha[i] = rgba[3];
+		}
+		*uploadFormat = GL_ALPHA;
+		return alpha;
+	}
+	return data;
 }
 
 /*
-	Generates a texture object for the given instance
-	of RS_Sprite.
+	Generates a texture object for an image of the given format,
+	kept on the GPU with the given storage.
 */
-static void generateTexture(GLuint * textureHandle, GLuint width, GLuint height, GLuint format, unsigned char * data)
+static void generateStoredTexture(GLuint * textureHandle, GLuint width, GLuint height, GLuint format, GLuint store,
+								unsigned char * data)
 {
+	GLuint uploadFormat, uploadType;
+	unsigned char * upload = convertForStore(data, width, height, format, store, &uploadFormat, &uploadType);
+
 	// Initialize that texture that will be used
 	// as the color buffer of the new framebuffer.
 	glGenTextures(1, textureHandle);
@@ -333,16 +879,21 @@ static void generateTexture(GLuint * textureHandle, GLuint width, GLuint height,
 	// GL_TEXTURE_2D so we can do dirty stuff to it.
 	glBindTexture(GL_TEXTURE_2D, *textureHandle);
 
+	// Rows of RGB, luminance or alpha texels aren't necessarily
+	// 4-byte aligned.
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	
 	// Format the texture image itself.
 	glTexImage2D(GL_TEXTURE_2D, // Which texture buffer to use.
 				0, 				// L.O.D.
-				format, 		// Internal pixel format the texture shall use.
+				storeInternalFormat(format, store),	// Internal pixel format the texture shall use.
 				width, 			// The width of the texture.
 				height, 		// The height of the texture.
 				0, 				// Border width. Always 0.
-				format, 		// The pixel format of the incoming data.
-				GL_FLOAT,		// The type of each color term being received.
-				data);			// The image data itself.
+				uploadFormat, 	// The pixel format of the incoming data.
+				uploadType,		// The type of each color term being received.
+				upload);		// The image data itself.
+	if(upload != data) free(upload);
 
 	// AH YEAH OOH AHH YOU TAKE THOSE 
 	// NO-MIPMAP TEXTURE PARAMETERS.
@@ -363,6 +914,15 @@ static void generateTexture(GLuint * textureHandle, GLuint width, GLuint height,
 	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
 }
 
+/*
+	Generates a texture object for the given instance
+	of RS_Sprite.
+*/
+static void generateTexture(GLuint * textureHandle, GLuint width, GLuint height, GLuint format, unsigned char * data)
+{
+	generateStoredTexture(textureHandle, width, height, format, RS_STORE_NATIVE, data);
+}
+
 /*
 	Resizes a texture object.
 */
@@ -409,748 +969,5052 @@ static void generateFramebuffer(GLuint * fboHandle, GLuint * textureHandle)
 }
 
 /*
-	Initializes the RenderSprite shader program, and retrieves
-	all attribute and uniform locations from it.
+	Returns the format a framebuffer attachment for an image of
+	the given format should have. Luminance textures can't be
+	rendered to, so they get promoted to color.
 */
-static void initShaders(void)
+static GLuint renderableFormat(GLuint format)
 {
-	// Create the shader program.
-	shader = createShaderProgram(vertSource, fragSource);
-	
-	// OH DEAR LAWDY THESE POSITION QUERIES.
-	posAttrib = glGetAttribLocation(shader, "vertPosition");
-	uvAttrib = glGetAttribLocation(shader, "vertUV");
-	canvasFrameOffsetUniform = glGetUniformLocation(shader, "canvasFrameOffset");
-	canvasFrameSizeUniform = glGetUniformLocation(shader, "canvasFrameSize");
-	canvasImageSizeUniform = glGetUniformLocation(shader, "canvasImageSize");
-	mediumFrameOffsetUniform = glGetUniformLocation(shader, "mediumFrameOffset");
-	mediumFrameSizeUniform = glGetUniformLocation(shader, "mediumFrameSize");
-	mediumImageSizeUniform = glGetUniformLocation(shader, "mediumImageSize");
-	rotationUniform = glGetUniformLocation(shader, "rotation"); 	
-	scaleUniform = glGetUniformLocation(shader, "scale"); 	
-	positionUniform = glGetUniformLocation(shader, "position");	
-	tintUniform = glGetUniformLocation(shader, "tint");		
-	mixUniform = glGetUniformLocation(shader, "canvasMediumMix");
-	paletteAKeysUniform = glGetUniformLocation(shader, "paletteAKeys");	
-	paletteAEntriesUniform = glGetUniformLocation(shader, "paletteAEntries");	
-	numPaletteAUniform = glGetUniformLocation(shader, "numPaletteA");	
-	paletteBKeysUniform = glGetUniformLocation(shader, "paletteBKeys");	
-	paletteBEntriesUniform = glGetUniformLocation(shader, "paletteBEntries");	
-	numPaletteBUniform = glGetUniformLocation(shader, "numPaletteB");	
-	swapHeightUniform = glGetUniformLocation(shader, "swapHeight");
-	canvasTextureUniform = glGetUniformLocation(shader, "canvas");
-	mediumTextureUniform = glGetUniformLocation(shader, "medium");
+	if(format == RS_LUMINANCE) return RS_RGB;
+	if(format == RS_LUMINANCE_ALPHA) return RS_RGBA;
+	return format;
 }
 
 /*
-	Initializes GLEW, and other libraries if need occurs.
-	Returns 1 if everything checks out.
+	Returns the number of bytes the sprite's framebuffer
+	attachment occupies, or would occupy if it were allocated.
 */
-static int initLibraries(void)
+static size_t spriteAttachmentBytes(RS_Sprite * sprite)
 {
-	// Initialize GLEW, storing its return status.
-	GLenum err = glewInit();
-	// If we ain't good, we do something about it.
-	if(err != GLEW_OK)
-	{
-		#ifdef RS_DB_ERRORS
-		printf("Error initializing GLEW%s\n.", glewGetErrorString(err));
-		#endif
-		return 0;
-	}
-	// We really need to make sure we have framebuffers.
-	if(!GLEW_EXT_framebuffer_object)
-	{
-		#ifdef RS_DB_ERRORS
-		printf("Error: no framebuffer capability.\n");
-		#endif
-		return 0;
-	}
-	// And a programmable pipeline.
-	if(!GLEW_VERSION_2_0)
-	{
-		#ifdef RS_DB_ERRORS
-		printf("Error: OpenGL version < 2.0. No programmable pipeline.\n");
-		#endif
-		return 0;
-	}
-	fprintf(stdout, "Status: Using GLEW %s\n", glewGetString(GLEW_VERSION));
-	return 1;
+	return (size_t)sprite->width*sprite->height*formatBytes(renderableFormat(sprite->format));
 }
 
-void RS_init(void)
+/*
+	Returns the number of bytes the sprite's image texture
+	occupies. Shared images are counted in full.
+*/
+static size_t spriteTextureBytes(RS_Sprite * sprite)
 {
-	// Initialize GLEW.
-	initLibraries();
-	// Initialize the rendering square.
-	initSquare();
-	// Initialize the shader program and its position constants.
-	initShaders();
+	// A shared image's handle lives in the cache; the sprite's
+	// copy of it may be stale.
+	GLuint tex = sprite->image ? sprite->image->tex : sprite->tex;
+	if(tex == RS_NULL_TEXTURE) return 0;
+	return storedTexelBytes(sprite->imageWidth, sprite->imageHeight, sprite->format,
+							sprite->image ? sprite->image->store : RS_STORE_NATIVE);
 }
 
-void RS_deInit(void)
+/*
+	Makes sure the sprite has a framebuffer and color attachment
+	to render into. Most sprites are never rendered to, so these
+	are only created the first time something actually needs them.
+*/
+static void requireFramebuffer(RS_Sprite * sprite)
 {
-	glDeleteBuffers(1, &vertexBuffer);
-	glDeleteBuffers(1, &indexBuffer);
-	glDeleteProgram(shader);
+	// Already have one? Good.
+	if(sprite->fbo != RS_NULL_FBO) return;
+	
+	// Create the color attachment, then wrap a framebuffer around it.
+	generateTexture(&sprite->att, sprite->width, sprite->height, renderableFormat(sprite->format), NULL);
+	generateFramebuffer(&sprite->fbo, &sprite->att);
+	
+	// Move the attachment's bytes from the deferred column
+	// to the allocated one.
+	deferredAttachmentBytes -= spriteAttachmentBytes(sprite);
+	attachmentBytes += spriteAttachmentBytes(sprite);
 }
 
-static RS_Sprite * generateRawSprite(void)
-{	
-	// Allocate an RS_Sprite-sized hunk of memory.
-	RS_Sprite * sprite = malloc(sizeof(RS_Sprite));
-	// Set up the transformation and animation variables.
-	sprite->frameOffsetX = 0;
-	sprite->frameOffsetY = 0;
-	sprite->rotation = 0.0;
-	sprite->posX = 0;
-	sprite->posY = 0;
-	sprite->scaleX = 1.0;
-	sprite->scaleY = 1.0;
-	sprite->tint = NULL;
-	sprite->paletteA = NULL;
-	sprite->paletteB = NULL;
-	sprite->swapHeight = 0;
-	// Return the sprite.
-	return sprite;
-}
-
-RS_Sprite * RS_mkEmptySprite(GLuint width, GLuint height, GLuint format)
+/*
+	Deletes a framebuffer an image is read through for copies,
+	if one was ever made.
+*/
+static void releaseReadFramebuffer(GLuint * fbo)
 {
-	// Create a raw, nubile RS_Sprite for prep.
-	RS_Sprite * sprite = generateRawSprite();
-	
-	// Store the width and height and format of the sprite.
-	sprite->width = width;
-	sprite->imageWidth = width;
-	sprite->imageHeight = height;
-	sprite->height = height;
-	
-	// Generate the texture object for this sprite.
-	generateTexture(&sprite->tex, 2, 2, format, NULL);
-	generateTexture(&sprite->att, sprite->width, sprite->height, format, NULL);
-	
-	// Generate the framebuffer object for this sprite,
-	// using the sprite's texture as the FBO's color
-	// attachment.
-	generateFramebuffer(&sprite->fbo, &sprite->att);
-	
-	return sprite;
+	if(*fbo == RS_NULL_FBO) return;
+	glDeleteFramebuffersEXT(1, fbo);
+	*fbo = RS_NULL_FBO;
 }
 
-RS_Sprite * RS_mkSpriteFromPNG(char * filename)
+/*
+	Frees a baked palette variant's slot.
+*/
+static void clearBakedPalette(RS_BakedPalette * baked)
 {
-	// Create a pointer to reference data loaded by LoadPNG.
-	unsigned char * imageData;
-	
-	// Create an instance of RS_Sprite.
-	RS_Sprite * sprite = generateRawSprite();
-	
-	// Load the image, storing any potential error.
-	unsigned lodePngError = lodepng_decode32_file(&imageData,
-												&sprite->imageWidth,
-												&sprite->imageHeight,
-												filename);
-	// Since we proportedly just loaded a 32-bit RGBA image,
-	// we set the format of the sprite to RGBA.
-	sprite->format = RS_RGBA;
-	
-	// If something happens we just assume for the first try
-	// that it was an error with the bit depth.
-	if(lodePngError)
-	{
-		lodePngError = lodepng_decode24_file(&imageData,
-											&sprite->imageWidth,
-											&sprite->imageHeight,
-											filename);
-		sprite->format = RS_RGB;
-	}
-	
-	// If there's still something wrong, well poop.
-	if(lodePngError)
+	if(baked->tex != RS_NULL_TEXTURE)
 	{
-		#ifdef RS_DB_ERRORS
-		fprintf(stderr, 
-				"Error loading PNG %d: %s", 
-				lodePngError, 
-				lodepng_error_text(lodePngError));
-		#endif
-		return NULL;
+		glDeleteTextures(1, &baked->tex);
+		bakedBytes -= baked->bytes;
 	}
-	sprite->width = sprite->imageWidth;
-	sprite->height = sprite->imageHeight;
-	
-	// Generate the sprite's texture object and store the
-	// loaded image date in it.
-	generateTexture(&sprite->tex, sprite->width, sprite->height, sprite->format, imageData);
-	generateTexture(&sprite->att, sprite->width, sprite->height, sprite->format, NULL);
-	
-	// Get rid of our copy of the image, since we don't need
-	// it any more.
-	free(imageData);
-	
-	// Create the sprite's framebuffer.
-	generateFramebuffer(&sprite->fbo, &sprite->att);
-	
-	// At long last!
-	return sprite;
+	memset(baked, 0, sizeof(RS_BakedPalette));
 }
 
-RS_Sprite * RS_mkAnimatedSpriteFromPNG(char * filename, GLuint frameWidth, GLuint frameHeight)
+/*
+	Forgets every baked variant made with the given palette.
+	Called whenever the palette changes or is deleted.
+*/
+static void forgetPaletteBakes(RS_Palette * palette)
 {
-	unsigned char * imageData;
-	RS_Sprite * sprite = generateRawSprite();
-	unsigned lodePngError = lodepng_decode32_file(&imageData,
-												&sprite->imageWidth,
-												&sprite->imageHeight,
-												filename);
-	sprite->format = RS_RGBA;
-	if(lodePngError)
-	{
-		lodePngError = lodepng_decode24_file(&imageData,
-											&sprite->imageWidth,
-											&sprite->imageHeight,
-											filename);
-		sprite->format = RS_RGB;
-	}
-	if(lodePngError)
-	{
-		#ifdef RS_DB_ERRORS
-		fprintf(stderr, 
-				"Error loading PNG %d: %s", 
-				lodePngError, 
-				lodepng_error_text(lodePngError));
-		#endif
-		return NULL;
-	}
-	
-	sprite->width = frameWidth;
-	sprite->height = frameHeight;
-	
-	// Store the image in the sprite's texture, 
-	// but keep the framebuffer the size of a single frame.
-	generateTexture(&sprite->tex, sprite->imageWidth, sprite->imageHeight, sprite->format, imageData);
-	generateTexture(&sprite->att, sprite->width, sprite->height, sprite->format, NULL);
-	free(imageData);
-	generateFramebuffer(&sprite->fbo, &sprite->att);
-	return sprite;
+	unsigned int i;
+	for(i = 0; i < RS_MAX_BAKED_PALETTES; i++)
+		if(bakedPalettes[i].palette == palette)
+			clearBakedPalette(&bakedPalettes[i]);
 }
 
-void RS_deleteSprite(RS_Sprite * sprite)
+/*
+	Forgets every baked variant made from the given image.
+	Called when the image is deleted for good.
+*/
+static void forgetImageBakes(void * image)
 {
-	// Delete FBO.
-	glDeleteFramebuffers(1, &sprite->fbo);
-	// Delete texture objects.
-	glDeleteTextures(1, &sprite->tex);
-	glDeleteTextures(1, &sprite->att);
-	// Free the structure. Bye bye!
-	free(sprite);
+	unsigned int i;
+	for(i = 0; i < RS_MAX_BAKED_PALETTES; i++)
+		if(bakedPalettes[i].image == image)
+			clearBakedPalette(&bakedPalettes[i]);
 }
 
-RS_Color * RS_mkColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+/*
+	Gives a palette a new version, dropping whatever was baked
+	with the old one.
+*/
+static void touchPalette(RS_Palette * palette)
 {
-	RS_Color *color = malloc(sizeof(RS_Color));
-	
-	color->r = r;
-	color->g = g;
-	color->b = b;
-	color->a = a;
+	palette->version = ++paletteVersions;
+	forgetPaletteBakes(palette);
 }
 
-void RS_deleteColor(RS_Color * color)
+/*
+	Converts a color term in [0, 1] to the 8-bit value it would
+	have to be stored as to compare equal to it in the fragment
+	shader. Returns -1 if no 8-bit value is close enough.
+*/
+static int colorTermByte(GLfloat term)
 {
-	free(color);
+	int value = (int)(term*255.0f+0.5f);
+	GLfloat difference = value/255.0f-term;
+	if(value < 0 || value > 255) return -1;
+	if(difference > RS_SWAP_SENSITIVITY || difference < -RS_SWAP_SENSITIVITY) return -1;
+	return value;
 }
 
-RS_Palette * RS_mkPalette(RS_Color ** keys, RS_Color ** entries, unsigned int numPairs)
+/*
+	Packs four color terms into four bytes in texel order, clamping
+	and rounding each term.
+*/
+static unsigned int packColor(const GLfloat * color)
 {
-	RS_Palette *p = malloc(sizeof(RS_Palette));
-	p->keys = keys;
-	p->entries = entries;
-	p->num = numPairs;
-	return p;
+	unsigned char bytes[4];
+	unsigned int i, packed;
+	for(i = 0; i < 4; i++)
+	{
+		GLfloat term = color[i];
+		if(term < 0.0f) term = 0.0f;
+		if(term > 1.0f) term = 1.0f;
+		bytes[i] = (unsigned char)(term*255.0f+0.5f);
+	}
+	memcpy(&packed, bytes, 4);
+	return packed;
 }
 
-void RS_scrubPalette(RS_Palette * palette)
+/*
+	Applies a palette's color replacements to an array of RGBA
+	texels, the same way the fragment shader would: each texel
+	matching a key becomes the entry of the first key it matches.
+	Keys are hashed by their packed texel value, so each texel
+	costs one lookup rather than a walk through every key.
+*/
+static void remapTexels(unsigned int * texels, size_t numTexels, RS_Palette * palette)
 {
-	unsigned int i;
+	// Twice the maximum number of keys, so probes stay short.
+	unsigned int keys[RS_MAX_PALETTE_ENTRIES*2];
+	unsigned int entries[RS_MAX_PALETTE_ENTRIES*2];
+	unsigned char used[RS_MAX_PALETTE_ENTRIES*2];
+	unsigned int i, mask = RS_MAX_PALETTE_ENTRIES*2-1;
+	size_t t;
+	memset(used, 0, sizeof(used));
+	
 	for(i = 0; i < palette->num; i++)
 	{
-		RS_deleteColor(palette->keys[i]);
-		RS_deleteColor(palette->entries[i]);
+		const GLfloat * key = &palette->keyTerms[i*4];
+		int r = colorTermByte(key[0]), g = colorTermByte(key[1]);
+		int b = colorTermByte(key[2]), a = colorTermByte(key[3]);
+		unsigned char bytes[4];
+		unsigned int packed, slot;
+		// A key no texel can match may as well not be there.
+		if(r < 0 || g < 0 || b < 0 || a < 0) continue;
+		bytes[0] = r; bytes[1] = g; bytes[2] = b; bytes[3] = a;
+		memcpy(&packed, bytes, 4);
+		
+		slot = (packed*2654435761u) >> 23 & mask;
+		while(used[slot] && keys[slot] != packed) slot = (slot+1) & mask;
+		// The first key wins, just like in the shader.
+		if(used[slot]) continue;
+		used[slot] = 1;
+		keys[slot] = packed;
+		entries[slot] = packColor(&palette->entryTerms[i*4]);
+	}
+	
+	for(t = 0; t < numTexels; t++)
+	{
+		unsigned int slot = (texels[t]*2654435761u) >> 23 & mask;
+		while(used[slot])
+		{
+			if(keys[slot] == texels[t])
+			{
+				texels[t] = entries[slot];
+				break;
+			}
+			slot = (slot+1) & mask;
+		}
 	}
-	palette->num = 0;
-	palette->keys = realloc(palette->keys, sizeof(RS_Color*));
-	palette->entries = realloc(palette->entries, sizeof(RS_Color*));
 }
 
-void RS_deletePalette(RS_Palette * palette)
+/*
+	Reads a texture of one of the decoded formats back off the GPU
+	as RGBA8. Asking for RGBA outright would turn luminance into
+	red, so the texels come back in their own format and are
+	expanded here. The caller frees the result.
+*/
+static unsigned char * readImageRGBA(GLuint tex, GLuint width, GLuint height, GLuint format)
 {
-	free(palette);
+	size_t i = (size_t)width*height;
+	GLuint texelBytes = formatBytes(format);
+	unsigned char * texels = malloc(i ? i*4 : 4);
+	unsigned char rgba[4];
+	
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glGetTexImage(GL_TEXTURE_2D, 0, format, GL_UNSIGNED_BYTE, texels);
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+	
+	// Back to front, so nothing is overwritten before it's read.
+	if(format != RS_RGBA)
+		while(i-- > 0)
+		{
+			texelRGBA(&texels[i*texelBytes], format, rgba);
+			memcpy(&texels[i*4], rgba, 4);
+		}
+	return texels;
 }
 
-void RS_setRotation(RS_Sprite * sprite, GLfloat rads)
+/*
+	Bakes a palette into a copy of a sprite's image, returning
+	the handle of the new texture.
+*/
+static GLuint bakePalette(RS_Sprite * sprite, RS_Palette * palette)
 {
-	sprite->rotation = rads;
+	GLuint tex;
+	size_t numTexels = (size_t)sprite->imageWidth*sprite->imageHeight;
+	
+	// Pull the image back off the GPU. This only happens once
+	// per variant, so the stall is worth it.
+	unsigned int * texels = (unsigned int *)readImageRGBA(sprite->tex, sprite->imageWidth,
+														sprite->imageHeight, sprite->format);
+	
+	remapTexels(texels, numTexels, palette);
+	generateTexture(&tex, sprite->imageWidth, sprite->imageHeight, RS_RGBA, (unsigned char *)texels);
+	free(texels);
+	return tex;
 }
 
-void RS_setScale(RS_Sprite * sprite, GLfloat x, GLfloat y)
+/*
+	Returns the texture of a baked variant of the sprite's image
+	with its palette applied, or RS_NULL_TEXTURE if there isn't one
+	and the palette has to be applied in the shader.
+	
+	Only sprites with a single palette are baked; with two, the
+	choice between them depends on where the sprite lands on the
+	screen. Images kept in compact storage aren't baked either. A
+	variant is baked the second time it's drawn with the same
+	palette version, so palettes that change every frame never
+	waste time being baked.
+*/
+static GLuint bakedPaletteFor(RS_Sprite * sprite)
 {
-	sprite->scaleX = x;
-	sprite->scaleY = y;
+	RS_Palette * palette;
+	RS_BakedPalette * slot = NULL;
+	void * image = sprite->image ? (void *)sprite->image : (void *)sprite;
+	unsigned int i;
+	
+	// Which palette, if just one? Band tables change from
+	// line to line, so they're never baked either.
+	if(sprite->paletteBands) return RS_NULL_TEXTURE;
+	if(sprite->paletteA && sprite->paletteB) return RS_NULL_TEXTURE;
+	palette = sprite->paletteA ? sprite->paletteA : sprite->paletteB;
+	if(!palette || palette->num == 0 || sprite->tex == RS_NULL_TEXTURE)
+		return RS_NULL_TEXTURE;
+	// Compact storage loses the exact texels a bake reads back,
+	// so those images keep to the shader.
+	if(sprite->image && sprite->image->store != RS_STORE_NATIVE)
+		return RS_NULL_TEXTURE;
+	
+	++bakeClock;
+	for(i = 0; i < RS_MAX_BAKED_PALETTES; i++)
+	{
+		RS_BakedPalette * baked = &bakedPalettes[i];
+		if(baked->image == image && baked->palette == palette && baked->version == palette->version)
+		{
+			baked->lastUse = bakeClock;
+			if(baked->tex == RS_NULL_TEXTURE)
+			{
+				size_t bytes = numTexelBytes(sprite->imageWidth, sprite->imageHeight, RS_RGBA);
+				++bakeMisses;
+				// A bake is only a shortcut, so it never pushes the
+				// library over its budget.
+				if(textureBudget && textureBytes+attachmentBytes+bakedBytes+bytes > textureBudget)
+					return RS_NULL_TEXTURE;
+				// Second sighting. Bake it.
+				baked->tex = bakePalette(sprite, palette);
+				baked->bytes = bytes;
+				bakedBytes += baked->bytes;
+			}
+			else
+				++bakeHits;
+			return baked->tex;
+		}
+		// Keep track of the least recently used slot on the way.
+		if(!slot || baked->lastUse < slot->lastUse)
+			slot = baked;
+	}
+	
+	// First sighting. Take over the stalest slot to remember it.
+	++bakeMisses;
+	clearBakedPalette(slot);
+	slot->image = image;
+	slot->palette = palette;
+	slot->version = palette->version;
+	slot->lastUse = bakeClock;
+	return RS_NULL_TEXTURE;
 }
 
-void RS_setPosition(RS_Sprite * sprite, GLint x, GLint y)
+/*
+	Works out the size of one level of a sprite's LOD chain. Each
+	level halves the frames of the one before, rounding up, and lays
+	them out on the same grid, so frames never share texels.
+	
+	Parameters:
+		width, height (GLuint): The full size frame size.
+		imageWidth, imageHeight (GLuint): The full size image size.
+		level (GLuint): The level, from 1.
+		frameWidth, frameHeight (GLuint*): Receive the level's frame size.
+		levelWidth, levelHeight (GLuint*): Receive the level's image size.
+*/
+static void lodSize(GLuint width, GLuint height, GLuint imageWidth, GLuint imageHeight, GLuint level,
+					GLuint * frameWidth, GLuint * frameHeight, GLuint * levelWidth, GLuint * levelHeight)
 {
-	sprite->posX = x;
-	sprite->posY = y;
+	GLuint w = width, h = height, i;
+	for(i = 0; i < level; i++)
+	{
+		w = (w+1)/2;
+		h = (h+1)/2;
+	}
+	*frameWidth = w;
+	*frameHeight = h;
+	// An empty frame has no levels to speak of.
+	*levelWidth = width ? w*(imageWidth/width) : 0;
+	*levelHeight = height ? h*(imageHeight/height) : 0;
 }
 
-void RS_setTint(RS_Sprite * sprite, RS_Color * tint)
+/*
+	Returns the bytes held by an LOD chain of the given number of
+	levels, for frames and an image of the given full size.
+*/
+static size_t lodChainBytes(GLuint width, GLuint height, GLuint imageWidth, GLuint imageHeight, GLuint levels)
 {
-	sprite->tint = tint;
+	size_t bytes = 0;
+	GLuint level, fw, fh, iw, ih;
+	for(level = 1; level <= levels; level++)
+	{
+		lodSize(width, height, imageWidth, imageHeight, level, &fw, &fh, &iw, &ih);
+		bytes += numTexelBytes(iw, ih, RS_RGBA);
+	}
+	return bytes;
 }
 
-void RS_setSwapHeight(RS_Sprite * sprite, GLint height)
+/*
+	Returns a sprite's LOD chain. Sprites sharing a cached image
+	share its chain too; others keep their own.
+*/
+static GLuint * spriteLODs(RS_Sprite * sprite)
 {
-	sprite->swapHeight = height;
+	return sprite->image ? sprite->image->lods : sprite->lods;
 }
 
-void RS_setPaletteA(RS_Sprite * sprite, RS_Palette * palette)
+/*
+	Returns how many levels a sprite's LOD chain has.
+*/
+static GLuint spriteNumLODs(RS_Sprite * sprite)
 {
-	sprite->paletteA = palette;
+	return sprite->image ? sprite->image->numLODs : sprite->numLODs;
 }
 
-void RS_setPaletteB(RS_Sprite * sprite, RS_Palette * palette)
+/*
+	Returns the alpha mask of a sprite's image, or NULL if it has
+	none. Cached images keep theirs in the cache; images loaded
+	from memory keep their own.
+*/
+static const uint64_t * spriteMask(RS_Sprite * sprite, GLuint * stride)
 {
-	sprite->paletteB = palette;
+	if(sprite->image)
+	{
+		*stride = sprite->image->maskStride;
+		return sprite->image->mask;
+	}
+	*stride = sprite->maskStride;
+	return sprite->mask;
 }
 
-void RS_clearTransforms(RS_Sprite * sprite)
+/*
+	Returns the bytes held on the GPU by the LOD chain a sprite
+	draws with. A cached image's chain goes with the image, so
+	there's nothing while it is evicted.
+*/
+static size_t spriteLODBytes(RS_Sprite * sprite)
 {
-	// zero out all the things.
-	sprite->rotation = 0.0;
-	sprite->posX = 0;
-	sprite->posY = 0;
-	sprite->scaleX = 1.0;
-	sprite->scaleY = 1.0;
-	sprite->tint = NULL;
+	if(sprite->image && sprite->image->tex == RS_NULL_TEXTURE) return 0;
+	return lodChainBytes(sprite->width, sprite->height, sprite->imageWidth, sprite->imageHeight,
+						spriteNumLODs(sprite));
 }
-	
+
 /*
-	Updates the color replacement uniforms.
+	Halves an RGBA image one frame at a time. Each texel of the
+	result takes the most common color of the up to four texels it
+	covers within its frame, ties going to the more opaque. Unlike
+	averaging, this never invents colors, so palette keys still
+	match and edges stay crisp. Fully transparent texels all count
+	as the same color.
 */
-static void updateColorSwapUniforms(RS_Sprite * sprite)
+static void downsampleFrames(const unsigned int * src, GLuint srcFrameWidth, GLuint srcFrameHeight,
+							unsigned int * dst, GLuint dstFrameWidth, GLuint dstFrameHeight,
+							GLuint framesX, GLuint framesY)
 {
-	if(sprite->paletteA)
+	GLuint srcWidth = srcFrameWidth*framesX, dstWidth = dstFrameWidth*framesX;
+	GLuint fx, fy, x, y, i, j;
+	for(fy = 0; fy < framesY; fy++)
+	for(fx = 0; fx < framesX; fx++)
+	for(y = 0; y < dstFrameHeight; y++)
+	for(x = 0; x < dstFrameWidth; x++)
 	{
-		// Since we can't feed the GPU raw RS_Colors, we have to unpack the
-		// color pairs.
-		GLfloat * paletteAKeyTerms = malloc(sizeof(GLfloat)*sprite->paletteA->num*4);
-		GLfloat * paletteAEntryTerms = malloc(sizeof(GLfloat)*sprite->paletteA->num*4);
-		
-		// Unpacking RS_Colors is thirsty work. Time for some lemonade.
-		// Also, standard C for loops are a bit cumbersome.
-		unsigned int i = 0;
-		for(i = 0; i < sprite->paletteA->num; i++)
+		unsigned int block[4];
+		unsigned int n = 0, best = 0, bestCount = 0;
+		// Gather the block, clipped to the frame.
+		for(j = 0; j < 2; j++)
+		for(i = 0; i < 2; i++)
 		{
-			paletteAKeyTerms[(i*4)+0] = sprite->paletteA->keys[i]->r;
-			paletteAKeyTerms[(i*4)+3] = sprite->paletteA->keys[i]->a;
-			paletteAKeyTerms[(i*4)+1] = sprite->paletteA->keys[i]->g;
-			paletteAKeyTerms[(i*4)+2] = sprite->paletteA->keys[i]->b;
-			
-			paletteAEntryTerms[(i*4)+0] = sprite->paletteA->entries[i]->r;
-			paletteAEntryTerms[(i*4)+1] = sprite->paletteA->entries[i]->g;
-			paletteAEntryTerms[(i*4)+2] = sprite->paletteA->entries[i]->b;
-			paletteAEntryTerms[(i*4)+3] = sprite->paletteA->entries[i]->a;
+			GLuint sx = x*2+i, sy = y*2+j;
+			unsigned char * t;
+			if(sx >= srcFrameWidth || sy >= srcFrameHeight) continue;
+			block[n] = src[(size_t)(fy*srcFrameHeight+sy)*srcWidth + fx*srcFrameWidth+sx];
+			t = (unsigned char *)&block[n];
+			if(t[3] == 0) block[n] = 0;
+			++n;
 		}
-		
-		// Store the unpacked values on the GPU.
-		glUniform4fv(paletteAKeysUniform, sprite->paletteA->num*4, paletteAKeyTerms);
-		glUniform4fv(paletteAEntriesUniform, sprite->paletteA->num*4, paletteAEntryTerms);
-		glUniform1i(numPaletteAUniform, sprite->paletteA->num);
-		free(paletteAKeyTerms);
-		free(paletteAEntryTerms);
+		// Vote.
+		for(i = 0; i < n; i++)
+		{
+			unsigned int count = 0;
+			for(j = 0; j < n; j++)
+				count += block[j] == block[i];
+			if(count > bestCount || (count == bestCount &&
+				((unsigned char *)&block[i])[3] > ((unsigned char *)&block[best])[3]))
+			{
+				best = i;
+				bestCount = count;
+			}
+		}
+		dst[(size_t)(fy*dstFrameHeight+y)*dstWidth + fx*dstFrameWidth+x] = block[best];
 	}
-	else
+}
+
+/*
+	Builds the reduced levels of a sprite's image from its texture,
+	which has to be on the GPU.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite, with a nonzero frame size.
+		levels (GLuint): How many levels to build, up to
+						RS_MAX_LOD_LEVELS.
+		lods (GLuint*): Receives the level textures.
+	
+	Returns:
+		How many levels were built, which stops short once the
+		frames are down to a single texel.
+*/
+static GLuint buildLODChain(RS_Sprite * sprite, GLuint levels, GLuint * lods)
+{
+	GLuint framesX = sprite->imageWidth/sprite->width;
+	GLuint framesY = sprite->imageHeight/sprite->height;
+	GLuint level, fw, fh, iw, ih, prevWidth, prevHeight, built = 0;
+	unsigned int * previous, * current;
+	
+	// Start from the full image, converted to RGBA. Packed stores
+	// have no decoded format to ask for, but GL unpacks those to
+	// RGBA just as they sample. Only whole frames take part; any
+	// ragged edge is left out.
+	previous = (unsigned int *)readImageRGBA(sprite->tex, sprite->imageWidth, sprite->imageHeight,
+		sprite->image && sprite->image->store != RS_STORE_NATIVE ? RS_RGBA : sprite->format);
+	if(framesX*sprite->width != sprite->imageWidth)
 	{
-		glUniform4fv(paletteAKeysUniform, 0, NULL);
-		glUniform4fv(paletteAEntriesUniform, 0, NULL);
-		glUniform1i(numPaletteAUniform, 0);
+		// Repack the rows without the ragged edge.
+		GLuint y;
+		for(y = 0; y < sprite->imageHeight; y++)
+			memmove(&previous[(size_t)y*framesX*sprite->width],
+					&previous[(size_t)y*sprite->imageWidth], framesX*sprite->width*4);
 	}
+	prevWidth = sprite->width;
+	prevHeight = sprite->height;
 	
-	if(sprite->paletteB)
+	// Each level comes from the one before it.
+	for(level = 1; level <= levels; level++)
 	{
-		GLfloat * paletteBKeyTerms = malloc(sizeof(GLfloat)*sprite->paletteB->num*4);
-		GLfloat * paletteBEntryTerms = malloc(sizeof(GLfloat)*sprite->paletteB->num*4);
-		unsigned int i = 0;
-		for(i = 0; i < sprite->paletteB->num; i++)
-		{
-			paletteBKeyTerms[(i*4)+0] = sprite->paletteB->keys[i]->r;
-			paletteBKeyTerms[(i*4)+1] = sprite->paletteB->keys[i]->g;
-			paletteBKeyTerms[(i*4)+2] = sprite->paletteB->keys[i]->b;
-			paletteBKeyTerms[(i*4)+3] = sprite->paletteB->keys[i]->a;
-			
-			paletteBEntryTerms[(i*4)+0] = sprite->paletteB->entries[i]->r;
-			paletteBEntryTerms[(i*4)+3] = sprite->paletteB->entries[i]->a;
-			paletteBEntryTerms[(i*4)+1] = sprite->paletteB->entries[i]->g;
-			paletteBEntryTerms[(i*4)+2] = sprite->paletteB->entries[i]->b;
-		}
-		
-		// Store the unpacked values on the GPU.
-		glUniform4fv(paletteBKeysUniform, sprite->paletteB->num*4, paletteBKeyTerms);
-		glUniform4fv(paletteBEntriesUniform, sprite->paletteB->num*4, paletteBEntryTerms);
-		glUniform1i(numPaletteBUniform, sprite->paletteB->num);
-		free(paletteBKeyTerms);
-		free(paletteBEntryTerms);
+		lodSize(sprite->width, sprite->height, sprite->imageWidth, sprite->imageHeight, level,
+				&fw, &fh, &iw, &ih);
+		current = malloc((size_t)iw*ih*4);
+		downsampleFrames(previous, prevWidth, prevHeight, current, fw, fh, framesX, framesY);
+		generateTexture(&lods[level-1], iw, ih, RS_RGBA, (unsigned char *)current);
+		free(previous);
+		previous = current;
+		prevWidth = fw;
+		prevHeight = fh;
+		built = level;
+		// No point going past a single texel.
+		if(fw == 1 && fh == 1) break;
+	}
+	free(previous);
+	return built;
+}
+
+/*
+	Returns the size of the grid of frames a sprite steps through.
+	That's its image, unless the image was trimmed and packed.
+*/
+static void sheetSize(RS_Sprite * sprite, GLuint * width, GLuint * height)
+{
+	if(sprite->image && sprite->image->frames)
+	{
+		*width = sprite->image->sheetWidth;
+		*height = sprite->image->sheetHeight;
 	}
 	else
 	{
-		glUniform4fv(paletteBKeysUniform, 0, NULL);
-		glUniform4fv(paletteBEntriesUniform, 0, NULL);
-		glUniform1i(numPaletteBUniform, 0);
+		*width = sprite->imageWidth;
+		*height = sprite->imageHeight;
 	}
 }
 
-void RS_addColorReplacement(RS_Palette * palette, RS_Color * oldColor, RS_Color * newColor)
+/*
+	Returns the index of a sprite's current frame, counting left to
+	right then top to bottom, or ~0 if the frame hangs off the edge
+	of the sheet.
+*/
+static GLuint frameIndex(RS_Sprite * sprite)
 {
-	if(palette->num == RS_MAX_PALETTE_ENTRIES) return;
-	palette->keys[palette->num] = oldColor;
-	palette->entries[palette->num] = newColor;
-
-	palette->keys = realloc(palette->keys, sizeof(RS_Color *)*++palette->num);
-	palette->entries = realloc(palette->entries, sizeof(RS_Color *)*palette->num);
+	GLuint sheetWidth, sheetHeight, columns;
+	sheetSize(sprite, &sheetWidth, &sheetHeight);
+	columns = sheetWidth/sprite->width;
+	if(sprite->frameOffsetX/sprite->width >= columns) return ~0u;
+	if(sprite->frameOffsetY/sprite->height >= sheetHeight/sprite->height) return ~0u;
+	return (sprite->frameOffsetY/sprite->height)*columns + sprite->frameOffsetX/sprite->width;
 }
 
-void RS_popColorReplacement(RS_Palette * palette)
+/*
+	Finds the part of the given frame a sprite's image actually
+	holds, as X, Y, width and height within the frame, and where in
+	the image that part starts. Untrimmed frames are held whole.
+	Frames off the sheet hold nothing.
+*/
+static void frameRectAt(RS_Sprite * sprite, GLuint index, GLuint * rect, GLuint * imageX, GLuint * imageY)
 {
-	if(palette->num == 0) return;
-	
-	palette->keys = realloc(palette->keys, sizeof(RS_Color *)*palette->num);
-	palette->entries = realloc(palette->entries, sizeof(RS_Color *)*palette->num--);
+	RS_CachedTexture * image = sprite->image;
+	GLuint sheetWidth, sheetHeight, columns;
+	sheetSize(sprite, &sheetWidth, &sheetHeight);
+	columns = sheetWidth/sprite->width;
+	if(image && image->frames)
+	{
+		RS_TrimmedFrame * frame;
+		if(index >= columns*(sheetHeight/sprite->height))
+		{
+			rect[0] = rect[1] = rect[2] = rect[3] = 0;
+			*imageX = *imageY = 0;
+			return;
+		}
+		frame = &image->frames[index];
+		rect[0] = frame->x;
+		rect[1] = frame->y;
+		rect[2] = frame->width;
+		rect[3] = frame->height;
+		*imageX = frame->atlasX;
+		*imageY = frame->atlasY;
+		return;
+	}
+	rect[0] = 0;
+	rect[1] = 0;
+	rect[2] = sprite->width;
+	rect[3] = sprite->height;
+	*imageX = (index%columns)*sprite->width;
+	*imageY = (index/columns)*sprite->height;
 }
-	
-void RS_clearColorReplacements(RS_Palette * palette)
+
+/*
+	Finds the part of a sprite's current frame its image actually
+	holds, as frameRectAt() does.
+*/
+static void storedFrameRect(RS_Sprite * sprite, GLuint * rect, GLuint * imageX, GLuint * imageY)
 {
-	// Clear out the color pairs.
-	palette->keys = realloc(palette->keys, sizeof(RS_Color *));
-	palette->entries = realloc(palette->entries, sizeof(RS_Color *));
-	palette->num = 0;
+	RS_CachedTexture * image = sprite->image;
+	if(image && image->frames)
+	{
+		frameRectAt(sprite, frameIndex(sprite), rect, imageX, imageY);
+		return;
+	}
+	// Untrimmed frames go by their offsets, which needn't line up
+	// with whole frames.
+	rect[0] = 0;
+	rect[1] = 0;
+	rect[2] = sprite->width;
+	rect[3] = sprite->height;
+	*imageX = sprite->frameOffsetX;
+	*imageY = sprite->frameOffsetY;
 }
 
 /*
-	Updates the uniforms of the shader to the values
-	stored in the given RS_Sprite instance.
+	Picks the LOD level a sprite should be drawn with: the smallest
+	one that's still at least as large as it'll appear. Sprites whose
+	line offsets or band tables count texels of the frame are always
+	drawn at full size, since those would shift with the level.
 */
-static void updateSpriteUniformState(RS_Sprite * sprite)
+static GLuint lodLevelFor(RS_Sprite * sprite)
 {
-	// Do as told; update all the uniform variables in the shader
-	// to reflect the state of the given sprite.
-	glUniform1f(rotationUniform, sprite->rotation);
-	glUniform2f(scaleUniform, sprite->scaleX, sprite->scaleY);
-	glUniform2f(positionUniform, (GLfloat)sprite->posX, (GLfloat)sprite->posY);
-	glUniform1f(swapHeightUniform, (GLfloat)sprite->swapHeight);
-	updateColorSwapUniforms(sprite);	// Populate the color swap uniforms.
-	// The tint is tricky, since having no tint leaves us
-	// with a null reference.
-	if(sprite->tint)
-		glUniform4f(tintUniform, 
-					sprite->tint->r,
-					sprite->tint->g,
-					sprite->tint->b,
-					sprite->tint->a);
-	else
-		glUniform4f(tintUniform, 1.0, 1.0, 1.0, 1.0);
+	GLfloat scaleX = fabsf(sprite->scaleX), scaleY = fabsf(sprite->scaleY);
+	GLfloat scale = scaleX < scaleY ? scaleX : scaleY;
+	GLuint level = 0;
+	GLuint numLODs = spriteNumLODs(sprite);
+	if(numLODs == 0 || scale <= 0.0) return 0;
+	if(sprite->lineOffsets != RS_NULL_TEXTURE) return 0;
+	if(sprite->paletteBands && sprite->paletteBands->space == RS_BANDS_SPRITE) return 0;
+	while(level < numLODs && scale <= .5f/(1 << level))
+		++level;
+	return level;
+}
+
+/*
+	Returns 1 if the current blend state leaves the target as it is
+	wherever the source is fully transparent, so draws can skip
+	those parts.
+*/
+static int blendSkipsClear(void)
+{
+	GLint equation, srcRGB, dstRGB, dstAlpha;
+	if(!glIsEnabled(GL_BLEND)) return 0;
+	glGetIntegerv(GL_BLEND_EQUATION_RGB, &equation);
+	if(equation != GL_FUNC_ADD) return 0;
+	glGetIntegerv(GL_BLEND_EQUATION_ALPHA, &equation);
+	if(equation != GL_FUNC_ADD) return 0;
+	// A transparent source's alpha adds nothing whatever its factor,
+	// but its color might, so that has to be weighed by its alpha.
+	glGetIntegerv(GL_BLEND_SRC_RGB, &srcRGB);
+	glGetIntegerv(GL_BLEND_DST_RGB, &dstRGB);
+	glGetIntegerv(GL_BLEND_DST_ALPHA, &dstAlpha);
+	return (srcRGB == GL_SRC_ALPHA || srcRGB == GL_ZERO) &&
+			(dstRGB == GL_ONE_MINUS_SRC_ALPHA || dstRGB == GL_ONE) &&
+			(dstAlpha == GL_ONE_MINUS_SRC_ALPHA || dstAlpha == GL_ONE);
+}
+
+/*
+	Tells the shader which part of which image to sample for the
+	medium sprite. At a reduced level the frame shrinks, so the scale
+	grows to match and the sprite still covers the same pixels. Call
+	it after updateSpriteUniformState(), since it may override the
+	scale set there. Sparse draws are those where transparent texels
+	leave the target alone, as blendSkipsClear() says.
+*/
+static void setMediumUniforms(RS_Sprite * sprite, GLuint level, int sparse)
+{
+	GLuint fw, fh, iw, ih, rect[4], imageX, imageY;
+	if(level == 0)
+	{
+		// Sparse draws only cover the stored part of a trimmed
+		// frame; the rest would clear the target, so other draws
+		// cover it all and the shader clears it. The frame offset
+		// is where its corner would have been.
+		storedFrameRect(sprite, rect, &imageX, &imageY);
+		glUniform2f(program->mediumFrameSizeUniform, (GLfloat)sprite->width, (GLfloat)sprite->height);
+		glUniform2f(program->mediumFrameOffsetUniform, (GLfloat)imageX-rect[0], (GLfloat)imageY-rect[1]);
+		glUniform2f(program->mediumImageSizeUniform, sprite->imageWidth, sprite->imageHeight);
+		glUniform4f(program->mediumTrimUniform, rect[0], rect[1], rect[2], rect[3]);
+		// Line offsets can pull the stored part anywhere in the
+		// frame, so those draws cover all of it.
+		if(sprite->lineOffsets != RS_NULL_TEXTURE || !sparse)
+			glUniform4f(program->mediumQuadUniform, 0.0, 0.0, sprite->width, sprite->height);
+		else
+			glUniform4f(program->mediumQuadUniform, rect[0], rect[1], rect[2], rect[3]);
+		return;
+	}
+	lodSize(sprite->width, sprite->height, sprite->imageWidth, sprite->imageHeight, level, &fw, &fh, &iw, &ih);
+	glUniform4f(program->mediumQuadUniform, 0.0, 0.0, fw, fh);
+	glUniform4f(program->mediumTrimUniform, 0.0, 0.0, fw, fh);
+	glUniform2f(program->mediumFrameSizeUniform, (GLfloat)fw, (GLfloat)fh);
+	glUniform2f(program->mediumFrameOffsetUniform,
+				(GLfloat)(sprite->frameOffsetX/sprite->width*fw),
+				(GLfloat)(sprite->frameOffsetY/sprite->height*fh));
+	glUniform2f(program->mediumImageSizeUniform, (GLfloat)iw, (GLfloat)ih);
+	glUniform2f(program->scaleUniform, sprite->scaleX*sprite->width/fw, sprite->scaleY*sprite->height/fh);
+}
+
+/*
+	Draws the medium sprite's current frame, with its hull if it has
+	one that applies, and keeps the fill totals. Takes the same level
+	and sparseness as setMediumUniforms().
+*/
+static void drawMedium(RS_Sprite * sprite, GLuint level, int sparse)
+{
+	GLuint rect[4], imageX, imageY, frame;
+	GLfloat scale = fabsf(sprite->scaleX*sprite->scaleY);
+	GLfloat frameArea = scale*sprite->width*sprite->height;
+	quadPixels += frameArea;
+	
+	// Reduced levels and line offsets draw the whole frame.
+	if(level || sprite->lineOffsets != RS_NULL_TEXTURE)
+	{
+		shadedPixels += frameArea;
+		drawSquare();
+		return;
+	}
+	storedFrameRect(sprite, rect, &imageX, &imageY);
+	frame = frameIndex(sprite);
+	// A hull leaves the texels around it untouched, which is only
+	// right when transparent texels wouldn't have changed them.
+	if(sparse && sprite->hull && frame < sprite->hull->numFrames)
+	{
+		RS_Hull * hull = sprite->hull;
+		shadedPixels += scale*rect[2]*rect[3]*hull->coverage[frame];
+		// Frames with nothing to show aren't drawn at all.
+		if(hull->counts[frame] == 0) return;
+		feedVertexAttributes(hull->buffer);
+		glDrawArrays(GL_TRIANGLE_FAN, frame*RS_MAX_HULL_VERTICES, hull->counts[frame]);
+		glDisableVertexAttribArray(program->posAttrib);
+		glDisableVertexAttribArray(program->uvAttrib);
+		glBindBuffer(GL_ARRAY_BUFFER, RS_NULL_BUFFER);
+		return;
+	}
+	// Trimmed frames cover only what they hold, unless the rest
+	// has to be cleared.
+	shadedPixels += sparse ? scale*rect[2]*rect[3] : frameArea;
+	drawSquare();
+}
+
+/*
+	Returns how long the palette arrays of a variant with the given
+	number of palettes and size class can be. This is the size of
+	the class, unless the driver's uniform limit says otherwise.
+*/
+static GLuint paletteCapacity(unsigned int palettes, unsigned int sizeClass)
+{
+	GLuint capacity = paletteSizeClasses[sizeClass];
+	GLint room;
+	// Band tables keep their palettes in a texture instead.
+	if(palettes == 0 || palettes == RS_VARIANT_BANDS) return 1;
+	// Each palette has two arrays of vec4s.
+	room = (maxFragmentUniforms-RS_RESERVED_UNIFORM_COMPONENTS)/(palettes*2*4);
+	if(room < 1) room = 1;
+	return (GLuint)room < capacity ? (GLuint)room : capacity;
+}
+
+/*
+	Compiles and links the shader variant with the given feature
+	bits, and retrieves all attribute and uniform locations from it.
+*/
+static void compileVariant(unsigned int key)
+{
+	RS_Program * p = &programs[key];
+	unsigned int palettes = (key >> RS_VARIANT_PALETTE_SHIFT) & 3;
+	unsigned int sizeClass = (key >> RS_VARIANT_SIZE_SHIFT) & 3;
+	char defines[512] = "";
+	GLuint shader;
+	
+	// Spell out the variant for the preprocessor.
+	p->paletteCapacity = paletteCapacity(palettes, sizeClass);
+	if(key & RS_VARIANT_CANVAS) strcat(defines, "#define CANVAS\n");
+	if(key & RS_VARIANT_TINT) strcat(defines, "#define TINT\n");
+	if(key & RS_VARIANT_LINE_OFFSETS) strcat(defines, "#define LINE_OFFSETS\n");
+	if(palettes == RS_VARIANT_BANDS)
+		sprintf(defines+strlen(defines), "#define PALETTE_BANDS\n#define BAND_PALETTES %u\n#define BAND_ENTRIES %u\n",
+				RS_MAX_BAND_PALETTES, RS_MAX_PALETTE_ENTRIES);
+	else
+		sprintf(defines+strlen(defines), "#define NUM_PALETTES %u\n#define PALETTE_SIZE %u\n",
+				palettes, p->paletteCapacity);
+	
+	// Create the shader program.
+	shader = linkShaderProgram(compileShader(vertText, defines, GL_VERTEX_SHADER),
+								compileShader(fragText, defines, GL_FRAGMENT_SHADER));
+	p->program = shader;
+	
+	// OH DEAR LAWDY THESE POSITION QUERIES.
+	p->posAttrib = glGetAttribLocation(shader, "vertPosition");
+	p->uvAttrib = glGetAttribLocation(shader, "vertUV");
+	p->canvasFrameOffsetUniform = glGetUniformLocation(shader, "canvasFrameOffset");
+	p->canvasFrameSizeUniform = glGetUniformLocation(shader, "canvasFrameSize");
+	p->canvasImageSizeUniform = glGetUniformLocation(shader, "canvasImageSize");
+	p->mediumFrameOffsetUniform = glGetUniformLocation(shader, "mediumFrameOffset");
+	p->mediumFrameSizeUniform = glGetUniformLocation(shader, "mediumFrameSize");
+	p->mediumImageSizeUniform = glGetUniformLocation(shader, "mediumImageSize");
+	p->mediumQuadUniform = glGetUniformLocation(shader, "mediumQuad");
+	p->mediumTrimUniform = glGetUniformLocation(shader, "mediumTrim");
+	p->canvasTrimUniform = glGetUniformLocation(shader, "canvasTrim");
+	p->rotationUniform = glGetUniformLocation(shader, "rotation"); 	
+	p->scaleUniform = glGetUniformLocation(shader, "scale"); 	
+	p->positionUniform = glGetUniformLocation(shader, "position");	
+	p->toScreenUniform = glGetUniformLocation(shader, "toScreen");
+	p->tintUniform = glGetUniformLocation(shader, "tint");		
+	p->mixUniform = glGetUniformLocation(shader, "canvasMediumMix");
+	p->paletteAKeysUniform = glGetUniformLocation(shader, "paletteAKeys");	
+	p->paletteAEntriesUniform = glGetUniformLocation(shader, "paletteAEntries");	
+	p->numPaletteAUniform = glGetUniformLocation(shader, "numPaletteA");	
+	p->paletteBKeysUniform = glGetUniformLocation(shader, "paletteBKeys");	
+	p->paletteBEntriesUniform = glGetUniformLocation(shader, "paletteBEntries");	
+	p->numPaletteBUniform = glGetUniformLocation(shader, "numPaletteB");	
+	p->swapHeightUniform = glGetUniformLocation(shader, "swapHeight");
+	p->paletteTableUniform = glGetUniformLocation(shader, "paletteTable");
+	p->paletteBandsUniform = glGetUniformLocation(shader, "paletteBands");
+	p->bandLinesUniform = glGetUniformLocation(shader, "bandLines");
+	p->bandsInSpriteUniform = glGetUniformLocation(shader, "bandsInSprite");
+	p->lineOffsetsUniform = glGetUniformLocation(shader, "lineOffsets");
+	p->offsetLinesUniform = glGetUniformLocation(shader, "offsetLines");
+	p->canvasTextureUniform = glGetUniformLocation(shader, "canvas");
+	p->mediumTextureUniform = glGetUniformLocation(shader, "medium");
+}
+
+/*
+	Works out the cheapest shader variant that can draw the given
+	sprite, compiles it if it's never been used, and starts using it.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite being drawn.
+		baked (GLuint): Whether the sprite's palette is baked into
+						its image, in which case the shader skips it.
+		canvas (int): Whether the draw mixes with a canvas image.
+*/
+static void useVariant(RS_Sprite * sprite, GLuint baked, int canvas)
+{
+	unsigned int key = 0, palettes = 0, sizeClass = 0, largest = 0;
+	if(canvas) key |= RS_VARIANT_CANVAS;
+	if(sprite->tint) key |= RS_VARIANT_TINT;
+	if(sprite->lineOffsets != RS_NULL_TEXTURE) key |= RS_VARIANT_LINE_OFFSETS;
+	
+	// Band tables need a variant of their own.
+	if(sprite->paletteBands)
+		palettes = RS_VARIANT_BANDS;
+	// Empty palettes don't count.
+	else if(!baked)
+	{
+		if(sprite->paletteA && sprite->paletteA->num)
+		{
+			++palettes;
+			largest = sprite->paletteA->num;
+		}
+		if(sprite->paletteB && sprite->paletteB->num)
+		{
+			++palettes;
+			if(sprite->paletteB->num > largest) largest = sprite->paletteB->num;
+		}
+	}
+	// Find the smallest size class the palettes fit in.
+	while(sizeClass < RS_NUM_PALETTE_SIZE_CLASSES-1 && largest > paletteSizeClasses[sizeClass])
+		++sizeClass;
+	if(palettes == 0 || palettes == RS_VARIANT_BANDS) sizeClass = 0;
+	key |= palettes << RS_VARIANT_PALETTE_SHIFT;
+	key |= sizeClass << RS_VARIANT_SIZE_SHIFT;
+	
+	if(programs[key].program == RS_NULL_PROGRAM)
+		compileVariant(key);
+	program = &programs[key];
+	glUseProgram(program->program);
+}
+
+/*
+	Loads the RenderSprite shader source and finds out how much
+	room it has for palettes. Variants are compiled as needed.
+*/
+static void initShaders(void)
+{
+	vertText = loadShaderSource(vertSource);
+	fragText = loadShaderSource(fragSource);
+	glGetIntegerv(GL_MAX_FRAGMENT_UNIFORM_COMPONENTS, &maxFragmentUniforms);
+}
+
+/*
+	Initializes GLEW, and other libraries if need occurs.
+	Returns 1 if everything checks out.
+*/
+static int initLibraries(void)
+{
+	// Initialize GLEW, storing its return status.
+	GLenum err = glewInit();
+	// If we ain't good, we do something about it.
+	if(err != GLEW_OK)
+	{
+		#ifdef RS_DB_ERRORS
+		printf("Error initializing GLEW%s\n.", glewGetErrorString(err));
+		#endif
+		return 0;
+	}
+	// We really need to make sure we have framebuffers.
+	if(!GLEW_EXT_framebuffer_object)
+	{
+		#ifdef RS_DB_ERRORS
+		printf("Error: no framebuffer capability.\n");
+		#endif
+		return 0;
+	}
+	// And a programmable pipeline.
+	if(!GLEW_VERSION_2_0)
+	{
+		#ifdef RS_DB_ERRORS
+		printf("Error: OpenGL version < 2.0. No programmable pipeline.\n");
+		#endif
+		return 0;
+	}
+	fprintf(stdout, "Status: Using GLEW %s\n", glewGetString(GLEW_VERSION));
+	return 1;
+}
+
+void RS_init(void)
+{
+	// Initialize GLEW.
+	initLibraries();
+	// Initialize the rendering square.
+	initSquare();
+	// Initialize the shader program and its position constants.
+	initShaders();
+}
+
+void RS_deInit(void)
+{
+	glDeleteBuffers(1, &vertexBuffer);
+	glDeleteBuffers(1, &indexBuffer);
+	// Delete every variant that was ever compiled.
+	unsigned int i;
+	for(i = 0; i < RS_NUM_SHADER_VARIANTS; i++)
+	{
+		if(programs[i].program != RS_NULL_PROGRAM)
+			glDeleteProgram(programs[i].program);
+		programs[i].program = RS_NULL_PROGRAM;
+	}
+	free(vertText);
+	free(fragText);
+	// Along with the virtual screen, if there was one.
+	RS_setVirtualResolution(0, 0);
+	// And the stand-in for empty canvases.
+	if(blankTex != RS_NULL_TEXTURE)
+	{
+		glDeleteTextures(1, &blankTex);
+		blankTex = RS_NULL_TEXTURE;
+	}
+	// And the batch target.
+	if(batchTarget)
+	{
+		glDeleteFramebuffersEXT(1, &batchTarget->fbo);
+		glDeleteTextures(1, &batchTarget->tex);
+		attachmentBytes -= numTexelBytes(batchTarget->width, batchTarget->height, RS_RGBA);
+		free(batchTarget);
+		batchTarget = NULL;
+	}
+	#ifdef RS_HEADLESS
+	// The context goes last, since everything above needs it.
+	if(headlessContext)
+	{
+		OSMesaDestroyContext(headlessContext);
+		headlessContext = NULL;
+		free(headlessPixels);
+		headlessPixels = NULL;
+	}
+	#endif
+}
+
+#ifdef RS_HEADLESS
+int RS_initHeadless(GLuint width, GLuint height)
+{
+	// RGBA with a depth buffer, like a typical window.
+	headlessContext = OSMesaCreateContextExt(OSMESA_RGBA, 24, 0, 0, NULL);
+	if(!headlessContext)
+	{
+		#ifdef RS_DB_ERRORS
+		printf("Error: could not create an OSMesa context.\n");
+		#endif
+		return 0;
+	}
+	headlessPixels = malloc((size_t)width*height*4);
+	if(!OSMesaMakeCurrent(headlessContext, headlessPixels, GL_UNSIGNED_BYTE, width, height))
+	{
+		#ifdef RS_DB_ERRORS
+		printf("Error: could not make the OSMesa context current.\n");
+		#endif
+		OSMesaDestroyContext(headlessContext);
+		headlessContext = NULL;
+		free(headlessPixels);
+		headlessPixels = NULL;
+		return 0;
+	}
+	glViewport(0, 0, width, height);
+	RS_init();
+	return 1;
+}
+
+unsigned char * RS_getHeadlessPixels(void)
+{
+	if(!headlessContext) return NULL;
+	glFinish();
+	return headlessPixels;
+}
+#endif
+
+static RS_Sprite * generateRawSprite(void)
+{	
+	// Allocate an RS_Sprite-sized hunk of memory.
+	RS_Sprite * sprite = malloc(sizeof(RS_Sprite));
+	// Nothing has been allocated on the GPU yet.
+	sprite->tex = RS_NULL_TEXTURE;
+	sprite->att = RS_NULL_TEXTURE;
+	sprite->fbo = RS_NULL_FBO;
+	sprite->readFBO = RS_NULL_FBO;
+	// Nor did its image come from the texture cache.
+	sprite->image = NULL;
+	// Set up the transformation and animation variables.
+	sprite->frameOffsetX = 0;
+	sprite->frameOffsetY = 0;
+	sprite->rotation = 0.0;
+	sprite->posX = 0;
+	sprite->posY = 0;
+	sprite->scaleX = 1.0;
+	sprite->scaleY = 1.0;
+	sprite->tint = NULL;
+	sprite->paletteA = NULL;
+	sprite->paletteB = NULL;
+	sprite->swapHeight = 0;
+	sprite->paletteBands = NULL;
+	sprite->lineOffsets = RS_NULL_TEXTURE;
+	sprite->numLineOffsets = 0;
+	sprite->numLODs = 0;
+	sprite->hull = NULL;
+	// Only images loaded from memory get a mask of their own.
+	sprite->mask = NULL;
+	sprite->maskStride = 0;
+	// Return the sprite.
+	return sprite;
+}
+
+RS_Sprite * RS_mkEmptySprite(GLuint width, GLuint height, GLuint format)
+{
+	// Create a raw, nubile RS_Sprite for prep.
+	RS_Sprite * sprite = generateRawSprite();
+	
+	// Store the width and height and format of the sprite.
+	sprite->width = width;
+	sprite->imageWidth = width;
+	sprite->imageHeight = height;
+	sprite->height = height;
+	sprite->format = format;
+	
+	// An empty sprite has no image to store, and its framebuffer
+	// is created the first time it is rendered to.
+	deferredAttachmentBytes += spriteAttachmentBytes(sprite);
+	
+	return sprite;
+}
+
+/*
+	Reads a whole file into the calling thread's scratch buffer,
+	growing it if need be. The buffer is reused by the next read,
+	so the contents are only good until then. Returns NULL if the
+	file couldn't be read.
+*/
+static unsigned char * readFile(char * filename, size_t * size)
+{
+	long length;
+	FILE * f = fopen(filename, "rb");
+	if(f == NULL)
+	{
+		#ifdef RS_DB_ERRORS
+		fprintf(stderr, "Could not open %s\n", filename);
+		#endif
+		return NULL;
+	}
+	// How big is it?
+	fseek(f, 0, SEEK_END);
+	length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if(length < 0)
+	{
+		fclose(f);
+		return NULL;
+	}
+	
+	// Grow the buffer geometrically, so a run of loads settles
+	// on one allocation.
+	if((size_t)length > scratchSize)
+	{
+		size_t newSize = scratchSize ? scratchSize : 4096;
+		while(newSize < (size_t)length) newSize *= 2;
+		free(scratch);
+		scratch = malloc(newSize);
+		scratchSize = scratch ? newSize : 0;
+		if(!scratch)
+		{
+			fclose(f);
+			return NULL;
+		}
+	}
+	*size = fread(scratch, 1, length, f);
+	fclose(f);
+	return *size == (size_t)length ? scratch : NULL;
+}
+
+/*
+	Returns 1 if the PNG in the given buffer has a chunk of the
+	given type before its image data. Used to find out whether
+	it has a tRNS chunk, which lodepng_inspect() doesn't read.
+*/
+static int hasChunkBeforeData(unsigned char * file, size_t fileSize, const char * type)
+{
+	// Skip the signature.
+	size_t at = 8;
+	while(at+8 <= fileSize)
+	{
+		size_t length = ((size_t)file[at] << 24) | ((size_t)file[at+1] << 16) |
+						((size_t)file[at+2] << 8) | (size_t)file[at+3];
+		if(memcmp(&file[at+4], type, 4) == 0) return 1;
+		if(memcmp(&file[at+4], "IDAT", 4) == 0) return 0;
+		// Length, type, data and CRC.
+		at += length+12;
+	}
+	return 0;
+}
+
+/*
+	Decodes the PNG held in the given buffer into a freshly malloc'd
+	array of 8-bit texel terms, storing its dimensions and format.
+	The header is inspected first, so the image is decoded just once,
+	straight into the smallest format that holds it: grayscale stays
+	grayscale, and only images that can be translucent get alpha.
+	Returns NULL if the image couldn't be decoded.
+*/
+static unsigned char * decodePNG(unsigned char * file, size_t fileSize, GLuint * width, GLuint * height, GLuint * format)
+{
+	// Create a pointer to reference data loaded by LoadPNG.
+	unsigned char * imageData = NULL;
+	LodePNGState state;
+	unsigned lodePngError;
+	int transparency;
+	
+	// Find out what we're dealing with.
+	lodepng_state_init(&state);
+	lodePngError = lodepng_inspect(width, height, &state, file, fileSize);
+	if(!lodePngError)
+	{
+		// A tRNS chunk adds alpha to images that otherwise have none.
+		transparency = hasChunkBeforeData(file, fileSize, "tRNS");
+		switch(state.info_png.color.colortype)
+		{
+			case LCT_GREY:
+				state.info_raw.colortype = transparency ? LCT_GREY_ALPHA : LCT_GREY;
+				*format = transparency ? RS_LUMINANCE_ALPHA : RS_LUMINANCE;
+				break;
+			case LCT_GREY_ALPHA:
+				state.info_raw.colortype = LCT_GREY_ALPHA;
+				*format = RS_LUMINANCE_ALPHA;
+				break;
+			case LCT_RGBA:
+				state.info_raw.colortype = LCT_RGBA;
+				*format = RS_RGBA;
+				break;
+			default:
+				// RGB and paletted images.
+				state.info_raw.colortype = transparency ? LCT_RGBA : LCT_RGB;
+				*format = transparency ? RS_RGBA : RS_RGB;
+				break;
+		}
+		// Anything deeper gets brought down to 8 bits per term.
+		state.info_raw.bitdepth = 8;
+		lodePngError = lodepng_decode(&imageData, width, height, &state, file, fileSize);
+	}
+	lodepng_state_cleanup(&state);
+	
+	// If there's something wrong, well poop.
+	if(lodePngError)
+	{
+		#ifdef RS_DB_ERRORS
+		fprintf(stderr, 
+				"Error loading PNG %d: %s", 
+				lodePngError, 
+				lodepng_error_text(lodePngError));
+		#endif
+		free(imageData);
+		return NULL;
+	}
+	return imageData;
+}
+
+/*
+	Hashes the given bytes with 64-bit FNV-1a. This identifies
+	image contents in the texture cache.
+*/
+static unsigned long long hashBytes(unsigned char * bytes, size_t size)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	size_t i;
+	for(i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+	Returns the number of bytes a cached image occupies, leaving
+	out its LOD chain.
+*/
+static size_t cachedImageBytes(RS_CachedTexture * entry)
+{
+	if(entry->tex == RS_NULL_TEXTURE) return 0;
+	return storedTexelBytes(entry->width, entry->height, entry->format, entry->store);
+}
+
+/*
+	Returns the number of bytes a cached image's LOD chain occupies.
+	Trimmed images never have one, so the frame size is the one
+	the image was loaded with.
+*/
+static size_t cachedLODBytes(RS_CachedTexture * entry)
+{
+	if(entry->tex == RS_NULL_TEXTURE) return 0;
+	return lodChainBytes(entry->frameWidth ? entry->frameWidth : entry->width,
+						entry->frameHeight ? entry->frameHeight : entry->height,
+						entry->width, entry->height, entry->numLODs);
+}
+
+/*
+	Returns the number of bytes a cached texture occupies, along
+	with its LOD chain.
+*/
+static size_t cachedTextureBytes(RS_CachedTexture * entry)
+{
+	return cachedImageBytes(entry)+cachedLODBytes(entry);
+}
+
+/*
+	Adds a cached texture to the front of the residency list,
+	making it the most recently used.
+*/
+static void linkResident(RS_CachedTexture * entry)
+{
+	entry->lruPrev = NULL;
+	entry->lruNext = lruHead;
+	if(lruHead) lruHead->lruPrev = entry;
+	lruHead = entry;
+	if(!lruTail) lruTail = entry;
+}
+
+/*
+	Removes a cached texture from the residency list.
+*/
+static void unlinkResident(RS_CachedTexture * entry)
+{
+	if(entry->lruPrev) entry->lruPrev->lruNext = entry->lruNext;
+	else lruHead = entry->lruNext;
+	if(entry->lruNext) entry->lruNext->lruPrev = entry->lruPrev;
+	else lruTail = entry->lruPrev;
+	entry->lruPrev = NULL;
+	entry->lruNext = NULL;
+}
+
+/*
+	Drops a cached texture from the GPU. It can be reloaded
+	from its source file later on.
+*/
+static void evictTexture(RS_CachedTexture * entry)
+{
+	textureBytes -= cachedTextureBytes(entry);
+	glDeleteTextures(1, &entry->tex);
+	// The LOD chain goes with it, but how many levels it had is
+	// kept so reloading builds them again.
+	if(entry->numLODs)
+		glDeleteTextures(entry->numLODs, entry->lods);
+	// Its read framebuffer would be left pointing at nothing.
+	releaseReadFramebuffer(&entry->readFBO);
+	entry->tex = RS_NULL_TEXTURE;
+	++evictions;
+}
+
+/*
+	Frees a chunk's sprite, which renders straight into its image
+	like the virtual screen does.
+*/
+static void releaseChunk(RS_StaticLayer * layer, GLuint chunk)
+{
+	RS_Sprite * sprite = layer->chunks[chunk];
+	if(!sprite) return;
+	glDeleteFramebuffersEXT(1, &sprite->fbo);
+	glDeleteTextures(1, &sprite->tex);
+	attachmentBytes -= numTexelBytes(sprite->width, sprite->height, RS_RGBA);
+	free(sprite);
+	layer->chunks[chunk] = NULL;
+}
+
+/*
+	Returns whether the library holds more texture memory than its
+	budget allows.
+*/
+static int overBudget(void)
+{
+	return textureBudget && textureBytes+attachmentBytes+bakedBytes > textureBudget;
+}
+
+/*
+	Drops the least recently drawn baked palette variant.
+	Returns 0 if nothing is baked.
+*/
+static int dropStalestBake(void)
+{
+	RS_BakedPalette * stalest = NULL;
+	unsigned int i;
+	for(i = 0; i < RS_MAX_BAKED_PALETTES; i++)
+	{
+		RS_BakedPalette * baked = &bakedPalettes[i];
+		if(baked->tex != RS_NULL_TEXTURE && (!stalest || baked->lastUse < stalest->lastUse))
+			stalest = baked;
+	}
+	if(!stalest) return 0;
+	clearBakedPalette(stalest);
+	return 1;
+}
+
+/*
+	Releases the chunks of a static layer that weren't on screen
+	the last time it was drawn, while over budget. They're baked
+	again when they come into view.
+*/
+static void releaseIdleChunks(RS_StaticLayer * layer)
+{
+	GLuint column, row;
+	for(row = 0; row < layer->rows; row++)
+		for(column = 0; column < layer->columns; column++)
+		{
+			if(!overBudget()) return;
+			if((GLint)column >= layer->shown[0] && (GLint)column <= layer->shown[2] &&
+				(GLint)row >= layer->shown[1] && (GLint)row <= layer->shown[3])
+				continue;
+			releaseChunk(layer, row*layer->columns+column);
+		}
+}
+
+/*
+	Brings the library back within its texture budget, giving up
+	the cheapest things to recreate first: baked palette variants,
+	then static layer chunks that are off screen, then the least
+	recently used cached textures, until it fits or there is
+	nothing left to give up. Other attachments hold contents that
+	can't be recovered, so they stay. The entry given as "keep" is
+	spared, since it's about to be drawn.
+*/
+static void enforceBudget(RS_CachedTexture * keep)
+{
+	RS_CachedTexture * victim = lruTail;
+	RS_StaticLayer * layer;
+	// No budget, no problem.
+	if(textureBudget == 0) return;
+	while(overBudget())
+		if(!dropStalestBake()) break;
+	for(layer = staticLayers; layer && overBudget(); layer = layer->next)
+		releaseIdleChunks(layer);
+	while(victim && overBudget())
+	{
+		if(victim != keep && victim->tex != RS_NULL_TEXTURE)
+			evictTexture(victim);
+		victim = victim->lruPrev;
+	}
+}
+
+/*
+	Orders trimmed frames tallest first, for packing.
+*/
+static int compareFrameHeights(const void * a, const void * b)
+{
+	const RS_TrimmedFrame * frameA = *(RS_TrimmedFrame * const *)a;
+	const RS_TrimmedFrame * frameB = *(RS_TrimmedFrame * const *)b;
+	return (int)frameB->height-(int)frameA->height;
+}
+
+/*
+	Trims the transparent border off every frame of a sprite sheet
+	and packs what's left into a new image, a shelf at a time,
+	tallest first. Frames that don't fit whole in the sheet are
+	dropped. Returns the packed image, and where each frame went.
+*/
+static unsigned char * trimFrames(unsigned char * imageData, GLuint width, GLuint height, GLuint format,
+								GLuint frameWidth, GLuint frameHeight, RS_TrimmedFrame ** framesOut,
+								GLuint * atlasWidth, GLuint * atlasHeight)
+{
+	GLuint columns = width/frameWidth, rows = height/frameHeight;
+	GLuint num = columns*rows, i, x, y;
+	GLuint texelBytes = formatBytes(format);
+	// Where the alpha term sits in a texel, if there is one.
+	int alpha = format == RS_RGBA ? 3 : format == RS_LUMINANCE_ALPHA ? 1 : -1;
+	RS_TrimmedFrame * frames = malloc(sizeof(RS_TrimmedFrame)*(num ? num : 1));
+	RS_TrimmedFrame ** order = malloc(sizeof(RS_TrimmedFrame *)*(num ? num : 1));
+	GLuint widest = 1, shelfWidth, shelfX = 0, shelfY = 0, shelfHeight = 0, packedWidth = 1;
+	size_t area = 0;
+	unsigned char * atlas;
+	
+	// Find each frame's visible rectangle.
+	for(i = 0; i < num; i++)
+	{
+		RS_TrimmedFrame * frame = &frames[i];
+		GLuint frameX = (i%columns)*frameWidth, frameY = (i/columns)*frameHeight;
+		GLuint minX = frameWidth, minY = frameHeight, maxX = 0, maxY = 0;
+		for(y = 0; y < frameHeight; y++)
+		{
+			unsigned char * texel = &imageData[((size_t)(frameY+y)*width+frameX)*texelBytes];
+			for(x = 0; x < frameWidth; x++, texel += texelBytes)
+			{
+				if(alpha >= 0 && !texel[alpha]) continue;
+				if(x < minX) minX = x;
+				if(x >= maxX) maxX = x+1;
+				if(y < minY) minY = y;
+				if(y >= maxY) maxY = y+1;
+			}
+		}
+		// Nothing visible at all takes no room.
+		if(maxX == 0)
+			minX = minY = 0;
+		frame->x = minX;
+		frame->y = minY;
+		frame->width = maxX-minX;
+		frame->height = maxY-minY;
+		area += (size_t)frame->width*frame->height;
+		if(frame->width > widest) widest = frame->width;
+		order[i] = frame;
+	}
+	
+	// Shelves about as wide as a square holding everything.
+	shelfWidth = (GLuint)ceil(sqrt((double)area));
+	if(shelfWidth < widest) shelfWidth = widest;
+	qsort(order, num, sizeof(RS_TrimmedFrame *), compareFrameHeights);
+	for(i = 0; i < num; i++)
+	{
+		RS_TrimmedFrame * frame = order[i];
+		if(shelfX+frame->width > shelfWidth)
+		{
+			shelfY += shelfHeight;
+			shelfX = 0;
+			shelfHeight = 0;
+		}
+		frame->atlasX = shelfX;
+		frame->atlasY = shelfY;
+		shelfX += frame->width;
+		if(frame->height > shelfHeight) shelfHeight = frame->height;
+		if(shelfX > packedWidth) packedWidth = shelfX;
+	}
+	free(order);
+	*atlasWidth = packedWidth;
+	*atlasHeight = shelfY+shelfHeight ? shelfY+shelfHeight : 1;
+	
+	// Copy the rectangles over.
+	atlas = calloc((size_t)*atlasWidth**atlasHeight, texelBytes);
+	for(i = 0; i < num; i++)
+	{
+		RS_TrimmedFrame * frame = &frames[i];
+		GLuint frameX = (i%columns)*frameWidth+frame->x, frameY = (i/columns)*frameHeight+frame->y;
+		for(y = 0; y < frame->height; y++)
+			memcpy(&atlas[((size_t)(frame->atlasY+y)**atlasWidth+frame->atlasX)*texelBytes],
+					&imageData[((size_t)(frameY+y)*width+frameX)*texelBytes],
+					(size_t)frame->width*texelBytes);
+	}
+	*framesOut = frames;
+	return atlas;
+}
+
+/*
+	Marks a sprite as just used, reloading its image if it was
+	evicted and then making room for it within the budget.
+	Sprites not loaded from files are never evicted, so there's
+	nothing to do for them.
+*/
+static void touchSprite(RS_Sprite * sprite)
+{
+	RS_CachedTexture * entry = sprite->image;
+	int reloaded = 0;
+	if(!entry) return;
+	
+	// Bring it back if it was evicted. Images from packs are
+	// still sitting in the mapping, ready to go.
+	if(entry->tex == RS_NULL_TEXTURE && entry->pixels)
+	{
+		generateStoredTexture(&entry->tex, entry->width, entry->height, entry->format, entry->store, entry->pixels);
+		reloaded = 1;
+	}
+	else if(entry->tex == RS_NULL_TEXTURE)
+	{
+		size_t fileSize;
+		unsigned char * file = readFile(entry->path, &fileSize);
+		if(file)
+		{
+			GLuint width, height, format;
+			unsigned char * imageData = decodePNG(file, fileSize, &width, &height, &format);
+			// Trimming is deterministic, so it packs the same way again.
+			if(imageData && entry->frames)
+			{
+				RS_TrimmedFrame * frames;
+				unsigned char * atlas = trimFrames(imageData, width, height, format,
+												entry->frameWidth, entry->frameHeight,
+												&frames, &width, &height);
+				free(frames);
+				free(imageData);
+				imageData = atlas;
+			}
+			if(imageData)
+			{
+				generateStoredTexture(&entry->tex, entry->width, entry->height, entry->format, entry->store, imageData);
+				free(imageData);
+				reloaded = 1;
+			}
+		}
+	}
+	// Sprites sharing this image may still hold the old handle.
+	sprite->tex = entry->tex;
+	if(reloaded)
+	{
+		// Its LOD chain was dropped along with it.
+		if(entry->numLODs)
+			entry->numLODs = buildLODChain(sprite, entry->numLODs, entry->lods);
+		textureBytes += cachedTextureBytes(entry);
+		++reloads;
+	}
+	
+	// Move it to the front of the line.
+	if(entry != lruHead)
+	{
+		unlinkResident(entry);
+		linkResident(entry);
+	}
+	enforceBudget(entry);
+}
+
+/*
+	Looks up a texture in the cache by source file, content hash,
+	frame layout and storage. Returns NULL on a miss.
+*/
+static RS_CachedTexture * findCachedTexture(char * path, unsigned long long hash, GLuint frameWidth, GLuint frameHeight,
+											int trimmed, GLuint store)
+{
+	RS_CachedTexture * entry = textureCache[hash%RS_TEXTURE_CACHE_BUCKETS];
+	for(; entry; entry = entry->next)
+	{
+		if(entry->hash == hash &&
+			entry->frameWidth == frameWidth &&
+			entry->frameHeight == frameHeight &&
+			(entry->frames != NULL) == trimmed &&
+			entry->store == store &&
+			strcmp(entry->path, path) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+	Builds the 1-bit alpha mask of an image from its texels.
+	Formats without alpha are opaque all over.
+	
+	Parameters:
+		width, height (GLuint): The size of the image.
+		format (RS_RGB(A)): The format of the image.
+		imageData (unsigned char*): The image's texels.
+		stride (GLuint*): Receives how many words each row takes.
+	
+	Returns:
+		The mask, which the caller frees.
+*/
+static uint64_t * buildAlphaMask(GLuint width, GLuint height, GLuint format, unsigned char * imageData,
+								GLuint * stride)
+{
+	GLuint x, y;
+	GLuint texelBytes = formatBytes(format);
+	// Where the alpha term sits in a texel, if there is one.
+	int alpha = format == RS_RGBA ? 3 : format == RS_LUMINANCE_ALPHA ? 1 : -1;
+	uint64_t * mask;
+	
+	*stride = (width+63)/64;
+	mask = calloc((size_t)*stride*height, sizeof(uint64_t));
+	maskBytes += (size_t)*stride*height*sizeof(uint64_t);
+	for(y = 0; y < height; y++)
+	{
+		uint64_t * row = &mask[(size_t)y**stride];
+		unsigned char * texel = &imageData[(size_t)y*width*texelBytes];
+		for(x = 0; x < width; x++, texel += texelBytes)
+			if(alpha < 0 || texel[alpha])
+				row[x>>6] |= (uint64_t)1 << (x&63);
+	}
+	return mask;
+}
+
+/*
+	Uploads an image, filing it away in the texture cache with a
+	single reference.
+*/
+static RS_CachedTexture * mkCachedTexture(char * path, unsigned long long hash, GLuint frameWidth, GLuint frameHeight,
+										GLuint width, GLuint height, GLuint format, GLuint store,
+										unsigned char * imageData)
+{
+	RS_CachedTexture * entry = malloc(sizeof(RS_CachedTexture));
+	entry->path = malloc(strlen(path)+1);
+	strcpy(entry->path, path);
+	entry->hash = hash;
+	entry->frameWidth = frameWidth;
+	entry->frameHeight = frameHeight;
+	entry->width = width;
+	entry->height = height;
+	entry->format = format;
+	entry->store = store;
+	entry->pixels = NULL;
+	entry->pack = NULL;
+	entry->frames = NULL;
+	entry->sheetWidth = width;
+	entry->sheetHeight = height;
+	entry->numLODs = 0;
+	entry->readFBO = RS_NULL_FBO;
+	entry->refs = 1;
+	
+	// Note down which texels can be hit while the image data is
+	// still in hand.
+	entry->mask = buildAlphaMask(width, height, format, imageData, &entry->maskStride);
+	
+	// Upload the image.
+	generateStoredTexture(&entry->tex, width, height, format, store, imageData);
+	textureBytes += cachedTextureBytes(entry);
+	
+	// File it under its hash.
+	entry->next = textureCache[hash%RS_TEXTURE_CACHE_BUCKETS];
+	textureCache[hash%RS_TEXTURE_CACHE_BUCKETS] = entry;
+	linkResident(entry);
+	return entry;
+}
+
+/*
+	Unmaps a sprite pack and frees it.
+*/
+static void freePack(RS_Pack * pack)
+{
+	#ifdef _WIN32
+	free(pack->data);
+	#else
+	munmap(pack->data, pack->size);
+	#endif
+	free(pack->path);
+	free(pack);
+}
+
+/*
+	Gives up a sprite's reference to its cached texture, deleting
+	the texture along with the last reference.
+*/
+static void releaseCachedTexture(RS_CachedTexture * entry)
+{
+	RS_CachedTexture ** link;
+	if(--entry->refs > 0)
+	{
+		cacheSavedBytes -= storedTexelBytes(entry->width, entry->height, entry->format, entry->store);
+		return;
+	}
+	
+	// Anything baked from it goes too.
+	forgetImageBakes(entry);
+	
+	// Pull it out of its bucket.
+	link = &textureCache[entry->hash%RS_TEXTURE_CACHE_BUCKETS];
+	while(*link != entry) link = &(*link)->next;
+	*link = entry->next;
+	unlinkResident(entry);
+	
+	textureBytes -= cachedTextureBytes(entry);
+	glDeleteTextures(1, &entry->tex);
+	if(entry->numLODs && entry->tex != RS_NULL_TEXTURE)
+		glDeleteTextures(entry->numLODs, entry->lods);
+	releaseReadFramebuffer(&entry->readFBO);
+	maskBytes -= (size_t)entry->maskStride*entry->height*sizeof(uint64_t);
+	free(entry->mask);
+	free(entry->frames);
+	free(entry->path);
+	// A pack closed early is held on to until its last image goes.
+	if(entry->pack && --entry->pack->users == 0 && entry->pack->closed)
+		freePack(entry->pack);
+	free(entry);
+}
+
+/*
+	Takes another reference to a cached texture, on account of
+	a sprite having been found to share it.
+*/
+static void retainCachedTexture(RS_CachedTexture * entry)
+{
+	++entry->refs;
+	++cacheHits;
+	cacheSavedBytes += storedTexelBytes(entry->width, entry->height, entry->format, entry->store);
+}
+
+/*
+	Creates a sprite around a cached texture, the reference to
+	which the sprite takes over. A frame size of zero means the
+	frame is the whole image.
+*/
+static RS_Sprite * mkSpriteFromCachedTexture(RS_CachedTexture * entry, GLuint frameWidth, GLuint frameHeight)
+{
+	// Create an instance of RS_Sprite around the shared image.
+	RS_Sprite * sprite = generateRawSprite();
+	sprite->image = entry;
+	sprite->tex = entry->tex;
+	sprite->imageWidth = entry->width;
+	sprite->imageHeight = entry->height;
+	sprite->format = entry->format;
+	
+	// Keep the framebuffer the size of a single frame.
+	sprite->width = frameWidth ? frameWidth : sprite->imageWidth;
+	sprite->height = frameHeight ? frameHeight : sprite->imageHeight;
+	
+	// The sprite's framebuffer is created when it's first needed.
+	deferredAttachmentBytes += spriteAttachmentBytes(sprite);
+	
+	// Make the image the most recently used, which may be what
+	// pushes something else out.
+	touchSprite(sprite);
+	return sprite;
+}
+
+/*
+	Creates a sprite from a PNG, with frames of the given size.
+	A frame size of zero means the frame is the whole image.
+	Images already in the texture cache are neither decoded nor
+	uploaded again; the new sprite shares the existing texture.
+	Trimmed images are cached apart from untrimmed ones, and images
+	kept in one storage format apart from those in another.
+*/
+static RS_Sprite * loadSpriteFromPNG(char * filename, GLuint frameWidth, GLuint frameHeight, int trimmed,
+									GLuint store)
+{
+	RS_CachedTexture * entry;
+	unsigned long long hash;
+	unsigned char * file;
+	size_t fileSize;
+	
+	// Read the file in, so we can tell by its contents whether
+	// we've seen it before.
+	file = readFile(filename, &fileSize);
+	if(!file) return NULL;
+	hash = hashBytes(file, fileSize);
+	
+	store = usableStore(store);
+	entry = findCachedTexture(filename, hash, frameWidth, frameHeight, trimmed, store);
+	if(entry)
+	{
+		// Seen it. Take another reference.
+		retainCachedTexture(entry);
+	}
+	else
+	{
+		GLuint width, height, format;
+		unsigned char * imageData = decodePNG(file, fileSize, &width, &height, &format);
+		RS_TrimmedFrame * frames = NULL;
+		GLuint sheetWidth = width, sheetHeight = height;
+		++cacheMisses;
+		if(!imageData) return NULL;
+		// Swap the sheet for its trimmed frames, packed. Sheets
+		// smaller than a frame are kept as they are.
+		if(width < frameWidth || height < frameHeight)
+			trimmed = 0;
+		if(trimmed)
+		{
+			unsigned char * atlas;
+			sheetWidth = width/frameWidth*frameWidth;
+			sheetHeight = height/frameHeight*frameHeight;
+			atlas = trimFrames(imageData, width, height, format, frameWidth, frameHeight,
+								&frames, &width, &height);
+			free(imageData);
+			imageData = atlas;
+		}
+		// Upload the image, then get rid of our copy of it.
+		entry = mkCachedTexture(filename, hash, frameWidth, frameHeight, width, height, format, store, imageData);
+		entry->frames = frames;
+		entry->sheetWidth = sheetWidth;
+		entry->sheetHeight = sheetHeight;
+		free(imageData);
+	}
+	
+	// At long last!
+	return mkSpriteFromCachedTexture(entry, frameWidth, frameHeight);
+}
+
+RS_Sprite * RS_mkSpriteFromPNG(char * filename)
+{
+	return loadSpriteFromPNG(filename, 0, 0, 0, RS_STORE_NATIVE);
+}
+
+RS_Sprite * RS_mkAnimatedSpriteFromPNG(char * filename, GLuint frameWidth, GLuint frameHeight)
+{
+	return loadSpriteFromPNG(filename, frameWidth, frameHeight, 0, RS_STORE_NATIVE);
+}
+
+RS_Sprite * RS_mkTrimmedSpriteFromPNG(char * filename, GLuint frameWidth, GLuint frameHeight)
+{
+	// Without whole frames there's nothing to trim.
+	if(frameWidth == 0 || frameHeight == 0)
+		return loadSpriteFromPNG(filename, frameWidth, frameHeight, 0, RS_STORE_NATIVE);
+	return loadSpriteFromPNG(filename, frameWidth, frameHeight, 1, RS_STORE_NATIVE);
+}
+
+RS_Sprite * RS_mkStoredSpriteFromPNG(char * filename, GLuint frameWidth, GLuint frameHeight, GLuint store)
+{
+	return loadSpriteFromPNG(filename, frameWidth, frameHeight, 0, store);
+}
+
+RS_Sprite * RS_mkAnimatedSpriteFromPNGBuffer(unsigned char * buffer, size_t size, GLuint frameWidth, GLuint frameHeight)
+{
+	RS_Sprite * sprite;
+	GLuint width, height, format;
+	unsigned char * imageData = decodePNG(buffer, size, &width, &height, &format);
+	if(!imageData) return NULL;
+	
+	sprite = generateRawSprite();
+	sprite->imageWidth = width;
+	sprite->imageHeight = height;
+	sprite->format = format;
+	sprite->width = frameWidth ? frameWidth : width;
+	sprite->height = frameHeight ? frameHeight : height;
+	
+	// There's no file to reload this image from, so it stays
+	// out of the texture cache and is never evicted.
+	generateTexture(&sprite->tex, width, height, format, imageData);
+	textureBytes += spriteTextureBytes(sprite);
+	// It still needs a mask for picking, collisions and hulls.
+	sprite->mask = buildAlphaMask(width, height, format, imageData, &sprite->maskStride);
+	free(imageData);
+	deferredAttachmentBytes += spriteAttachmentBytes(sprite);
+	return sprite;
+}
+
+RS_Sprite * RS_mkSpriteFromPNGBuffer(unsigned char * buffer, size_t size)
+{
+	return RS_mkAnimatedSpriteFromPNGBuffer(buffer, size, 0, 0);
+}
+
+void RS_releaseLoadBuffer(void)
+{
+	free(scratch);
+	scratch = NULL;
+	scratchSize = 0;
+}
+
+void RS_deleteSprite(RS_Sprite * sprite)
+{
+	// Delete the FBO and its attachment, if they were ever made.
+	RS_releaseFramebuffer(sprite);
+	deferredAttachmentBytes -= spriteAttachmentBytes(sprite);
+	RS_clearLineOffsets(sprite);
+	// A shared image's chain goes with the image.
+	if(!sprite->image)
+		RS_clearLODs(sprite);
+	RS_clearHull(sprite);
+	// Delete the image texture, unless someone else still uses it.
+	if(sprite->image)
+		releaseCachedTexture(sprite->image);
+	else
+	{
+		forgetImageBakes(sprite);
+		textureBytes -= spriteTextureBytes(sprite);
+		releaseReadFramebuffer(&sprite->readFBO);
+		glDeleteTextures(1, &sprite->tex);
+		maskBytes -= (size_t)sprite->maskStride*sprite->imageHeight*sizeof(uint64_t);
+		free(sprite->mask);
+	}
+	// Free the structure. Bye bye!
+	free(sprite);
+}
+
+RS_Pack * RS_openPack(char * filename)
+{
+	RS_Pack * pack;
+	RS_PackHeader * header;
+	unsigned char * data;
+	size_t size;
+	unsigned long long stamp;
+	
+	#ifdef _WIN32
+	// No mmap() here, so read the whole thing in instead. With
+	// it all in hand anyway, its contents tell builds apart.
+	if(lodepng_load_file(&data, &size, filename))
+		return NULL;
+	stamp = hashBytes(data, size);
+	#else
+	unsigned long long identity[3];
+	struct stat info;
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+	{
+		#ifdef RS_DB_ERRORS
+		fprintf(stderr, "Could not open sprite pack %s\n", filename);
+		#endif
+		return NULL;
+	}
+	if(fstat(fd, &info) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	size = info.st_size;
+	// A rebuilt pack has a new modification time, or at least is
+	// a different size or file.
+	identity[0] = size;
+	identity[1] = (unsigned long long)info.st_mtime;
+	identity[2] = (unsigned long long)info.st_ino;
+	stamp = hashBytes((unsigned char *)identity, sizeof(identity));
+	// Map the pack read-only. Textures are uploaded straight
+	// out of this mapping, and the mapping outlives the file
+	// descriptor.
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return NULL;
+	#endif
+	
+	// Make sure it's a pack at all, and one built for this
+	// machine's byte order.
+	header = (RS_PackHeader *)data;
+	if(size < sizeof(RS_PackHeader) ||
+		memcmp(header->magic, RS_PACK_MAGIC, 4) != 0 ||
+		header->byteOrder != RS_PACK_BYTE_ORDER ||
+		header->version != RS_PACK_VERSION ||
+		size < sizeof(RS_PackHeader)+(size_t)header->numImages*sizeof(RS_PackEntry))
+	{
+		#ifdef RS_DB_ERRORS
+		fprintf(stderr, "%s is not a usable sprite pack\n", filename);
+		#endif
+		#ifdef _WIN32
+		free(data);
+		#else
+		munmap(data, size);
+		#endif
+		return NULL;
+	}
+	
+	pack = malloc(sizeof(RS_Pack));
+	pack->path = malloc(strlen(filename)+1);
+	strcpy(pack->path, filename);
+	pack->data = data;
+	pack->size = size;
+	pack->header = header;
+	pack->entries = (RS_PackEntry *)(data+sizeof(RS_PackHeader));
+	pack->stamp = stamp;
+	pack->users = 0;
+	pack->closed = 0;
+	return pack;
+}
+
+/*
+	Finds the index entry of the named image in a pack.
+	Returns NULL if there's no such image.
+*/
+static RS_PackEntry * findPackEntry(RS_Pack * pack, char * name)
+{
+	unsigned int i;
+	for(i = 0; i < pack->header->numImages; i++)
+	{
+		if(strncmp(pack->entries[i].name, name, RS_PACK_NAME_LENGTH) == 0)
+			return &pack->entries[i];
+	}
+	return NULL;
+}
+
+RS_Sprite * RS_mkSpriteFromPack(RS_Pack * pack, char * name)
+{
+	RS_CachedTexture * entry;
+	RS_PackEntry * image = findPackEntry(pack, name);
+	unsigned long long key[2], hash;
+	if(!image) return NULL;
+	// Don't trust the index to stay within the file.
+	if((size_t)image->pixelOffset+(size_t)image->width*image->height*formatBytes(image->format) > pack->size)
+		return NULL;
+	
+	// Within one build of a pack, the index entry pins down the
+	// image's contents as well as any hash of its pixels would,
+	// and costs nothing to hash. The pack's stamp keeps a rebuilt
+	// pack at the same path from matching images of the old one.
+	key[0] = hashBytes((unsigned char *)image, sizeof(RS_PackEntry));
+	key[1] = pack->stamp;
+	hash = hashBytes((unsigned char *)key, sizeof(key));
+	entry = findCachedTexture(pack->path, hash, image->frameWidth, image->frameHeight, 0, RS_STORE_NATIVE);
+	if(entry)
+		retainCachedTexture(entry);
+	else
+	{
+		++cacheMisses;
+		// No decoding and no copies; the pixels go straight from
+		// the mapping to the GPU. They stay put for reloading.
+		entry = mkCachedTexture(pack->path, hash, image->frameWidth, image->frameHeight,
+								image->width, image->height, image->format, RS_STORE_NATIVE,
+								pack->data+image->pixelOffset);
+		entry->pixels = pack->data+image->pixelOffset;
+		entry->pack = pack;
+		++pack->users;
+	}
+	return mkSpriteFromCachedTexture(entry, image->frameWidth, image->frameHeight);
+}
+
+unsigned char * RS_getPackPalette(RS_Pack * pack, char * name, unsigned int * num)
+{
+	RS_PackEntry * image = findPackEntry(pack, name);
+	*num = 0;
+	if(!image || image->paletteSize == 0) return NULL;
+	// Don't trust the index to stay within the file.
+	if((size_t)image->paletteOffset+(size_t)image->paletteSize*4 > pack->size)
+		return NULL;
+	*num = image->paletteSize;
+	return pack->data+image->paletteOffset;
+}
+
+void RS_closePack(RS_Pack * pack)
+{
+	if(pack->users == 0)
+	{
+		freePack(pack);
+		return;
+	}
+	// Images still reload from the mapping, so it stays until the
+	// last of them is released.
+	#ifdef RS_DB_ERRORS
+	fprintf(stderr, "Warning: %s closed with %u images still in use\n", pack->path, pack->users);
+	#endif
+	pack->closed = 1;
+}
+
+void RS_releaseFramebuffer(RS_Sprite * sprite)
+{
+	if(sprite->fbo == RS_NULL_FBO) return;
+	
+	glDeleteFramebuffersEXT(1, &sprite->fbo);
+	glDeleteTextures(1, &sprite->att);
+	sprite->fbo = RS_NULL_FBO;
+	sprite->att = RS_NULL_TEXTURE;
+	
+	// The bytes go back to being merely potential.
+	attachmentBytes -= spriteAttachmentBytes(sprite);
+	deferredAttachmentBytes += spriteAttachmentBytes(sprite);
+}
+
+RS_Color * RS_mkColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+	RS_Color *color = malloc(sizeof(RS_Color));
+	
+	color->r = r;
+	color->g = g;
+	color->b = b;
+	color->a = a;
+	return color;
+}
+
+void RS_deleteColor(RS_Color * color)
+{
+	free(color);
+}
+
+/*
+	Allocates a palette and its color storage in one block.
+*/
+static RS_Palette * allocPalette(unsigned int capacity)
+{
+	RS_Palette * p;
+	if(capacity == 0) capacity = 1;
+	if(capacity > RS_MAX_PALETTE_ENTRIES) capacity = RS_MAX_PALETTE_ENTRIES;
+	p = malloc(sizeof(RS_Palette)+sizeof(GLfloat)*8*capacity);
+	p->keyTerms = (GLfloat *)(p+1);
+	p->entryTerms = p->keyTerms+4*capacity;
+	p->keys = NULL;
+	p->entries = NULL;
+	p->numColors = 0;
+	p->num = 0;
+	p->capacity = capacity;
+	p->version = ++paletteVersions;
+	return p;
+}
+
+/*
+	Copies an RS_Color into four packed terms.
+*/
+static void storeColor(GLfloat * terms, RS_Color * color)
+{
+	terms[0] = color->r;
+	terms[1] = color->g;
+	terms[2] = color->b;
+	terms[3] = color->a;
+}
+
+/*
+	Copies a palette's RS_Colors, if it was made from any, into
+	its packed terms.
+*/
+static void loadPaletteColors(RS_Palette * palette)
+{
+	unsigned int i;
+	for(i = 0; i < palette->numColors; i++)
+	{
+		storeColor(&palette->keyTerms[i*4], palette->keys[i]);
+		storeColor(&palette->entryTerms[i*4], palette->entries[i]);
+	}
+}
+
+RS_Palette * RS_mkPalette(RS_Color ** keys, RS_Color ** entries, unsigned int numPairs)
+{
+	RS_Palette *p = allocPalette(RS_MAX_PALETTE_ENTRIES);
+	// The palette keeps hold of the colors, as it always has, so
+	// RS_scrubPalette() can free them.
+	p->keys = keys;
+	p->entries = entries;
+	p->numColors = numPairs > p->capacity ? p->capacity : numPairs;
+	loadPaletteColors(p);
+	p->num = p->numColors;
+	return p;
+}
+
+RS_Palette * RS_mkPackedPalette(unsigned int capacity)
+{
+	return allocPalette(capacity);
+}
+
+void RS_setPaletteColors(RS_Palette * palette, const GLfloat * keys, const GLfloat * entries, unsigned int num)
+{
+	if(num > palette->capacity) num = palette->capacity;
+	memcpy(palette->keyTerms, keys, sizeof(GLfloat)*4*num);
+	memcpy(palette->entryTerms, entries, sizeof(GLfloat)*4*num);
+	palette->num = num;
+	touchPalette(palette);
+}
+
+void RS_setPaletteColorsRGBA8(RS_Palette * palette, const unsigned char * keys,
+								const unsigned char * entries, unsigned int num)
+{
+	unsigned int i;
+	if(num > palette->capacity) num = palette->capacity;
+	for(i = 0; i < num*4; i++)
+	{
+		palette->keyTerms[i] = keys[i]/255.0f;
+		palette->entryTerms[i] = entries[i]/255.0f;
+	}
+	palette->num = num;
+	touchPalette(palette);
+}
+
+void RS_scrubPalette(RS_Palette * palette)
+{
+	unsigned int i;
+	// Free the colors the palette was made from. The arrays
+	// holding them are the caller's.
+	for(i = 0; i < palette->numColors; i++)
+	{
+		RS_deleteColor(palette->keys[i]);
+		RS_deleteColor(palette->entries[i]);
+	}
+	palette->keys = NULL;
+	palette->entries = NULL;
+	palette->numColors = 0;
+	RS_clearColorReplacements(palette);
+}
+
+void RS_deletePalette(RS_Palette * palette)
+{
+	forgetPaletteBakes(palette);
+	free(palette);
+}
+
+void RS_invalidatePalette(RS_Palette * palette)
+{
+	// Edits may have gone through the RS_Colors it was made from.
+	loadPaletteColors(palette);
+	touchPalette(palette);
+}
+
+void RS_setRotation(RS_Sprite * sprite, GLfloat rads)
+{
+	sprite->rotation = rads;
+}
+
+void RS_setScale(RS_Sprite * sprite, GLfloat x, GLfloat y)
+{
+	sprite->scaleX = x;
+	sprite->scaleY = y;
+}
+
+void RS_setPosition(RS_Sprite * sprite, GLint x, GLint y)
+{
+	sprite->posX = x;
+	sprite->posY = y;
+}
+
+void RS_setTint(RS_Sprite * sprite, RS_Color * tint)
+{
+	sprite->tint = tint;
+}
+
+void RS_setSwapHeight(RS_Sprite * sprite, GLint height)
+{
+	sprite->swapHeight = height;
+}
+
+/*
+	Warns when a sprite being given palettes keeps its image in a
+	format whose colors won't match their keys.
+*/
+static void checkPaletteStore(RS_Sprite * sprite)
+{
+	if(!sprite->image || storeKeepsColors(sprite->image->store)) return;
+	#ifdef RS_DB_ERRORS
+	printf("Warning: %s is stored lossily, so palette keys may not match its colors.\n",
+			sprite->image->path);
+	#endif
+}
+
+void RS_setPaletteA(RS_Sprite * sprite, RS_Palette * palette)
+{
+	if(palette) checkPaletteStore(sprite);
+	sprite->paletteA = palette;
+}
+
+void RS_setPaletteB(RS_Sprite * sprite, RS_Palette * palette)
+{
+	if(palette) checkPaletteStore(sprite);
+	sprite->paletteB = palette;
+}
+
+void RS_setLineOffsets(RS_Sprite * sprite, GLuint first, GLuint count, const GLfloat * offsets)
+{
+	unsigned char * texels;
+	unsigned int i, j;
+	// The table covers every line of the frame, and starts out
+	// shifting none of them.
+	if(sprite->lineOffsets == RS_NULL_TEXTURE)
+	{
+		sprite->numLineOffsets = sprite->height ? sprite->height : 1;
+		texels = malloc(sprite->numLineOffsets*4);
+		for(i = 0; i < sprite->numLineOffsets*2; i++)
+		{
+			texels[i*2+0] = RS_LINE_OFFSET_BIAS >> 8;
+			texels[i*2+1] = RS_LINE_OFFSET_BIAS & 255;
+		}
+		generateTexture(&sprite->lineOffsets, sprite->numLineOffsets, 1, RS_RGBA, texels);
+		free(texels);
+	}
+	if(first >= sprite->numLineOffsets) return;
+	if(count > sprite->numLineOffsets-first) count = sprite->numLineOffsets-first;
+	if(count == 0) return;
+	
+	// Each offset goes in as 12.4 fixed point, biased to stay
+	// positive, high byte first.
+	texels = malloc(count*4);
+	for(i = 0; i < count*2; i++)
+	{
+		GLfloat offset = offsets[i];
+		long fixed;
+		if(offset < -RS_MAX_LINE_OFFSET) offset = -RS_MAX_LINE_OFFSET;
+		if(offset > RS_MAX_LINE_OFFSET) offset = RS_MAX_LINE_OFFSET;
+		fixed = lroundf(offset*16.0f)+RS_LINE_OFFSET_BIAS;
+		if(fixed > 65535) fixed = 65535;
+		j = i*2;
+		texels[j+0] = (unsigned char)(fixed >> 8);
+		texels[j+1] = (unsigned char)(fixed & 255);
+	}
+	// Only the lines that changed go over.
+	glBindTexture(GL_TEXTURE_2D, sprite->lineOffsets);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, first, 0, count, 1, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+	free(texels);
+}
+
+void RS_buildLODs(RS_Sprite * sprite, GLuint levels)
+{
+	GLuint * lods;
+	GLuint built;
+	
+	RS_clearLODs(sprite);
+	// Trimmed frames are all different sizes, so they don't halve
+	// neatly, and empty ones have nothing to halve.
+	if(sprite->image && sprite->image->frames) return;
+	if(sprite->width == 0 || sprite->height == 0) return;
+	if(levels > RS_MAX_LOD_LEVELS) levels = RS_MAX_LOD_LEVELS;
+	// The image has to be on the GPU to read it back.
+	touchSprite(sprite);
+	if(levels == 0 || sprite->tex == RS_NULL_TEXTURE) return;
+	
+	lods = spriteLODs(sprite);
+	built = buildLODChain(sprite, levels, lods);
+	if(sprite->image)
+		sprite->image->numLODs = built;
+	else
+		sprite->numLODs = built;
+	textureBytes += lodChainBytes(sprite->width, sprite->height, sprite->imageWidth, sprite->imageHeight, built);
+	// A shared chain counts against the budget along with its image.
+	if(sprite->image)
+		enforceBudget(sprite->image);
+}
+
+void RS_clearLODs(RS_Sprite * sprite)
+{
+	GLuint * lods = spriteLODs(sprite);
+	GLuint numLODs = spriteNumLODs(sprite);
+	textureBytes -= spriteLODBytes(sprite);
+	// An evicted image's chain is already gone.
+	if(numLODs && (!sprite->image || sprite->image->tex != RS_NULL_TEXTURE))
+		glDeleteTextures(numLODs, lods);
+	if(sprite->image)
+		sprite->image->numLODs = 0;
+	else
+		sprite->numLODs = 0;
+}
+
+/*
+	A corner of a hull, in texels of the stored part of a frame.
+*/
+typedef struct
+{
+	double x, y;
+} RS_HullPoint;
+
+/*
+	Orders hull points left to right, then top to bottom.
+*/
+static int compareHullPoints(const void * a, const void * b)
+{
+	const RS_HullPoint * pointA = a;
+	const RS_HullPoint * pointB = b;
+	if(pointA->x != pointB->x) return pointA->x < pointB->x ? -1 : 1;
+	if(pointA->y != pointB->y) return pointA->y < pointB->y ? -1 : 1;
+	return 0;
+}
+
+/*
+	Which way o, a and b turn: positive one way, negative the
+	other, and zero if they're in a line.
+*/
+static double turn(RS_HullPoint o, RS_HullPoint a, RS_HullPoint b)
+{
+	return (a.x-o.x)*(b.y-o.y)-(a.y-o.y)*(b.x-o.x);
+}
+
+/*
+	Removes the edge of a convex polygon whose removal grows it the
+	least: the edge's two corners are swapped for the point where
+	the edges on either side meet. The result still holds the whole
+	polygon. Returns 0 if no edge can go.
+*/
+static int dropHullEdge(RS_HullPoint * hull, GLuint * num)
+{
+	GLuint n = *num, i, best = 0;
+	double bestArea = -1.0;
+	RS_HullPoint bestPoint = {0.0, 0.0};
+	for(i = 0; i < n; i++)
+	{
+		RS_HullPoint p = hull[(i+n-1)%n], a = hull[i], b = hull[(i+1)%n], q = hull[(i+2)%n];
+		double dx1 = a.x-p.x, dy1 = a.y-p.y, dx2 = b.x-q.x, dy2 = b.y-q.y;
+		double denominator = dx1*dy2-dy1*dx2, t, s, area;
+		if(fabs(denominator) < 1e-9) continue;
+		// The neighbouring edges have to meet past this one.
+		t = ((b.x-a.x)*dy2-(b.y-a.y)*dx2)/denominator;
+		s = ((b.x-a.x)*dy1-(b.y-a.y)*dx1)/denominator;
+		if(t <= 0.0 || s <= 0.0) continue;
+		RS_HullPoint meet = {a.x+t*dx1, a.y+t*dy1};
+		area = fabs(turn(a, meet, b));
+		if(bestArea < 0.0 || area < bestArea)
+		{
+			bestArea = area;
+			bestPoint = meet;
+			best = i;
+		}
+	}
+	if(bestArea < 0.0) return 0;
+	hull[best] = bestPoint;
+	i = (best+1)%n;
+	memmove(&hull[i], &hull[i+1], sizeof(RS_HullPoint)*(n-i-1));
+	*num = n-1;
+	return 1;
+}
+
+/*
+	Clips a convex polygon to one side of a line of constant X (axis
+	0) or Y (axis 1), keeping the side below the bound, or above it.
+	Returns how many corners are left, which is at most one more.
+*/
+static GLuint clipHull(const RS_HullPoint * in, GLuint n, RS_HullPoint * out, int axis, double bound, int below)
+{
+	GLuint i, num = 0;
+	for(i = 0; i < n; i++)
+	{
+		RS_HullPoint a = in[i], b = in[(i+1)%n];
+		double da = (axis ? a.y : a.x)-bound, db = (axis ? b.y : b.x)-bound;
+		int insideA = below ? da <= 0.0 : da >= 0.0;
+		int insideB = below ? db <= 0.0 : db >= 0.0;
+		if(insideA) out[num++] = a;
+		if(insideA != insideB)
+		{
+			double t = da/(da-db);
+			RS_HullPoint cross = {a.x+(b.x-a.x)*t, a.y+(b.y-a.y)*t};
+			out[num++] = cross;
+		}
+	}
+	return num;
+}
+
+/*
+	Builds the hull of the visible texels of one frame, given where
+	its stored part is. Writes X, Y, U and V for each corner, relative
+	to the stored part, along with how much of it the hull covers.
+	Returns how many corners there are.
+*/
+static GLuint buildFrameHull(const uint64_t * mask, GLuint maskStride, const GLuint * rect,
+							GLuint imageX, GLuint imageY, GLfloat * vertices, GLfloat * coverage)
+{
+	GLuint width = rect[2], height = rect[3], num = 0, n = 0, i, x, y, k;
+	RS_HullPoint * points, * hull, clipped[RS_MAX_HULL_VERTICES];
+	double area = 0.0;
+	*coverage = 0.0;
+	if(width == 0 || height == 0) return 0;
+	
+	// The outer corners of the first and last visible texel of each
+	// row are all the hull can touch.
+	points = malloc(sizeof(RS_HullPoint)*height*4);
+	hull = malloc(sizeof(RS_HullPoint)*(height*4+1));
+	for(y = 0; y < height; y++)
+	{
+		const uint64_t * row = &mask[(size_t)(imageY+y)*maskStride];
+		long first = -1, last = -1;
+		for(x = imageX; x < imageX+width; x++)
+		{
+			if(!((row[x>>6] >> (x&63)) & 1)) continue;
+			if(first < 0) first = x-imageX;
+			last = x-imageX;
+		}
+		if(first < 0) continue;
+		points[num].x = first; points[num++].y = y;
+		points[num].x = first; points[num++].y = y+1;
+		points[num].x = last+1; points[num++].y = y;
+		points[num].x = last+1; points[num++].y = y+1;
+	}
+	
+	// Monotone chain: the bottom half of the hull, then the top.
+	qsort(points, num, sizeof(RS_HullPoint), compareHullPoints);
+	for(i = 0; i < num; i++)
+	{
+		while(n >= 2 && turn(hull[n-2], hull[n-1], points[i]) <= 0.0) --n;
+		hull[n++] = points[i];
+	}
+	for(i = num-1, k = n+1; num && i-- > 0;)
+	{
+		while(n >= k && turn(hull[n-2], hull[n-1], points[i]) <= 0.0) --n;
+		hull[n++] = points[i];
+	}
+	if(n > 0) --n;	// The last point repeats the first.
+	free(points);
+	
+	// Fit it in the room left over after clipping, which can add a
+	// corner per side.
+	while(n > RS_MAX_HULL_VERTICES-4 && dropHullEdge(hull, &n))
+		;
+	// Loosening can push corners out of the frame, where the image
+	// holds other frames' texels.
+	if(n >= 3)
+	{
+		RS_HullPoint scratchHull[RS_MAX_HULL_VERTICES];
+		n = clipHull(hull, n, scratchHull, 0, 0.0, 0);
+		n = clipHull(scratchHull, n, clipped, 0, width, 1);
+		n = clipHull(clipped, n, scratchHull, 1, 0.0, 0);
+		n = clipHull(scratchHull, n, clipped, 1, height, 1);
+	}
+	free(hull);
+	if(n < 3) return 0;
+	
+	for(i = 0; i < n; i++)
+		area += clipped[i].x*clipped[(i+1)%n].y-clipped[(i+1)%n].x*clipped[i].y;
+	*coverage = (GLfloat)(fabs(area)*.5/((double)width*height));
+	
+	// Hulls that barely save anything aren't worth the extra
+	// triangles.
+	if(*coverage > RS_HULL_QUAD_COVERAGE)
+	{
+		RS_HullPoint quad[4] = {{0.0, 0.0}, {width, 0.0}, {width, height}, {0.0, height}};
+		memcpy(clipped, quad, sizeof(quad));
+		n = 4;
+		*coverage = 1.0;
+	}
+	for(i = 0; i < n; i++)
+	{
+		vertices[i*4+0] = vertices[i*4+2] = (GLfloat)(clipped[i].x/width);
+		vertices[i*4+1] = vertices[i*4+3] = (GLfloat)(clipped[i].y/height);
+	}
+	return n;
+}
+
+void RS_buildHull(RS_Sprite * sprite)
+{
+	GLuint sheetWidth, sheetHeight, f, rect[4], imageX, imageY, maskStride;
+	const uint64_t * mask = spriteMask(sprite, &maskStride);
+	GLfloat * vertices;
+	RS_Hull * hull;
+	RS_clearHull(sprite);
+	// The hulls come from the alpha mask.
+	if(!mask) return;
+	
+	sheetSize(sprite, &sheetWidth, &sheetHeight);
+	hull = malloc(sizeof(RS_Hull));
+	hull->numFrames = (sheetWidth/sprite->width)*(sheetHeight/sprite->height);
+	hull->counts = malloc(hull->numFrames ? hull->numFrames : 1);
+	hull->coverage = malloc(sizeof(GLfloat)*(hull->numFrames ? hull->numFrames : 1));
+	vertices = calloc((size_t)hull->numFrames*RS_MAX_HULL_VERTICES*4+1, sizeof(GLfloat));
+	for(f = 0; f < hull->numFrames; f++)
+	{
+		frameRectAt(sprite, f, rect, &imageX, &imageY);
+		hull->counts[f] = buildFrameHull(mask, maskStride, rect, imageX, imageY,
+										&vertices[(size_t)f*RS_MAX_HULL_VERTICES*4], &hull->coverage[f]);
+	}
+	
+	// Every frame's fan goes in one buffer.
+	glGenBuffers(1, &hull->buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, hull->buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*hull->numFrames*RS_MAX_HULL_VERTICES*4,
+				vertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, RS_NULL_BUFFER);
+	free(vertices);
+	sprite->hull = hull;
+}
+
+void RS_clearHull(RS_Sprite * sprite)
+{
+	if(!sprite->hull) return;
+	glDeleteBuffers(1, &sprite->hull->buffer);
+	free(sprite->hull->counts);
+	free(sprite->hull->coverage);
+	free(sprite->hull);
+	sprite->hull = NULL;
+}
+
+void RS_clearLineOffsets(RS_Sprite * sprite)
+{
+	if(sprite->lineOffsets == RS_NULL_TEXTURE) return;
+	glDeleteTextures(1, &sprite->lineOffsets);
+	sprite->lineOffsets = RS_NULL_TEXTURE;
+	sprite->numLineOffsets = 0;
+}
+
+RS_PaletteBands * RS_mkPaletteBands(GLuint lines, GLuint space)
+{
+	RS_PaletteBands * bands = malloc(sizeof(RS_PaletteBands));
+	unsigned int i;
+	for(i = 0; i < RS_MAX_BAND_PALETTES; i++)
+	{
+		bands->palettes[i] = NULL;
+		bands->versions[i] = 0;
+		bands->counts[i] = 0;
+	}
+	if(lines == 0) lines = 1;
+	bands->lines = lines;
+	bands->space = space;
+	bands->bands = malloc(lines);
+	memset(bands->bands, 255, lines);
+	// The textures are made at the first draw.
+	bands->tableTex = RS_NULL_TEXTURE;
+	bands->bandTex = RS_NULL_TEXTURE;
+	bands->dirty = 1;
+	return bands;
+}
+
+void RS_setBandPalette(RS_PaletteBands * bands, GLuint index, RS_Palette * palette)
+{
+	if(index >= RS_MAX_BAND_PALETTES) return;
+	bands->palettes[index] = palette;
+	// Force the slot to upload, and the lines using it with it.
+	bands->versions[index] = 0;
+	bands->counts[index] = 0;
+	bands->dirty = 1;
+}
+
+void RS_setPaletteBand(RS_PaletteBands * bands, GLuint top, GLuint bottom, GLint index)
+{
+	if(index >= RS_MAX_BAND_PALETTES) return;
+	if(bottom > bands->lines) bottom = bands->lines;
+	if(top >= bottom) return;
+	memset(&bands->bands[top], index < 0 ? 255 : index, bottom-top);
+	bands->dirty = 1;
+}
+
+void RS_setPaletteBands(RS_Sprite * sprite, RS_PaletteBands * bands)
+{
+	if(bands) checkPaletteStore(sprite);
+	sprite->paletteBands = bands;
+}
+
+void RS_deletePaletteBands(RS_PaletteBands * bands)
+{
+	if(bands->tableTex != RS_NULL_TEXTURE) glDeleteTextures(1, &bands->tableTex);
+	if(bands->bandTex != RS_NULL_TEXTURE) glDeleteTextures(1, &bands->bandTex);
+	free(bands->bands);
+	free(bands);
+}
+
+void RS_clearTransforms(RS_Sprite * sprite)
+{
+	// zero out all the things.
+	sprite->rotation = 0.0;
+	sprite->posX = 0;
+	sprite->posY = 0;
+	sprite->scaleX = 1.0;
+	sprite->scaleY = 1.0;
+	sprite->tint = NULL;
+}
+	
+/*
+	Brings a band table's textures up to date with its palettes
+	and bands. Only palettes whose versions changed are uploaded
+	again; the band texture is tiny, so it's redone whenever
+	anything changed.
+*/
+static void syncPaletteBands(RS_PaletteBands * bands)
+{
+	unsigned char row[RS_MAX_PALETTE_ENTRIES*2*4];
+	unsigned int i, j;
+	int changed = bands->dirty;
+	
+	if(bands->tableTex == RS_NULL_TEXTURE)
+	{
+		generateTexture(&bands->tableTex, RS_MAX_PALETTE_ENTRIES*2, RS_MAX_BAND_PALETTES, RS_RGBA, NULL);
+		generateTexture(&bands->bandTex, bands->lines, 1, RS_RGBA, NULL);
+	}
+	
+	// Each palette is a row: its keys, then its entries.
+	glBindTexture(GL_TEXTURE_2D, bands->tableTex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for(i = 0; i < RS_MAX_BAND_PALETTES; i++)
+	{
+		RS_Palette * palette = bands->palettes[i];
+		if(!palette || palette->version == bands->versions[i]) continue;
+		memset(row, 0, sizeof(row));
+		// Keys no 8-bit texel could match are left out, rather
+		// than rounded into matching something they shouldn't.
+		bands->counts[i] = 0;
+		for(j = 0; j < palette->num && j < RS_MAX_PALETTE_ENTRIES; j++)
+		{
+			const GLfloat * terms = &palette->keyTerms[j*4];
+			unsigned int key = packColor(terms);
+			unsigned int entry = packColor(&palette->entryTerms[j*4]);
+			if(colorTermByte(terms[0]) < 0 || colorTermByte(terms[1]) < 0 ||
+				colorTermByte(terms[2]) < 0 || colorTermByte(terms[3]) < 0)
+				continue;
+			memcpy(&row[bands->counts[i]*4], &key, 4);
+			memcpy(&row[(RS_MAX_PALETTE_ENTRIES+bands->counts[i])*4], &entry, 4);
+			++bands->counts[i];
+		}
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i, RS_MAX_PALETTE_ENTRIES*2, 1, GL_RGBA, GL_UNSIGNED_BYTE, row);
+		bands->versions[i] = palette->version;
+		changed = 1;
+	}
+	
+	// Each line gets its palette's row and length, less one,
+	// since lengths run up to 256. Empty palettes count as none.
+	if(changed)
+	{
+		unsigned char * texels = malloc(bands->lines*4);
+		for(i = 0; i < bands->lines; i++)
+		{
+			unsigned char index = bands->bands[i];
+			if(index >= RS_MAX_BAND_PALETTES || !bands->palettes[index] || bands->counts[index] == 0)
+				index = 255;
+			texels[i*4+0] = index;
+			texels[i*4+1] = index == 255 ? 0 : bands->counts[index]-1;
+			texels[i*4+2] = 0;
+			texels[i*4+3] = 255;
+		}
+		glBindTexture(GL_TEXTURE_2D, bands->bandTex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bands->lines, 1, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+		free(texels);
+		bands->dirty = 0;
+	}
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+}
+
+/*
+	Uploads a palette to the given uniforms. The terms are already
+	packed the way the shader wants them, so this is a straight
+	copy. Palettes longer than the variant's arrays are cut short.
+*/
+static void uploadPalette(RS_Palette * palette, GLint keysUniform, GLint entriesUniform, GLint numUniform)
+{
+	unsigned int num = palette->num;
+	if(num > program->paletteCapacity) num = program->paletteCapacity;
+	glUniform4fv(keysUniform, num, palette->keyTerms);
+	glUniform4fv(entriesUniform, num, palette->entryTerms);
+	glUniform1i(numUniform, num);
+}
+
+/*
+	Clears the texture units a band table was bound to.
+*/
+static void unbindPaletteBands(void)
+{
+	glActiveTexture(GL_TEXTURE0+2);
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+	glActiveTexture(GL_TEXTURE0+3);
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+}
+
+/*
+	Clears the texture unit a line offset table was bound to.
+*/
+static void unbindLineOffsets(void)
+{
+	glActiveTexture(GL_TEXTURE0+4);
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+}
+
+/*
+	Updates the color replacement uniforms. The variant in use
+	decides where each palette goes: with one palette, whichever
+	of the sprite's palettes is in use goes into the A slot.
+*/
+static void updateColorSwapUniforms(RS_Sprite * sprite)
+{
+	RS_Palette * a = sprite->paletteA && sprite->paletteA->num ? sprite->paletteA : NULL;
+	RS_Palette * b = sprite->paletteB && sprite->paletteB->num ? sprite->paletteB : NULL;
+	if(a && b)
+	{
+		uploadPalette(a, program->paletteAKeysUniform, program->paletteAEntriesUniform, program->numPaletteAUniform);
+		uploadPalette(b, program->paletteBKeysUniform, program->paletteBEntriesUniform, program->numPaletteBUniform);
+		glUniform1f(program->swapHeightUniform, (GLfloat)sprite->swapHeight);
+	}
+	else if(a || b)
+		uploadPalette(a ? a : b, program->paletteAKeysUniform, program->paletteAEntriesUniform, program->numPaletteAUniform);
+}
+
+void RS_pushColorReplacement(RS_Palette * palette, RS_Color * oldColor, RS_Color * newColor)
+{
+	if(palette->num == palette->capacity) return;
+	storeColor(&palette->keyTerms[palette->num*4], oldColor);
+	storeColor(&palette->entryTerms[palette->num*4], newColor);
+	++palette->num;
+	touchPalette(palette);
+}
+
+void RS_setColorReplacement(RS_Palette * palette, unsigned int index, RS_Color * oldColor, RS_Color * newColor)
+{
+	if(index >= palette->num) return;
+	storeColor(&palette->keyTerms[index*4], oldColor);
+	storeColor(&palette->entryTerms[index*4], newColor);
+	touchPalette(palette);
+}
+
+void RS_popColorReplacement(RS_Palette * palette)
+{
+	if(palette->num == 0) return;
+	--palette->num;
+	touchPalette(palette);
+}
+	
+void RS_clearColorReplacements(RS_Palette * palette)
+{
+	// Clear out the color pairs.
+	palette->num = 0;
+	touchPalette(palette);
+}
+
+/*
+	Updates the uniforms of the shader to the values
+	stored in the given RS_Sprite instance. When the sprite's
+	palette has been baked into its image, the shader is told
+	there are no palettes to apply.
+*/
+static void updateSpriteUniformState(RS_Sprite * sprite, GLuint baked)
+{
+	// Do as told; update all the uniform variables in the shader
+	// to reflect the state of the given sprite.
+	glUniform1f(program->rotationUniform, sprite->rotation);
+	glUniform2f(program->scaleUniform, sprite->scaleX, sprite->scaleY);
+	glUniform2f(program->positionUniform, (GLfloat)sprite->posX, (GLfloat)sprite->posY);
+	// A band table takes the place of both palettes, and sits
+	// in the texture units after the canvas and medium.
+	if(sprite->paletteBands)
+	{
+		RS_PaletteBands * bands = sprite->paletteBands;
+		syncPaletteBands(bands);
+		glActiveTexture(GL_TEXTURE0+2);
+		glBindTexture(GL_TEXTURE_2D, bands->tableTex);
+		glUniform1i(program->paletteTableUniform, 2);
+		glActiveTexture(GL_TEXTURE0+3);
+		glBindTexture(GL_TEXTURE_2D, bands->bandTex);
+		glUniform1i(program->paletteBandsUniform, 3);
+		glUniform1f(program->bandLinesUniform, (GLfloat)bands->lines);
+		glUniform1i(program->bandsInSpriteUniform, bands->space == RS_BANDS_SPRITE);
+	}
+	// A baked palette was left out of the variant altogether.
+	else if(!baked)
+		updateColorSwapUniforms(sprite);	// Populate the color swap uniforms.
+	// The line offsets come after the band table.
+	if(sprite->lineOffsets != RS_NULL_TEXTURE)
+	{
+		glActiveTexture(GL_TEXTURE0+4);
+		glBindTexture(GL_TEXTURE_2D, sprite->lineOffsets);
+		glUniform1i(program->lineOffsetsUniform, 4);
+		glUniform1f(program->offsetLinesUniform, (GLfloat)sprite->numLineOffsets);
+	}
+	// Variants without tinting don't have a tint to set.
+	if(sprite->tint)
+		glUniform4f(program->tintUniform, 
+					sprite->tint->r,
+					sprite->tint->g,
+					sprite->tint->b,
+					sprite->tint->a);
 }
 
 void RS_iterFrame(RS_Sprite * sprite)
 {
-	sprite->frameOffsetX += sprite->width;
-	if(sprite->frameOffsetX >= sprite->imageWidth)
+	GLuint sheetWidth, sheetHeight;
+	sheetSize(sprite, &sheetWidth, &sheetHeight);
+	sprite->frameOffsetX += sprite->width;
+	if(sprite->frameOffsetX >= sheetWidth)
+	{
+		sprite->frameOffsetX = 0;
+		sprite->frameOffsetY += sprite->height;
+	}
+	if(sprite->frameOffsetY >= sheetHeight)
+	{
+		sprite->frameOffsetX = 0;
+		sprite->frameOffsetY = 0;
+	}
+}
+
+/*
+	Returns 1 if a scale, after the viewport's own stretch, lands
+	every texel on a whole number of pixels.
+*/
+static int wholeScale(GLfloat scale)
+{
+	return scale != 0.0 && floorf(scale) == scale;
+}
+
+/*
+	Returns the framebuffer a sprite's image can be read through
+	for a blit, making it the first time. Shared images keep theirs
+	in the cache, and sprites that render straight into their image
+	already have one.
+*/
+static GLuint readFramebuffer(RS_Sprite * sprite)
+{
+	GLuint * fbo;
+	if(!sprite->image && sprite->fbo != RS_NULL_FBO && sprite->att == RS_NULL_TEXTURE)
+		return sprite->fbo;
+	fbo = sprite->image ? &sprite->image->readFBO : &sprite->readFBO;
+	if(*fbo == RS_NULL_FBO)
+	{
+		glGenFramebuffersEXT(1, fbo);
+		glBindFramebufferEXT(GL_READ_FRAMEBUFFER, *fbo);
+		glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sprite->tex, 0);
+	}
+	return *fbo;
+}
+
+/*
+	Returns 1 if the current blend state lets an opaque source
+	replace what's under it outright, as a blit does.
+*/
+static int blendReplacesOpaque(void)
+{
+	GLint equationRGB, equationAlpha, srcRGB, dstRGB, srcAlpha, dstAlpha;
+	if(!glIsEnabled(GL_BLEND)) return 1;
+	glGetIntegerv(GL_BLEND_EQUATION_RGB, &equationRGB);
+	glGetIntegerv(GL_BLEND_EQUATION_ALPHA, &equationAlpha);
+	glGetIntegerv(GL_BLEND_SRC_RGB, &srcRGB);
+	glGetIntegerv(GL_BLEND_DST_RGB, &dstRGB);
+	glGetIntegerv(GL_BLEND_SRC_ALPHA, &srcAlpha);
+	glGetIntegerv(GL_BLEND_DST_ALPHA, &dstAlpha);
+	if(equationRGB != GL_FUNC_ADD || equationAlpha != GL_FUNC_ADD) return 0;
+	if(srcRGB != GL_ONE && srcRGB != GL_SRC_ALPHA) return 0;
+	if(dstRGB != GL_ZERO && dstRGB != GL_ONE_MINUS_SRC_ALPHA) return 0;
+	if(srcAlpha != GL_ONE && srcAlpha != GL_SRC_ALPHA) return 0;
+	if(dstAlpha != GL_ZERO && dstAlpha != GL_ONE_MINUS_SRC_ALPHA) return 0;
+	return 1;
+}
+
+/*
+	Draws a sprite by copying its frame with a framebuffer blit,
+	if the draw is a plain copy: no rotation, a whole number
+	scale, and nothing the shader would change the texels with.
+	Blending has to be off, too, unless the image is opaque and
+	the blend state lets an opaque source replace what's there.
+	Returns 1 if the sprite was drawn, 0 if the shader has to.
+	
+	Parameters:
+		sprite (RS_Sprite*): The resident sprite to draw.
+		fbo (GLuint): The framebuffer to draw it into.
+		width (GLfloat): The width of the target, as drawToTarget().
+		height (GLfloat): The height of the target.
+		toScreen (GLboolean): Whether the target's rows run bottom up.
+*/
+static int blitSprite(RS_Sprite * sprite, GLuint fbo, GLfloat width, GLfloat height, GLboolean toScreen)
+{
+	GLint viewport[4], sampleBuffers;
+	GLuint rect[4], imageX, imageY;
+	GLfloat scaleX, scaleY, x0, y0, x1, y1;
+	
+	if(!GLEW_EXT_framebuffer_blit) return 0;
+	if(sprite->rotation != 0.0 || sprite->tint) return 0;
+	if(sprite->paletteA && sprite->paletteA->num) return 0;
+	if(sprite->paletteB && sprite->paletteB->num) return 0;
+	if(sprite->paletteBands || sprite->lineOffsets != RS_NULL_TEXTURE) return 0;
+	// A hull leaves out texels a blit would copy.
+	if(sprite->hull) return 0;
+	// Only colors can be read through a framebuffer, and
+	// compressed ones can't be at all.
+	if(sprite->format != RS_RGB && sprite->format != RS_RGBA) return 0;
+	if(sprite->image && sprite->image->store >= RS_STORE_ALPHA8) return 0;
+	if(glIsEnabled(GL_BLEND) && (sprite->format != RS_RGB || !blendReplacesOpaque())) return 0;
+	
+	// Target pixels are stretched over the viewport, so a copy
+	// has to come out whole after that as well.
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	scaleX = sprite->scaleX*viewport[2]/width;
+	scaleY = sprite->scaleY*viewport[3]/height;
+	if(!wholeScale(scaleX) || !wholeScale(scaleY)) return 0;
+	if(!wholeScale(viewport[2]/width) || !wholeScale(viewport[3]/height)) return 0;
+	
+	// The frame has to be in the image in full; the shader would
+	// clamp whatever hangs off the edge.
+	storedFrameRect(sprite, rect, &imageX, &imageY);
+	if(rect[2] == 0 || rect[3] == 0) return 0;
+	if(imageX+rect[2] > sprite->imageWidth || imageY+rect[3] > sprite->imageHeight) return 0;
+	// A trimmed frame's padding has to be cleared, which blending
+	// would skip but a blit can't do.
+	if(!glIsEnabled(GL_BLEND) && (rect[0] || rect[1] || rect[2] != sprite->width || rect[3] != sprite->height))
+		return 0;
+	
+	// Multisampled targets can't take a blit from a plain texture.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, fbo);
+	glGetIntegerv(GL_SAMPLE_BUFFERS, &sampleBuffers);
+	if(sampleBuffers) return 0;
+	// Nor is every stored format guaranteed to be readable.
+	glBindFramebufferEXT(GL_READ_FRAMEBUFFER, readFramebuffer(sprite));
+	if(glCheckFramebufferStatusEXT(GL_READ_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE_EXT)
+	{
+		glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+		return 0;
+	}
+	
+	// Work out where the frame's corners land, in the target's
+	// pixels with Y running down, just as the vertex shader does.
+	// Negative scales come out mirrored, which blits handle too.
+	x0 = sprite->posX*viewport[2]/width + rect[0]*scaleX;
+	y0 = sprite->posY*viewport[3]/height + rect[1]*scaleY;
+	x1 = x0 + rect[2]*scaleX;
+	y1 = y0 + rect[3]*scaleY;
+	// Then into the framebuffer's own rows.
+	if(toScreen)
+	{
+		y0 = viewport[3]-y0;
+		y1 = viewport[3]-y1;
+	}
+	
+	// Sprite images keep their top row first, and the blit maps
+	// first rows to first rows.
+	glBlitFramebufferEXT(imageX, imageY, imageX+rect[2], imageY+rect[3],
+						viewport[0]+(GLint)x0, viewport[1]+(GLint)y0,
+						viewport[0]+(GLint)x1, viewport[1]+(GLint)y1,
+						GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+	
+	quadPixels += fabsf(sprite->scaleX*sprite->scaleY)*sprite->width*sprite->height;
+	++blits;
+	return 1;
+}
+
+/*
+	Draws the medium sprite into the canvas sprite's color
+	attachment. Unless it's blended, the canvas image is sampled
+	and mixed with the medium in the shader; blended draws leave
+	mixing to whatever blend state the caller has set up, and
+	sample nothing but the medium.
+	
+	Parameters:
+		canvas (RS_Sprite*): The sprite to draw onto.
+		medium (RS_Sprite*): The sprite to draw onto the other.
+		mix (GLfloat): How much of the medium to use, already clamped.
+		blended (int): Whether fixed-function blending does the mixing.
+		sparse (int): Whether that blending leaves the canvas alone
+						under transparent texels.
+*/
+/*
+	Returns a single transparent black texel, which canvases
+	without an image of their own are mixed against. Made the
+	first time it's needed.
+*/
+static GLuint blankTexture(void)
+{
+	unsigned char texel[4] = {0, 0, 0, 0};
+	if(blankTex == RS_NULL_TEXTURE)
+		generateTexture(&blankTex, 1, 1, RS_RGBA, texel);
+	return blankTex;
+}
+
+static void drawIntoCanvas(RS_Sprite * canvas, RS_Sprite * medium, GLfloat mix, int blended, int sparse)
+{
+	GLuint canvasRect[4], canvasX, canvasY;
+	
+	// The canvas might never have been drawn to before.
+	requireFramebuffer(canvas);
+	// Both images are about to be sampled, so they had
+	// better be resident.
+	touchSprite(canvas);
+	touchSprite(medium);
+	// Zoomed out far enough, a smaller level will do. Levels
+	// keep their palette keys, so the shader applies the palette.
+	GLuint level = lodLevelFor(medium);
+	// Otherwise maybe the medium's palette is already baked in.
+	GLuint baked = level ? RS_NULL_TEXTURE : bakedPaletteFor(medium);
+	
+	// Bind to the framebuffer of the canvas RS_Sprite, so the
+	// rendering pipeline outputs into its texture.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, canvas->fbo);
+	// We don't have a depth texture or renderbuffer.
+	glDisable(GL_DEPTH_TEST);
+	// Begin use of the RenderSprite shader. A full mix never
+	// shows the canvas, so there's no need to sample it, and
+	// neither is there when the blender reads it for us.
+	useVariant(medium, baked, !blended && mix < 1.0);
+	
+	// Swap over to the first texture slot so we can
+	// populate it with the canvas texture.
+	if(!blended)
+	{
+		glActiveTexture(GL_TEXTURE0+0);
+		// Empty sprites have no image until one is rendered in.
+		glBindTexture(GL_TEXTURE_2D, canvas->tex != RS_NULL_TEXTURE ? canvas->tex : blankTexture());
+		glUniform1i(program->canvasTextureUniform, 0);
+	}
+	
+	// We also need to supply the medium texture.
+	glActiveTexture(GL_TEXTURE0+1);
+	glBindTexture(GL_TEXTURE_2D, level ? spriteLODs(medium)[level-1] : baked ? baked : medium->tex);
+	glUniform1i(program->mediumTextureUniform, 1);
+
+	// Set the blending uniform.
+	glUniform1f(program->mixUniform, mix);
+	// Sprites keep their rows top to bottom.
+	glUniform1i(program->toScreenUniform, GL_FALSE);
+	
+	// Since we are rendering to the canvas sprite's texture,
+	// the essential size of the screen is the width and the
+	// height of that very texture.
+	
+	// Supply info about frame sizes so we don't draw all frames
+	// of animation at once.
+	glUniform2f(program->canvasFrameSizeUniform, (GLfloat)canvas->width, (GLfloat)canvas->height);
+	storedFrameRect(canvas, canvasRect, &canvasX, &canvasY);
+	glUniform2f(program->canvasFrameOffsetUniform, (GLfloat)canvasX-canvasRect[0], (GLfloat)canvasY-canvasRect[1]);
+	glUniform2f(program->canvasImageSizeUniform, canvas->imageWidth, canvas->imageHeight);
+	glUniform4f(program->canvasTrimUniform, canvasRect[0], canvasRect[1], canvasRect[2], canvasRect[3]);
+	// Set the transform uniform variables to the medium sprite.
+	updateSpriteUniformState(medium, baked);
+	setMediumUniforms(medium, level, sparse);
+	
+	// Now that all the uniforms are set up, we can call
+	// our drawing function.
+	drawMedium(medium, level, sparse);
+	
+	// State-persistence time!
+	if(medium->paletteBands) unbindPaletteBands();
+	if(medium->lineOffsets != RS_NULL_TEXTURE) unbindLineOffsets();
+	glActiveTexture(GL_TEXTURE0+0);
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+	glActiveTexture(GL_TEXTURE0+1);
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+	glUseProgram(RS_NULL_PROGRAM);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+}
+
+void RS_renderSpriteToSprite(RS_Sprite * canvas, RS_Sprite * medium, GLfloat mix)
+{
+	// First off let's normalize blend.
+	if(mix > 1.0) mix = 1.0;
+	if(mix < 0.0) mix = 0.0;
+	drawIntoCanvas(canvas, medium, mix, 0, 0);
+}
+
+int RS_copySpriteToSprite(RS_Sprite * canvas, RS_Sprite * medium)
+{
+	requireFramebuffer(canvas);
+	touchSprite(medium);
+	if(blitSprite(medium, canvas->fbo, (GLfloat)canvas->width, (GLfloat)canvas->height, GL_FALSE))
+		return 1;
+	// Anything else takes the shader, at a full mix.
+	drawIntoCanvas(canvas, medium, 1.0, 0, 0);
+	return 0;
+}
+
+void RS_blendSpriteToSprite(RS_Sprite * canvas, RS_Sprite * medium, GLfloat mix, GLuint mode)
+{
+	GLint blendSrcRGB, blendDstRGB, blendSrcAlpha, blendDstAlpha;
+	GLfloat blendColor[4];
+	GLboolean blending;
+	RS_Color * tint = medium->tint, fade;
+	
+	if(mix > 1.0) mix = 1.0;
+	if(mix < 0.0) mix = 0.0;
+	
+	// Whatever blending the caller had going is put back after.
+	blending = glIsEnabled(GL_BLEND);
+	glGetIntegerv(GL_BLEND_SRC_RGB, &blendSrcRGB);
+	glGetIntegerv(GL_BLEND_DST_RGB, &blendDstRGB);
+	glGetIntegerv(GL_BLEND_SRC_ALPHA, &blendSrcAlpha);
+	glGetIntegerv(GL_BLEND_DST_ALPHA, &blendDstAlpha);
+	glGetFloatv(GL_BLEND_COLOR, blendColor);
+	
+	glEnable(GL_BLEND);
+	if(mode == RS_BLEND_OVER || mode == RS_BLEND_PREMULTIPLIED)
+	{
+		// The blender can't scale the source's own alpha by a
+		// constant, so the mix rides along in the tint instead.
+		// A straight source has its alpha faded; a premultiplied
+		// one has every term faded.
+		if(mix < 1.0)
+		{
+			if(tint) fade = *tint;
+			else fade.r = fade.g = fade.b = fade.a = 1.0;
+			fade.a *= mix;
+			if(mode == RS_BLEND_PREMULTIPLIED)
+			{
+				fade.r *= mix;
+				fade.g *= mix;
+				fade.b *= mix;
+			}
+			medium->tint = &fade;
+		}
+		// Either way the canvas ends up premultiplied.
+		if(mode == RS_BLEND_OVER)
+			glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+		else
+			glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	else
+	{
+		// The same linear mix the shader does, against what's
+		// already in the attachment.
+		glBlendColor(0.0, 0.0, 0.0, mix);
+		glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+	}
+	
+	// Laying a transparent texel over the canvas changes nothing,
+	// but mixing it in fades what's there.
+	drawIntoCanvas(canvas, medium, mix, 1, mode != RS_BLEND_MIX);
+	
+	medium->tint = tint;
+	glBlendFuncSeparate(blendSrcRGB, blendDstRGB, blendSrcAlpha, blendDstAlpha);
+	glBlendColor(blendColor[0], blendColor[1], blendColor[2], blendColor[3]);
+	if(!blending) glDisable(GL_BLEND);
+}
+
+/*
+	Clears the bound framebuffer to black with the given opacity,
+	leaving the clear color as it was.
+*/
+static void clearToBlack(GLfloat alpha)
+{
+	GLfloat previous[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, previous);
+	glClearColor(0.0, 0.0, 0.0, alpha);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(previous[0], previous[1], previous[2], previous[3]);
+}
+
+/*
+	Draws a sprite into a framebuffer without mixing it into
+	anything: the screen, or the virtual screen standing in for it.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to draw.
+		fbo (GLuint): The framebuffer to draw into.
+		width (GLfloat): The width of the viewport, in pixels.
+		height (GLfloat): The height of the viewport, in pixels.
+		toScreen (GLboolean): Whether the framebuffer's rows run
+							bottom to top, as the window's do.
+*/
+static void drawToTarget(RS_Sprite * sprite, GLuint fbo, GLfloat width, GLfloat height, GLboolean toScreen)
+{
+	// Make sure that we are using the right framebuffer.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, fbo);
+	
+	// Make sure the sprite's image is resident.
+	touchSprite(sprite);
+	// Use a reduced level if it's zoomed out, or otherwise
+	// a baked palette variant if there is one.
+	GLuint level = lodLevelFor(sprite);
+	GLuint baked = level ? RS_NULL_TEXTURE : bakedPaletteFor(sprite);
+	GLuint image = level ? spriteLODs(sprite)[level-1] : baked ? baked : sprite->tex;
+	// Only sprites that could skip their transparent parts need
+	// to ask about blending.
+	int sparse = (sprite->hull || (sprite->image && sprite->image->frames)) && blendSkipsClear();
+	// There's no canvas to mix with on the screen, so
+	// the pure variant is all we need.
+	useVariant(sprite, baked, 0);
+	
+	// The pure variant only samples the medium.
+	glActiveTexture(GL_TEXTURE0+1);
+	glBindTexture(GL_TEXTURE_2D, image);
+	glUniform1i(program->mediumTextureUniform, 1);
+	
+	glUniform2f(program->canvasFrameSizeUniform, width, height);
+	glUniform2f(program->canvasFrameOffsetUniform, 0.0, 0.0);
+	glUniform2f(program->canvasImageSizeUniform, width, height);
+	glUniform1i(program->toScreenUniform, toScreen);
+	
+	// Don't forget to tell the shader all about how
+	// to manipulate the sprite.
+	updateSpriteUniformState(sprite, baked);
+	setMediumUniforms(sprite, level, sparse);
+	
+	// Now that all the uniforms are set up, we can call
+	// our drawing function.
+	drawMedium(sprite, level, sparse);
+	
+	// State-persistence time!
+	if(sprite->paletteBands) unbindPaletteBands();
+	if(sprite->lineOffsets != RS_NULL_TEXTURE) unbindLineOffsets();
+	glActiveTexture(GL_TEXTURE0+1);
+	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
+	glUseProgram(RS_NULL_PROGRAM);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+}
+
+/*
+	Draws a sprite to the window, or to the virtual screen if
+	there is one. Returns 1 if it was a copy done with a blit.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to draw.
+		copy (int): Whether to try a blit before the shader.
+*/
+static int drawToScreen(RS_Sprite * sprite, int copy)
+{
+	GLint viewport[4];	// Window X, Y, width and height.
+	int copied = 0;
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	// A blit reads the image, so it has to be resident first.
+	if(copy) touchSprite(sprite);
+	
+	// With a virtual screen, sprites go there at its own
+	// resolution instead, and the window waits for
+	// RS_presentVirtualScreen().
+	if(virtualScreen)
+	{
+		glViewport(0, 0, virtualScreen->width, virtualScreen->height);
+		copied = copy && blitSprite(sprite, virtualScreen->fbo, (GLfloat)virtualScreen->width,
+									(GLfloat)virtualScreen->height, GL_FALSE);
+		if(!copied)
+			drawToTarget(sprite, virtualScreen->fbo, (GLfloat)virtualScreen->width,
+						(GLfloat)virtualScreen->height, GL_FALSE);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+		return copied;
+	}
+	// Otherwise the window's viewport is the canvas.
+	copied = copy && blitSprite(sprite, RS_NULL_FRAMEBUFFER, (GLfloat)viewport[2], (GLfloat)viewport[3], GL_TRUE);
+	if(!copied)
+		drawToTarget(sprite, RS_NULL_FRAMEBUFFER, (GLfloat)viewport[2], (GLfloat)viewport[3], GL_TRUE);
+	return copied;
+}
+
+void RS_renderSpriteToScreen(RS_Sprite * sprite)
+{
+	drawToScreen(sprite, 0);
+}
+
+int RS_copySprite(RS_Sprite * sprite)
+{
+	return drawToScreen(sprite, 1);
+}
+
+void RS_setVirtualResolution(GLuint width, GLuint height)
+{
+	// Throw out the old one first.
+	if(virtualScreen)
+	{
+		glDeleteFramebuffersEXT(1, &virtualScreen->fbo);
+		glDeleteTextures(1, &virtualScreen->tex);
+		attachmentBytes -= numTexelBytes(virtualScreen->width, virtualScreen->height, RS_RGBA);
+		free(virtualScreen);
+		virtualScreen = NULL;
+	}
+	if(width == 0 || height == 0) return;
+	
+	// The virtual screen is a sprite whose framebuffer renders
+	// straight into its image, since nothing ever samples it
+	// while it's being drawn to.
+	virtualScreen = generateRawSprite();
+	virtualScreen->width = virtualScreen->imageWidth = width;
+	virtualScreen->height = virtualScreen->imageHeight = height;
+	virtualScreen->format = RS_RGBA;
+	generateTexture(&virtualScreen->tex, width, height, RS_RGBA, NULL);
+	generateFramebuffer(&virtualScreen->fbo, &virtualScreen->tex);
+	attachmentBytes += numTexelBytes(width, height, RS_RGBA);
+	
+	// Start out clear.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, virtualScreen->fbo);
+	clearToBlack(0.0);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+}
+
+void RS_presentVirtualScreen(void)
+{
+	GLint viewport[4];
+	GLfloat scale, scaleX, scaleY;
+	GLint width, height;
+	if(!virtualScreen) return;
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	
+	// The largest whole multiple of the virtual resolution that
+	// fits the window. Windows too small for even one are the
+	// only case that gets a fractional scale.
+	scaleX = (GLfloat)viewport[2]/virtualScreen->width;
+	scaleY = (GLfloat)viewport[3]/virtualScreen->height;
+	scale = scaleX < scaleY ? scaleX : scaleY;
+	if(scale >= 1.0) scale = floorf(scale);
+	width = (GLint)(virtualScreen->width*scale);
+	height = (GLint)(virtualScreen->height*scale);
+	
+	// Black out the bars, then draw the virtual screen centered
+	// between them.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+	clearToBlack(1.0);
+	glViewport(viewport[0]+(viewport[2]-width)/2, viewport[1]+(viewport[3]-height)/2, width, height);
+	// At a whole multiple that's a plain copy, so it's blitted.
+	if(!blitSprite(virtualScreen, RS_NULL_FRAMEBUFFER, (GLfloat)virtualScreen->width,
+					(GLfloat)virtualScreen->height, GL_TRUE))
+		drawToTarget(virtualScreen, RS_NULL_FRAMEBUFFER, (GLfloat)virtualScreen->width,
+					(GLfloat)virtualScreen->height, GL_TRUE);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	
+	// Leave the virtual screen clear for the next frame.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, virtualScreen->fbo);
+	clearToBlack(0.0);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+}
+
+void RS_beginRenderToSprite(RS_Sprite * sprite)
+{
+	// Make sure there is something to render into.
+	requireFramebuffer(sprite);
+	// Bind to the framebuffer of the canvas RS_Sprite, so the
+	// rendering pipeline outputs into its texture.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, sprite->fbo);
+	// We don't have a depth texture or renderbuffer.
+	glDisable(GL_DEPTH_TEST);
+}
+
+void RS_endRenderToSprite(RS_Sprite * sprite)
+{
+	// Bind back to the normal framebuffer.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+}
+
+GLuint RS_getTexture(RS_Sprite * sprite)
+{
+	// An evicted image would be a useless handle.
+	touchSprite(sprite);
+	return sprite->tex;
+}
+
+GLuint RS_getFBO(RS_Sprite * sprite)
+{
+	// Whoever asks for the FBO intends to use it.
+	requireFramebuffer(sprite);
+	return sprite->fbo;
+}
+
+GLuint RS_getWidth(RS_Sprite * sprite)
+{
+	return sprite->width;
+}
+
+GLuint RS_getHeight(RS_Sprite * sprite)
+{
+	return sprite->height;
+}
+
+GLfloat RS_getRot(RS_Sprite * sprite)
+{
+	return sprite->rotation;
+}
+
+GLint RS_getXPos(RS_Sprite * sprite)
+{
+	return sprite->posX;
+}
+
+GLint RS_getYPos(RS_Sprite * sprite)
+
+{
+	return sprite->posY;
+}
+
+GLfloat RS_getXScale(RS_Sprite * sprite)
+{
+	return sprite->scaleX;
+}
+
+GLfloat RS_getYScale(RS_Sprite * sprite)
+{
+	return sprite->scaleY;
+}
+
+RS_Color * RS_getTint(RS_Sprite * sprite)
+{
+	return sprite->tint;
+}
+
+GLfloat * RS_getTexelData(RS_Sprite * sprite)
+{
+	// Allocate data to store what the GPU gives us, in the
+	// format of the attachment rather than the image.
+	GLuint format = renderableFormat(sprite->format);
+	GLfloat * data;
+	if(format == RS_RGB)
+		data = malloc(sizeof(GLfloat)*sprite->width*sprite->height*3);
+	else
+		data = malloc(sizeof(GLfloat)*sprite->width*sprite->height*4);
+		
+	// Make sure there's a framebuffer to read from at all.
+	requireFramebuffer(sprite);
+	// Make sure that we are reading from the correct framebuffer.
+	glBindFramebufferEXT(GL_FRAMEBUFFER, sprite->fbo);
+	// It's kind of like palm reading, but with VRAM.
+	glReadPixels(0,	// Top left of rectangle to read out. (x)
+				0,	// Top left of rectangle to read out. (y)
+				sprite->width,	// The width of that rectangle.
+				sprite->height,	// The height of that rectangle.
+				format,	// The format of that data that we're expecting.
+				GL_FLOAT,	// The type of that data.
+				data);	// A container for this frame data.
+	return data;
+}
+
+/*
+	Where a frame in an exporter is along the pipeline.
+*/
+#define RS_SLOT_FREE 0		// Ready to be read back into.
+#define RS_SLOT_READING 1	// Being read back into its pixel buffer.
+#define RS_SLOT_QUEUED 2	// Waiting for a worker.
+#define RS_SLOT_WRITING 3	// Being encoded and written.
+
+/*
+	One frame's worth of room in an exporter.
+*/
+typedef struct
+{
+	GLuint pbo;
+	GLuint capacity;		// Bytes the pixel buffer and pixels can hold.
+	unsigned char * pixels;
+	GLuint width, height;
+	unsigned int frame;
+	int state;
+	int failed;				// The readback couldn't be mapped.
+} RS_ExportSlot;
+
+struct RS_Exporter
+{
+	int mode;
+	char * path;
+	FILE * stream;
+	RS_ExportSlot * slots;
+	unsigned int numSlots;
+	unsigned int issue;		// The slot the next readback goes into.
+	unsigned int take;		// The slot workers take next.
+	int pending;			// The slot read back into last, or -1.
+	unsigned int frames;	// How many frames have been queued.
+	unsigned int failures;	// How many couldn't be written.
+	RS_Thread * workers;
+	unsigned int numWorkers;
+	RS_Mutex lock;
+	RS_Cond queued;	// Signalled when a slot is queued, or on closing.
+	RS_Cond freed;	// Signalled when a slot is written.
+	int closing;
+};
+
+/*
+	Encodes and writes one frame. Called by workers, without the lock.
+*/
+static int writeExportSlot(RS_Exporter * exporter, RS_ExportSlot * slot)
+{
+	size_t n = (size_t)slot->width*slot->height;
+	if(exporter->mode == RS_EXPORT_RAW)
+		return fwrite(slot->pixels, 4, n, exporter->stream) == n;
+	else
+	{
+		// The pattern can expand to anything, so measure it first.
+		int length = snprintf(NULL, 0, exporter->path, slot->frame);
+		char * name;
+		unsigned error;
+		if(length < 0) return 0;
+		name = malloc((size_t)length+1);
+		snprintf(name, (size_t)length+1, exporter->path, slot->frame);
+		error = lodepng_encode32_file(name, slot->pixels, slot->width, slot->height);
+		#ifdef RS_DB_ERRORS
+		if(error)
+			printf("Error: could not export %s: %s\n", name, lodepng_error_text(error));
+		#endif
+		free(name);
+		return !error;
+	}
+}
+
+/*
+	Returns the first queued slot at or after the one workers take
+	next, or -1 if none are. Called with the lock held.
+*/
+static int nextQueuedSlot(RS_Exporter * exporter)
+{
+	unsigned int i;
+	for(i = 0; i < exporter->numSlots; i++)
+	{
+		unsigned int index = (exporter->take+i)%exporter->numSlots;
+		if(exporter->slots[index].state == RS_SLOT_QUEUED)
+			return (int)index;
+	}
+	return -1;
+}
+
+/*
+	A worker thread. Takes queued slots in the order they were
+	queued until the exporter closes and nothing's left.
+*/
+static void * exportWorker(void * data)
+{
+	RS_Exporter * exporter = data;
+	lockMutex(&exporter->lock);
+	for(;;)
+	{
+		RS_ExportSlot * slot = &exporter->slots[exporter->take];
+		int written;
+		// Slots are queued in ring order, so if the next one isn't
+		// queued, none should be. On closing, make sure of it, so
+		// nothing queued is left behind.
+		if(slot->state != RS_SLOT_QUEUED)
+		{
+			if(exporter->closing)
+			{
+				int next = nextQueuedSlot(exporter);
+				if(next < 0) break;
+				exporter->take = (unsigned int)next;
+				continue;
+			}
+			waitCond(&exporter->queued, &exporter->lock);
+			continue;
+		}
+		slot->state = RS_SLOT_WRITING;
+		exporter->take = (exporter->take+1)%exporter->numSlots;
+		
+		// A frame that couldn't be read back is still taken in
+		// its turn, so the ones behind it aren't held up.
+		if(slot->failed)
+			written = 0;
+		else
+		{
+			unlockMutex(&exporter->lock);
+			written = writeExportSlot(exporter, slot);
+			lockMutex(&exporter->lock);
+		}
+		
+		if(!written) ++exporter->failures;
+		slot->state = RS_SLOT_FREE;
+		wakeAll(&exporter->freed);
+	}
+	unlockMutex(&exporter->lock);
+	return NULL;
+}
+
+/*
+	Maps a slot's finished readback, copies it out and hands it to
+	the workers. Must be called on the GL thread.
+*/
+static void queueExportSlot(RS_Exporter * exporter, RS_ExportSlot * slot)
+{
+	void * mapped;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if(mapped)
+	{
+		memcpy(slot->pixels, mapped, (size_t)slot->width*slot->height*4);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, RS_NULL_BUFFER);
+	
+	// Failed frames are queued too, and counted by the worker that
+	// takes them, so slots are always freed in ring order.
+	lockMutex(&exporter->lock);
+	slot->failed = !mapped;
+	slot->state = RS_SLOT_QUEUED;
+	wakeAll(&exporter->queued);
+	unlockMutex(&exporter->lock);
+}
+
+RS_Exporter * RS_mkExporter(int mode, char * path, unsigned int depth, unsigned int workers)
+{
+	RS_Exporter * exporter = malloc(sizeof(RS_Exporter));
+	unsigned int i;
+	exporter->mode = mode;
+	exporter->stream = NULL;
+	if(mode == RS_EXPORT_RAW)
+	{
+		exporter->stream = fopen(path, "wb");
+		if(!exporter->stream)
+		{
+			#ifdef RS_DB_ERRORS
+			printf("Error: could not open %s for export.\n", path);
+			#endif
+			free(exporter);
+			return NULL;
+		}
+		// One writer keeps the stream in order.
+		workers = 1;
+	}
+	exporter->path = malloc(strlen(path)+1);
+	strcpy(exporter->path, path);
+	
+	// It takes two slots for a readback to have a call's worth of
+	// time to finish while the next one starts.
+	exporter->numSlots = depth < 2 ? 2 : depth;
+	exporter->slots = calloc(exporter->numSlots, sizeof(RS_ExportSlot));
+	for(i = 0; i < exporter->numSlots; i++)
+		glGenBuffers(1, &exporter->slots[i].pbo);
+	exporter->issue = 0;
+	exporter->take = 0;
+	exporter->pending = -1;
+	exporter->frames = 0;
+	exporter->failures = 0;
+	exporter->closing = 0;
+	
+	initMutex(&exporter->lock);
+	initCond(&exporter->queued);
+	initCond(&exporter->freed);
+	if(workers < 1) workers = 1;
+	exporter->workers = malloc(sizeof(RS_Thread)*workers);
+	// Only the workers that actually started get joined later.
+	exporter->numWorkers = 0;
+	for(i = 0; i < workers; i++)
+		if(startThread(&exporter->workers[exporter->numWorkers], exportWorker, exporter))
+			++exporter->numWorkers;
+	if(exporter->numWorkers == 0)
+	{
+		#ifdef RS_DB_ERRORS
+		printf("Error: could not start any export workers.\n");
+		#endif
+		for(i = 0; i < exporter->numSlots; i++)
+			glDeleteBuffers(1, &exporter->slots[i].pbo);
+		if(exporter->stream) fclose(exporter->stream);
+		destroyMutex(&exporter->lock);
+		destroyCond(&exporter->queued);
+		destroyCond(&exporter->freed);
+		free(exporter->workers);
+		free(exporter->slots);
+		free(exporter->path);
+		free(exporter);
+		return NULL;
+	}
+	return exporter;
+}
+
+unsigned int RS_exportSprite(RS_Exporter * exporter, RS_Sprite * sprite)
+{
+	RS_ExportSlot * slot = &exporter->slots[exporter->issue];
+	GLuint bytes = sprite->width*sprite->height*4;
+	
+	// Back-pressure: wait for the workers to free up the slot.
+	lockMutex(&exporter->lock);
+	while(slot->state != RS_SLOT_FREE)
+		waitCond(&exporter->freed, &exporter->lock);
+	slot->state = RS_SLOT_READING;
+	unlockMutex(&exporter->lock);
+	
+	if(slot->capacity < bytes)
 	{
-		sprite->frameOffsetX = 0;
-		sprite->frameOffsetY += sprite->height;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, RS_NULL_BUFFER);
+		slot->pixels = realloc(slot->pixels, bytes);
+		slot->capacity = bytes;
 	}
-	if(sprite->frameOffsetY >= sprite->imageHeight)
+	slot->width = sprite->width;
+	slot->height = sprite->height;
+	slot->frame = exporter->frames++;
+	
+	// Start the readback. With a pixel buffer bound this returns
+	// right away, and the driver converts to RGBA8 as it copies.
+	requireFramebuffer(sprite);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, sprite->fbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, sprite->width, sprite->height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, RS_NULL_BUFFER);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+	
+	// The last readback has had a whole call to finish, so
+	// mapping it now shouldn't stall.
+	if(exporter->pending >= 0)
+		queueExportSlot(exporter, &exporter->slots[exporter->pending]);
+	exporter->pending = exporter->issue;
+	exporter->issue = (exporter->issue+1)%exporter->numSlots;
+	return slot->frame;
+}
+
+unsigned int RS_closeExporter(RS_Exporter * exporter)
+{
+	unsigned int i, failures;
+	if(exporter->pending >= 0)
+		queueExportSlot(exporter, &exporter->slots[exporter->pending]);
+	
+	// Let the workers finish what's queued, then go.
+	lockMutex(&exporter->lock);
+	exporter->closing = 1;
+	wakeAll(&exporter->queued);
+	unlockMutex(&exporter->lock);
+	for(i = 0; i < exporter->numWorkers; i++)
+		joinThread(exporter->workers[i]);
+	
+	for(i = 0; i < exporter->numSlots; i++)
 	{
-		sprite->frameOffsetX = 0;
-		sprite->frameOffsetY = 0;
+		glDeleteBuffers(1, &exporter->slots[i].pbo);
+		free(exporter->slots[i].pixels);
 	}
+	if(exporter->stream) fclose(exporter->stream);
+	destroyMutex(&exporter->lock);
+	destroyCond(&exporter->queued);
+	destroyCond(&exporter->freed);
+	failures = exporter->failures;
+	free(exporter->workers);
+	free(exporter->slots);
+	free(exporter->path);
+	free(exporter);
+	return failures;
 }
 
-void RS_renderSpriteToSprite(RS_Sprite * canvas, RS_Sprite * medium, GLfloat mix)
+GLfloat * RS_getTexelGroup(RS_Sprite * sprite, GLuint x, GLuint y, GLuint width, GLuint height)
 {
-	// First off let's normalize blend.
-	if(mix > 1.0) mix = 1.0;
-	if(mix < 0.0) mix = 0.0;
+	GLuint format = renderableFormat(sprite->format);
+	GLfloat * data;
+	if(format == RS_RGB)
+		data = malloc(sizeof(GLfloat)*(width-x)*(height-y)*3);
+	else
+		data = malloc(sizeof(GLfloat)*(width-x)*(height-y)*4);
+
+	requireFramebuffer(sprite);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, sprite->fbo);
+	// Oh look now you get to specify the parameters to glReadPixels().
+	glReadPixels(x,
+				y,
+				width,
+				height,
+				format,
+				GL_FLOAT,
+				data);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+	return data;
+}
+
+void RS_getColorAt(RS_Color * container, RS_Sprite * sprite, GLuint x, GLuint y)
+{
+	// Get a single pixel of color data.
+	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
+	// Stuff it into the container RS_Color.
+	container->r = data[0];
+	container->g = data[1];
+	container->b = data[2];
+	// If the sprite is merely RGB, then we wouldn't have
+	// gotten a fourth term from RS_getPixelData().
+	if(renderableFormat(sprite->format) == RS_RGBA)
+		container->a = data[3];
+	else
+		container->a = 1.0;
+		
+	// Free that pixel from the wrath of definition.
+	free(data);
+}
+
+GLfloat RS_getRedAt(RS_Sprite * sprite, GLuint x, GLuint y)
+{
+	// Get that same single pixel.
+	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
+	// Store its red value.
+	GLfloat red = data[0];
+	// Rid ourselves of this filth.
+	free(data);
+	// Give back to the community.
+	return red;
+}
+
+GLfloat RS_getGreenAt(RS_Sprite * sprite, GLuint x, GLuint y)
+{
+	// Hmm.
+	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
+	GLfloat green = data[1];
+	free(data);
+	return green;
+}
 	
-	// Bind to the framebuffer of the canvas RS_Sprite, so the
-	// rendering pipeline outputs into its texture.
-	glBindFramebufferEXT(GL_FRAMEBUFFER, canvas->fbo);
-	// We don't have a depth texture or renderbuffer.
-	glDisable(GL_DEPTH_TEST);
-	// Begin use of the RenderSprite shader.
-	glUseProgram(shader);
+GLfloat RS_getBlueAt(RS_Sprite * sprite, GLuint x, GLuint y)
+{
+	// This leaves a familiar taste in my mouth.
+	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
+	GLfloat blue = data[2];
+	free(data);
+	return blue;
+}
+
+GLfloat RS_getAlphaAt(RS_Sprite * sprite, GLuint x, GLuint y)
+{
+	// So if the sprite has a strictly RGB format, the fourth
+	// term will be either null or the next red, depending on
+	// how glReadPixels() is implemented. So therefore we
+	// have to check to make sure that 
+	// Things aren't quite so opaque.
+	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
+	GLfloat alpha = data[3];
+	free(data);
+	return alpha;
+}
+
+/*
+	Batches of sprite transforms at least this big are split
+	across threads, up to this many of them.
+*/
+#define RS_PARALLEL_SPRITES 65536
+#define RS_MAX_TRANSFORM_THREADS 8
+
+/*
+	The part of a batch of sprite transforms one thread works on.
+*/
+typedef struct
+{
+	unsigned int first, last;
+	const GLfloat * positions, * scales, * rotations, * frameSizes;
+	GLfloat * out;
+	int bounds;			// Whether out gets boxes rather than corners.
+} RS_TransformRange;
+
+/*
+	Works out the sine and cosine of a rotation. Most sprites
+	aren't rotated, and those can skip the trig.
+*/
+static void spriteSinCos(GLfloat rotation, GLfloat * s, GLfloat * c)
+{
+	if(rotation == 0.0)
+	{
+		*s = 0.0;
+		*c = 1.0;
+		return;
+	}
+	*s = sinf(rotation);
+	*c = cosf(rotation);
+}
+
+#ifdef __SSE__
+/*
+	Loads the interleaved pairs of four sprites, starting from
+	the i'th, as one vector of Xs and one of Ys.
+*/
+static void loadPairs(const GLfloat * pairs, unsigned int i, __m128 * x, __m128 * y)
+{
+	__m128 lo = _mm_loadu_ps(&pairs[i*2]), hi = _mm_loadu_ps(&pairs[i*2+4]);
+	*x = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+	*y = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+}
+#endif
+
+/*
+	Transforms a range of sprites, four at a time with SSE where
+	it's available. The vector and scalar paths do the same
+	operations in the same order, so every sprite comes out the
+	same either way.
+*/
+static void transformRange(RS_TransformRange * range)
+{
+	const GLfloat * positions = range->positions, * scales = range->scales;
+	const GLfloat * rotations = range->rotations, * frameSizes = range->frameSizes;
+	unsigned int i = range->first;
 	
-	// Swap over to the first texture slot so we can
-	// populate it with the canvas texture.
-	glActiveTexture(GL_TEXTURE0+0);
-	glBindTexture(GL_TEXTURE_2D, canvas->tex);
-	glUniform1i(canvasTextureUniform, 0);
+	#ifdef __SSE__
+	const __m128 half = _mm_set1_ps(.5f);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	for(; i+4 <= range->last; i += 4)
+	{
+		GLfloat sn[4], cs[4];
+		__m128 px, py, sx, sy, fw, fh, hw, hh, c, s, cx, cy;
+		unsigned int k;
+		// The trig stays scalar, worked out once per sprite up front.
+		for(k = 0; k < 4; k++)
+			spriteSinCos(rotations[i+k], &sn[k], &cs[k]);
+		c = _mm_loadu_ps(cs);
+		s = _mm_loadu_ps(sn);
+		loadPairs(positions, i, &px, &py);
+		loadPairs(scales, i, &sx, &sy);
+		loadPairs(frameSizes, i, &fw, &fh);
+		hw = _mm_mul_ps(_mm_mul_ps(fw, sx), half);
+		hh = _mm_mul_ps(_mm_mul_ps(fh, sy), half);
+		cx = _mm_add_ps(px, hw);
+		cy = _mm_add_ps(py, hh);
+		if(range->bounds)
+		{
+			__m128 ex = _mm_add_ps(_mm_andnot_ps(sign, _mm_mul_ps(c, hw)), _mm_andnot_ps(sign, _mm_mul_ps(s, hh)));
+			__m128 ey = _mm_add_ps(_mm_andnot_ps(sign, _mm_mul_ps(s, hw)), _mm_andnot_ps(sign, _mm_mul_ps(c, hh)));
+			__m128 b0 = _mm_sub_ps(cx, ex), b1 = _mm_sub_ps(cy, ey);
+			__m128 b2 = _mm_add_ps(cx, ex), b3 = _mm_add_ps(cy, ey);
+			// Each sprite's box is a column; turn them into rows.
+			_MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+			_mm_storeu_ps(&range->out[i*4+0], b0);
+			_mm_storeu_ps(&range->out[i*4+4], b1);
+			_mm_storeu_ps(&range->out[i*4+8], b2);
+			_mm_storeu_ps(&range->out[i*4+12], b3);
+		}
+		else
+		{
+			__m128 ax = _mm_mul_ps(c, hw), ay = _mm_mul_ps(s, hw);
+			__m128 bx = _mm_xor_ps(_mm_mul_ps(s, hh), sign), by = _mm_mul_ps(c, hh);
+			__m128 q0 = _mm_sub_ps(_mm_sub_ps(cx, ax), bx), q1 = _mm_sub_ps(_mm_sub_ps(cy, ay), by);
+			__m128 q2 = _mm_sub_ps(_mm_add_ps(cx, ax), bx), q3 = _mm_sub_ps(_mm_add_ps(cy, ay), by);
+			__m128 q4 = _mm_add_ps(_mm_sub_ps(cx, ax), bx), q5 = _mm_add_ps(_mm_sub_ps(cy, ay), by);
+			__m128 q6 = _mm_add_ps(_mm_add_ps(cx, ax), bx), q7 = _mm_add_ps(_mm_add_ps(cy, ay), by);
+			_MM_TRANSPOSE4_PS(q0, q1, q2, q3);
+			_MM_TRANSPOSE4_PS(q4, q5, q6, q7);
+			_mm_storeu_ps(&range->out[i*8+0], q0);
+			_mm_storeu_ps(&range->out[i*8+4], q4);
+			_mm_storeu_ps(&range->out[i*8+8], q1);
+			_mm_storeu_ps(&range->out[i*8+12], q5);
+			_mm_storeu_ps(&range->out[i*8+16], q2);
+			_mm_storeu_ps(&range->out[i*8+20], q6);
+			_mm_storeu_ps(&range->out[i*8+24], q3);
+			_mm_storeu_ps(&range->out[i*8+28], q7);
+		}
+	}
+	#endif
 	
-	// We also need to supply the medium texture.
-	glActiveTexture(GL_TEXTURE0+1);
-	glBindTexture(GL_TEXTURE_2D, medium->tex);
-	glUniform1i(mediumTextureUniform, 1);
+	// This is rendersprite.vert's arithmetic, rearranged around
+	// the sprite's center and two half-axes so each sprite is a
+	// handful of multiply-adds.
+	for(; i < range->last; i++)
+	{
+		GLfloat hw = frameSizes[i*2+0]*scales[i*2+0]*.5f;
+		GLfloat hh = frameSizes[i*2+1]*scales[i*2+1]*.5f;
+		GLfloat c, s, cx, cy;
+		spriteSinCos(rotations[i], &s, &c);
+		// The center, then the rotated half-width and half-height.
+		cx = positions[i*2+0]+hw;
+		cy = positions[i*2+1]+hh;
+		if(range->bounds)
+		{
+			// The box around a rotated rectangle reaches as far as
+			// the sum of its half-axes' extents, so the corners
+			// needn't be found.
+			GLfloat ex = fabsf(c*hw)+fabsf(s*hh);
+			GLfloat ey = fabsf(s*hw)+fabsf(c*hh);
+			GLfloat * b = &range->out[i*4];
+			b[0] = cx-ex;	b[1] = cy-ey;
+			b[2] = cx+ex;	b[3] = cy+ey;
+		}
+		else
+		{
+			GLfloat ax = c*hw, ay = s*hw;
+			GLfloat bx = -(s*hh), by = c*hh;
+			GLfloat * q = &range->out[i*8];
+			// Top left, top right, bottom left, bottom right.
+			q[0] = cx-ax-bx;	q[1] = cy-ay-by;
+			q[2] = cx+ax-bx;	q[3] = cy+ay-by;
+			q[4] = cx-ax+bx;	q[5] = cy-ay+by;
+			q[6] = cx+ax+bx;	q[7] = cy+ay+by;
+		}
+	}
+}
 
-	// Set the blending uniform.
-	glUniform1f(mixUniform, mix);
+/*
+	A thread's entry point into transformRange().
+*/
+static void * transformWorker(void * data)
+{
+	transformRange(data);
+	return NULL;
+}
+
+/*
+	Transforms a batch of sprites, splitting it across threads if
+	it's big enough to be worth starting them. The calling thread
+	takes the first share itself, and any share whose thread
+	couldn't be started.
+*/
+static void transformSprites(unsigned int num, const GLfloat * positions, const GLfloat * scales,
+							const GLfloat * rotations, const GLfloat * frameSizes, GLfloat * out, int bounds)
+{
+	RS_TransformRange ranges[RS_MAX_TRANSFORM_THREADS];
+	RS_Thread threads[RS_MAX_TRANSFORM_THREADS];
+	int started[RS_MAX_TRANSFORM_THREADS];
+	unsigned int numRanges = 1, share, i;
 	
-	// Since we are rendering to the canvas sprite's texture,
-	// the essential size of the screen is the width and the
-	// height of that very texture.
+	if(num >= RS_PARALLEL_SPRITES)
+	{
+		numRanges = numCores();
+		if(numRanges > RS_MAX_TRANSFORM_THREADS) numRanges = RS_MAX_TRANSFORM_THREADS;
+	}
+	// Shares are kept to whole groups of four for the vector path.
+	share = (num/numRanges+3) & ~3u;
+	for(i = 0; i < numRanges; i++)
+	{
+		RS_TransformRange * range = &ranges[i];
+		range->first = i*share < num ? i*share : num;
+		range->last = range->first+share < num && i+1 < numRanges ? range->first+share : num;
+		range->positions = positions;
+		range->scales = scales;
+		range->rotations = rotations;
+		range->frameSizes = frameSizes;
+		range->out = out;
+		range->bounds = bounds;
+		started[i] = i > 0 && startThread(&threads[i], transformWorker, range);
+	}
+	for(i = 0; i < numRanges; i++)
+		if(!started[i])
+			transformRange(&ranges[i]);
+	for(i = 1; i < numRanges; i++)
+		if(started[i])
+			joinThread(threads[i]);
+}
+
+void RS_computeSpriteQuads(unsigned int num, const GLfloat * positions, const GLfloat * scales,
+							const GLfloat * rotations, const GLfloat * frameSizes, GLfloat * quads)
+{
+	transformSprites(num, positions, scales, rotations, frameSizes, quads, 0);
+}
+
+void RS_computeSpriteBounds(unsigned int num, const GLfloat * positions, const GLfloat * scales,
+							const GLfloat * rotations, const GLfloat * frameSizes, GLfloat * bounds)
+{
+	transformSprites(num, positions, scales, rotations, frameSizes, bounds, 1);
+}
+
+void RS_getSpriteBounds(RS_Sprite * sprite, GLfloat * bounds)
+{
+	GLfloat position[2] = {(GLfloat)sprite->posX, (GLfloat)sprite->posY};
+	GLfloat scale[2] = {sprite->scaleX, sprite->scaleY};
+	GLfloat frameSize[2] = {(GLfloat)sprite->width, (GLfloat)sprite->height};
+	RS_computeSpriteBounds(1, position, scale, &sprite->rotation, frameSize, bounds);
+}
+
+/*
+	Tests whether a point lands on an opaque texel of a sprite, given
+	the cosine and sine of its rotation. Split out of RS_pickSprite()
+	so that collision tests can work out the trig once per sprite.
+*/
+static int texelAt(RS_Sprite * sprite, GLfloat c, GLfloat s, GLfloat x, GLfloat y)
+{
+	GLfloat halfWidth = sprite->width*sprite->scaleX*.5f;
+	GLfloat halfHeight = sprite->height*sprite->scaleY*.5f;
+	GLfloat dx, dy, u, v;
+	GLuint tx, ty, rect[4], maskStride;
+	const uint64_t * mask;
+	// A sprite squashed flat covers nothing.
+	if(sprite->scaleX == 0.0 || sprite->scaleY == 0.0) return 0;
 	
-	// Supply info about frame sizes so we don't draw all frames
-	// of animation at once.
-	glUniform2f(canvasFrameSizeUniform, (GLfloat)canvas->width, (GLfloat)canvas->height);
-	glUniform2f(canvasFrameOffsetUniform, (GLfloat)canvas->frameOffsetX, (GLfloat)canvas->frameOffsetY);
-	glUniform2f(canvasImageSizeUniform, canvas->imageWidth, canvas->imageHeight);
-	glUniform2f(mediumFrameSizeUniform, (GLfloat)medium->width, (GLfloat)medium->height);
-	glUniform2f(mediumFrameOffsetUniform, (GLfloat)medium->frameOffsetX, (GLfloat)medium->frameOffsetY);
-	glUniform2f(mediumImageSizeUniform, medium->imageWidth, medium->imageHeight);
-	// Set the transform uniform variables to the medium sprite.
-	updateSpriteUniformState(medium);
+	// Undo the vertex shader: move the point relative to the
+	// sprite's center, rotate it back, and unscale it into
+	// texels of the frame.
+	dx = x-(sprite->posX+halfWidth);
+	dy = y-(sprite->posY+halfHeight);
+	u = (c*dx+s*dy)/sprite->scaleX + sprite->width*.5f;
+	v = (c*dy-s*dx)/sprite->scaleY + sprite->height*.5f;
+	if(u < 0.0 || v < 0.0 || u >= sprite->width || v >= sprite->height) return 0;
 	
-	// Now that all the uniforms are set up, we can call
-	// our drawing function.
-	drawSquare();
+	// Without an image there's no mask, so the whole frame counts.
+	mask = spriteMask(sprite, &maskStride);
+	if(!mask) return 1;
+	// Trimmed frames are clear outside what's stored.
+	storedFrameRect(sprite, rect, &tx, &ty);
+	if(u < rect[0] || v < rect[1] || u >= rect[0]+rect[2] || v >= rect[1]+rect[3]) return 0;
+	tx += (GLuint)u-rect[0];
+	ty += (GLuint)v-rect[1];
+	return (mask[(size_t)ty*maskStride + (tx>>6)] >> (tx&63)) & 1;
+}
+
+int RS_pickSprite(RS_Sprite * sprite, GLfloat x, GLfloat y)
+{
+	return texelAt(sprite, cosf(sprite->rotation), sinf(sprite->rotation), x, y);
+}
+
+int RS_pickSprites(RS_Sprite ** sprites, unsigned int num, GLfloat x, GLfloat y)
+{
+	// Later sprites are drawn over earlier ones, so look
+	// from the top down.
+	while(num-- > 0)
+		if(RS_pickSprite(sprites[num], x, y))
+			return (int)num;
+	return -1;
+}
+
+/*
+	Gathers 64 bits of a mask row, starting from the given bit,
+	which may lie outside the row. Bits outside [lo, hi) are left
+	clear, so that neighbouring frames don't bleed in.
+*/
+static uint64_t maskWord(const uint64_t * row, GLuint stride, long bit, long lo, long hi)
+{
+	long word = bit >= 0 ? bit/64 : -((63-bit)/64);
+	long shift = bit-word*64;
+	uint64_t w = 0;
+	if(word >= 0 && word < (long)stride)
+		w = row[word] >> shift;
+	if(shift && word+1 >= 0 && word+1 < (long)stride)
+		w |= row[word+1] << (64-shift);
+	// Trim off whatever falls outside the frame.
+	if(lo > bit)
+		w = lo-bit >= 64 ? 0 : w & (~(uint64_t)0 << (lo-bit));
+	if(hi < bit+64)
+		w = hi-bit <= 0 ? 0 : w & (~(uint64_t)0 >> (64-(hi-bit)));
+	return w;
+}
+
+/*
+	Fills a row of bits with the opaque pixels of a sprite along
+	the pixel row y, from pixel x0 for n pixels. c and s are the
+	cosine and sine of the sprite's rotation.
+*/
+static void fillCollisionRow(RS_Sprite * sprite, GLfloat c, GLfloat s,
+							long x0, long y, long n, uint64_t * row)
+{
+	long words = (n+63)/64, k, i;
+	GLuint maskStride;
+	const uint64_t * mask = spriteMask(sprite, &maskStride);
+	
+	// Sprites drawn one texel to a pixel can be copied straight
+	// out of their masks a word at a time.
+	if(mask && sprite->rotation == 0.0 && sprite->scaleX == 1.0 && sprite->scaleY == 1.0)
+	{
+		GLuint rect[4], imageX, imageY;
+		long ty = y-sprite->posY;
+		// Only the stored part of the frame has a mask; the
+		// rest of a trimmed frame is clear.
+		storedFrameRect(sprite, rect, &imageX, &imageY);
+		if(ty < (long)rect[1] || ty >= (long)(rect[1]+rect[3]))
+		{
+			memset(row, 0, words*sizeof(uint64_t));
+			return;
+		}
+		const uint64_t * src = &mask[(size_t)(imageY+ty-rect[1])*maskStride];
+		long lo = imageX, hi = lo+rect[2];
+		long bit = lo-(long)rect[0]+x0-sprite->posX;
+		for(k = 0; k < words; k++)
+			row[k] = maskWord(src, maskStride, bit+k*64, lo, hi);
+		return;
+	}
+	
+	// Everything else is resampled at each pixel's center.
+	memset(row, 0, words*sizeof(uint64_t));
+	for(i = 0; i < n; i++)
+		if(texelAt(sprite, c, s, x0+i+.5f, y+.5f))
+			row[i>>6] |= (uint64_t)1 << (i&63);
+}
+
+// Row buffers for the narrow phase, grown as needed.
+static uint64_t * collisionRows;
+static size_t collisionRowWords;
+
+/*
+	The narrow phase: tests two sprites, whose boxes are already
+	known, row by row across the pixels both boxes cover.
+*/
+static int collideWithin(RS_Sprite * a, const GLfloat * boundsA, RS_Sprite * b, const GLfloat * boundsB)
+{
+	long x0 = (long)floorf(boundsA[0] > boundsB[0] ? boundsA[0] : boundsB[0]);
+	long y0 = (long)floorf(boundsA[1] > boundsB[1] ? boundsA[1] : boundsB[1]);
+	long x1 = (long)ceilf(boundsA[2] < boundsB[2] ? boundsA[2] : boundsB[2]);
+	long y1 = (long)ceilf(boundsA[3] < boundsB[3] ? boundsA[3] : boundsB[3]);
+	long n = x1-x0, words = (n+63)/64, y, k;
+	GLfloat ca = cosf(a->rotation), sa = sinf(a->rotation);
+	GLfloat cb = cosf(b->rotation), sb = sinf(b->rotation);
+	uint64_t last;
+	if(n <= 0 || y1 <= y0) return 0;
+	
+	// One row for each sprite.
+	if(collisionRowWords < (size_t)words*2)
+	{
+		collisionRowWords = words*2;
+		collisionRows = realloc(collisionRows, collisionRowWords*sizeof(uint64_t));
+	}
+	uint64_t * rowA = collisionRows;
+	uint64_t * rowB = collisionRows+words;
+	// Bits past the end of the overlap don't count.
+	last = n%64 ? ~(uint64_t)0 >> (64-n%64) : ~(uint64_t)0;
+	
+	for(y = y0; y < y1; y++)
+	{
+		fillCollisionRow(a, ca, sa, x0, y, n, rowA);
+		fillCollisionRow(b, cb, sb, x0, y, n, rowB);
+		for(k = 0; k < words-1; k++)
+			if(rowA[k] & rowB[k]) return 1;
+		if(rowA[k] & rowB[k] & last) return 1;
+	}
+	return 0;
+}
+
+int RS_spritesCollide(RS_Sprite * a, RS_Sprite * b)
+{
+	GLfloat boundsA[4], boundsB[4];
+	RS_getSpriteBounds(a, boundsA);
+	RS_getSpriteBounds(b, boundsB);
+	return collideWithin(a, boundsA, b, boundsB);
+}
+
+// Scratch space for the broad phase, grown as needed.
+static GLfloat * broadBounds;
+static unsigned int * broadOrder;
+static unsigned int broadCapacity;
+
+/*
+	Orders sprite indices by the left edges of their boxes.
+*/
+static int compareLeftEdges(const void * a, const void * b)
+{
+	GLfloat ea = broadBounds[*(const unsigned int*)a*4];
+	GLfloat eb = broadBounds[*(const unsigned int*)b*4];
+	return ea < eb ? -1 : ea > eb;
+}
+
+unsigned int RS_findCollisions(RS_Sprite ** sprites, unsigned int num,
+								RS_CollisionPair * pairs, unsigned int maxPairs)
+{
+	unsigned int i, j, found = 0;
+	if(broadCapacity < num)
+	{
+		broadCapacity = num;
+		broadBounds = realloc(broadBounds, sizeof(GLfloat)*4*num);
+		broadOrder = realloc(broadOrder, sizeof(unsigned int)*num);
+	}
+	
+	// Box every sprite, and sort them along X.
+	for(i = 0; i < num; i++)
+	{
+		RS_getSpriteBounds(sprites[i], &broadBounds[i*4]);
+		broadOrder[i] = i;
+	}
+	qsort(broadOrder, num, sizeof(unsigned int), compareLeftEdges);
+	
+	// Sweep: each sprite can only touch those whose left edges
+	// come before its right edge.
+	for(i = 0; i < num; i++)
+	{
+		unsigned int p = broadOrder[i];
+		const GLfloat * bp = &broadBounds[p*4];
+		for(j = i+1; j < num; j++)
+		{
+			unsigned int q = broadOrder[j];
+			const GLfloat * bq = &broadBounds[q*4];
+			if(bq[0] >= bp[2]) break;
+			if(bq[1] >= bp[3] || bp[1] >= bq[3]) continue;
+			if(!collideWithin(sprites[p], bp, sprites[q], bq)) continue;
+			if(found < maxPairs)
+			{
+				pairs[found].a = p < q ? p : q;
+				pairs[found].b = p < q ? q : p;
+			}
+			++found;
+		}
+	}
+	return found;
+}
+
+/*
+	Makes sure the batch target is at least the given size.
+*/
+static void requireBatchTarget(GLuint width, GLuint height)
+{
+	if(batchTarget && batchTarget->width >= width && batchTarget->height >= height)
+		return;
+	// Grow in both directions at once, so alternating tall and
+	// wide jobs don't remake it every time.
+	if(batchTarget)
+	{
+		if(batchTarget->width > width) width = batchTarget->width;
+		if(batchTarget->height > height) height = batchTarget->height;
+		glDeleteFramebuffersEXT(1, &batchTarget->fbo);
+		glDeleteTextures(1, &batchTarget->tex);
+		attachmentBytes -= numTexelBytes(batchTarget->width, batchTarget->height, RS_RGBA);
+		free(batchTarget);
+	}
+	// Like the virtual screen, it renders straight into its image.
+	batchTarget = generateRawSprite();
+	batchTarget->width = batchTarget->imageWidth = width;
+	batchTarget->height = batchTarget->imageHeight = height;
+	batchTarget->format = RS_RGBA;
+	generateTexture(&batchTarget->tex, width, height, RS_RGBA, NULL);
+	generateFramebuffer(&batchTarget->fbo, &batchTarget->tex);
+	attachmentBytes += numTexelBytes(width, height, RS_RGBA);
+}
+
+GLdouble RS_renderBatch(RS_BatchJob * jobs, unsigned int num)
+{
+	GLint viewport[4];
+	GLdouble start, seconds;
+	unsigned int i;
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	start = clockSeconds();
 	
-	// State-persistence time!
-	glActiveTexture(GL_TEXTURE0+0);
-	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
-	glActiveTexture(GL_TEXTURE0+1);
-	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
-	glUseProgram(RS_NULL_PROGRAM);
+	for(i = 0; i < num; i++)
+	{
+		RS_BatchJob * job = &jobs[i];
+		RS_Sprite * sprite = job->sprite;
+		// Put the job's state on the sprite for the draw, and
+		// keep the sprite's own to put back after.
+		RS_Sprite saved = *sprite;
+		sprite->posX = job->posX;
+		sprite->posY = job->posY;
+		sprite->rotation = job->rotation;
+		sprite->scaleX = job->scaleX;
+		sprite->scaleY = job->scaleY;
+		sprite->paletteA = job->palette;
+		sprite->paletteB = NULL;
+		
+		// Jobs smaller than the target use its lower left corner,
+		// which is where its top rows are.
+		requireBatchTarget(job->width, job->height);
+		glBindFramebufferEXT(GL_FRAMEBUFFER, batchTarget->fbo);
+		glViewport(0, 0, job->width, job->height);
+		clearToBlack(0.0);
+		drawToTarget(sprite, batchTarget->fbo, (GLfloat)job->width, (GLfloat)job->height, GL_FALSE);
+		glBindFramebufferEXT(GL_FRAMEBUFFER, batchTarget->fbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, job->width, job->height, GL_RGBA, GL_UNSIGNED_BYTE, job->output);
+		
+		sprite->posX = saved.posX;
+		sprite->posY = saved.posY;
+		sprite->rotation = saved.rotation;
+		sprite->scaleX = saved.scaleX;
+		sprite->scaleY = saved.scaleY;
+		sprite->paletteA = saved.paletteA;
+		sprite->paletteB = saved.paletteB;
+	}
 	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 	
+	seconds = clockSeconds()-start;
+	return seconds > 0.0 ? num/seconds : 0.0;
 }
 
-void RS_renderSpriteToScreen(RS_Sprite * sprite)
+RS_Scene * RS_mkScene(void)
 {
-	// Make sure that we are using the main framebuffer.
-	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+	RS_Scene * scene = malloc(sizeof(RS_Scene));
+	// Everything starts out empty and grows on demand.
+	memset(scene, 0, sizeof(RS_Scene));
+	return scene;
+}
+
+void RS_deleteScene(RS_Scene * scene)
+{
+	free(scene->sprites);
+	free(scene->parents);
+	free(scene->sizes);
+	free(scene->handles);
+	free(scene->indices);
+	free(scene->local);
+	free(scene->world);
+	free(scene->dirty);
+	free(scene->freeHandles);
+	free(scene);
+}
+
+/*
+	Moves the nodes from index from onwards by the given distance,
+	which may be negative, keeping every reference to them straight.
+*/
+static void shiftSceneNodes(RS_Scene * scene, unsigned int from, int distance)
+{
+	unsigned int count = scene->num-from, i;
+	unsigned int to = from+distance;
+	memmove(&scene->sprites[to], &scene->sprites[from], sizeof(RS_Sprite *)*count);
+	memmove(&scene->parents[to], &scene->parents[from], sizeof(int)*count);
+	memmove(&scene->sizes[to], &scene->sizes[from], sizeof(unsigned int)*count);
+	memmove(&scene->handles[to], &scene->handles[from], sizeof(unsigned int)*count);
+	memmove(&scene->local[to*5], &scene->local[from*5], sizeof(GLfloat)*5*count);
+	memmove(&scene->world[to*5], &scene->world[from*5], sizeof(GLfloat)*5*count);
+	memmove(&scene->dirty[to], &scene->dirty[from], count);
+	// Parents come before their children, so only nodes that moved
+	// can have parents that moved.
+	for(i = to; i < to+count; i++)
+	{
+		if(scene->parents[i] >= (int)from)
+			scene->parents[i] += distance;
+		scene->indices[scene->handles[i]] = i;
+	}
+}
+
+unsigned int RS_addSceneNode(RS_Scene * scene, RS_Sprite * sprite, unsigned int parent)
+{
+	int parentIndex = parent == RS_SCENE_ROOT ? -1 : (int)scene->indices[parent];
+	unsigned int handle, at;
+	int p;
 	
-	// Set up the first texture object slot so we
-	// can use the sprite's texture.
-	glActiveTexture(GL_TEXTURE0+0);
-	glBindTexture(GL_TEXTURE_2D, sprite->tex);
-	glUniform1i(canvasTextureUniform, 0);
+	// Make room.
+	if(scene->num == scene->capacity)
+	{
+		unsigned int c = scene->capacity = scene->capacity ? scene->capacity*2 : 16;
+		scene->sprites = realloc(scene->sprites, sizeof(RS_Sprite *)*c);
+		scene->parents = realloc(scene->parents, sizeof(int)*c);
+		scene->sizes = realloc(scene->sizes, sizeof(unsigned int)*c);
+		scene->handles = realloc(scene->handles, sizeof(unsigned int)*c);
+		scene->indices = realloc(scene->indices, sizeof(unsigned int)*c);
+		scene->freeHandles = realloc(scene->freeHandles, sizeof(unsigned int)*c);
+		scene->local = realloc(scene->local, sizeof(GLfloat)*5*c);
+		scene->world = realloc(scene->world, sizeof(GLfloat)*5*c);
+		scene->dirty = realloc(scene->dirty, c);
+	}
+	handle = scene->numFreeHandles ? scene->freeHandles[--scene->numFreeHandles] : scene->numHandles++;
 	
-	// As a compatibility thing we also send in
-	// the sprite's texture to the other texture
-	// unit. This way the shader has nothing to
-	// worry about.
-	glActiveTexture(GL_TEXTURE0+1);
-	glBindTexture(GL_TEXTURE_2D, sprite->tex);
-	glUniform1i(mediumTextureUniform, 1);
-	
-	// Get the width and height of the window.
-	GLuint data[4];	// Window X, Y, width and height.
-	glGetIntegerv(GL_VIEWPORT, data);
-	glUniform2f(canvasFrameSizeUniform, (GLfloat)data[2], (GLfloat)data[3]);
-	glUniform2f(canvasFrameOffsetUniform, 0.0, 0.0);
-	glUniform2f(mediumFrameSizeUniform, (GLfloat)sprite->width, (GLfloat)sprite->height);
-	glUniform2f(mediumFrameOffsetUniform, (GLfloat)sprite->frameOffsetX, (GLfloat)sprite->frameOffsetY);
-	
-	// Still have to set the mix uniform, but since
-	// the canvas and medium textures are the same,
-	// the value doesn't really matter.
-	glUniform1f(mixUniform, .5);
+	// The new node goes at the end of its parent's subtree, so
+	// that subtree stays in one run.
+	at = parentIndex < 0 ? scene->num : parentIndex+scene->sizes[parentIndex];
+	if(at < scene->num)
+		shiftSceneNodes(scene, at, 1);
+	++scene->num;
+	for(p = parentIndex; p >= 0; p = scene->parents[p])
+		++scene->sizes[p];
 	
-	// Don't forget to tell the shader all about how
-	// to manipulate the sprite.
-	updateSpriteUniformState(sprite);
+	scene->sprites[at] = sprite;
+	scene->parents[at] = parentIndex;
+	scene->sizes[at] = 1;
+	scene->handles[at] = handle;
+	scene->indices[handle] = at;
+	scene->local[at*5+0] = 0.0;
+	scene->local[at*5+1] = 0.0;
+	scene->local[at*5+2] = 0.0;
+	scene->local[at*5+3] = 1.0;
+	scene->local[at*5+4] = 1.0;
+	scene->dirty[at] = 1;
+	scene->anyDirty = 1;
+	return handle;
+}
+
+void RS_removeSceneNode(RS_Scene * scene, unsigned int node)
+{
+	unsigned int at = scene->indices[node];
+	unsigned int size = scene->sizes[at], i;
+	int p;
 	
-	// Now that all the uniforms are set up, we can call
-	// our drawing function.
-	drawSquare();
+	// Give back the handles of the whole subtree.
+	for(i = at; i < at+size; i++)
+		scene->freeHandles[scene->numFreeHandles++] = scene->handles[i];
+	for(p = scene->parents[at]; p >= 0; p = scene->parents[p])
+		scene->sizes[p] -= size;
 	
-	// State-persistence time!
-	glActiveTexture(GL_TEXTURE0+0);
-	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
-	glActiveTexture(GL_TEXTURE0+1);
-	glBindTexture(GL_TEXTURE_2D, RS_NULL_TEXTURE);
-	glUseProgram(RS_NULL_PROGRAM);
-	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+	// Close the gap.
+	if(at+size < scene->num)
+		shiftSceneNodes(scene, at+size, -(int)size);
+	scene->num -= size;
 }
 
-void RS_beginRenderToSprite(RS_Sprite * sprite)
+void RS_setNodeTransform(RS_Scene * scene, unsigned int node, GLfloat x, GLfloat y,
+						GLfloat rotation, GLfloat scaleX, GLfloat scaleY)
 {
-	// Bind to the framebuffer of the canvas RS_Sprite, so the
-	// rendering pipeline outputs into its texture.
-	glBindFramebufferEXT(GL_FRAMEBUFFER, sprite->fbo);
-	// We don't have a depth texture or renderbuffer.
-	glDisable(GL_DEPTH_TEST);
+	unsigned int at = scene->indices[node];
+	GLfloat * local = &scene->local[at*5];
+	local[0] = x;
+	local[1] = y;
+	local[2] = rotation;
+	local[3] = scaleX;
+	local[4] = scaleY;
+	scene->dirty[at] = 1;
+	scene->anyDirty = 1;
 }
 
-void RS_endRenderToSprite(RS_Sprite * sprite)
+void RS_updateScene(RS_Scene * scene)
 {
-	// Bind back to the normal framebuffer.
-	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
+	unsigned int i = 0, j, end;
+	// Standing still is free.
+	if(!scene->anyDirty) return;
+	
+	// Parents come before their children, so by the time a node is
+	// reached, its parent's world transform is already current. A
+	// dirty node drags its whole run along with it; clean runs are
+	// stepped over.
+	while(i < scene->num)
+	{
+		if(!scene->dirty[i])
+		{
+			++i;
+			continue;
+		}
+		end = i+scene->sizes[i];
+		for(j = i; j < end; j++)
+		{
+			const GLfloat * local = &scene->local[j*5];
+			GLfloat * world = &scene->world[j*5];
+			RS_Sprite * sprite = scene->sprites[j];
+			int p = scene->parents[j];
+			if(p < 0)
+				memcpy(world, local, sizeof(GLfloat)*5);
+			else
+			{
+				const GLfloat * up = &scene->world[p*5];
+				GLfloat c = cosf(up[2]), s = sinf(up[2]);
+				GLfloat x = local[0]*up[3], y = local[1]*up[4];
+				world[0] = up[0]+c*x-s*y;
+				world[1] = up[1]+s*x+c*y;
+				world[2] = up[2]+local[2];
+				world[3] = up[3]*local[3];
+				world[4] = up[4]*local[4];
+			}
+			scene->dirty[j] = 0;
+			
+			// Sprites are placed by their top left corner, and
+			// turn around their centers.
+			if(sprite)
+			{
+				sprite->posX = (GLint)floorf(world[0]-sprite->width*world[3]*.5f+.5f);
+				sprite->posY = (GLint)floorf(world[1]-sprite->height*world[4]*.5f+.5f);
+				sprite->rotation = world[2];
+				sprite->scaleX = world[3];
+				sprite->scaleY = world[4];
+			}
+		}
+		i = end;
+	}
+	scene->anyDirty = 0;
 }
 
-GLuint RS_getTexture(RS_Sprite * sprite)
+void RS_getNodeWorldTransform(RS_Scene * scene, unsigned int node, GLfloat * transform)
 {
-	return sprite->tex;
+	memcpy(transform, &scene->world[scene->indices[node]*5], sizeof(GLfloat)*5);
 }
 
-GLuint RS_getFBO(RS_Sprite * sprite)
+void RS_renderSceneToScreen(RS_Scene * scene)
 {
-	return sprite->fbo;
+	unsigned int i;
+	for(i = 0; i < scene->num; i++)
+		if(scene->sprites[i])
+			RS_renderSpriteToScreen(scene->sprites[i]);
 }
 
-GLuint RS_getWidth(RS_Sprite * sprite)
+RS_StaticLayer * RS_mkStaticLayer(GLint x, GLint y, GLuint width, GLuint height, GLuint chunkSize)
 {
-	return sprite->width;
+	RS_StaticLayer * layer = malloc(sizeof(RS_StaticLayer));
+	size_t numChunks;
+	memset(layer, 0, sizeof(RS_StaticLayer));
+	if(chunkSize == 0) chunkSize = 1;
+	layer->x = x;
+	layer->y = y;
+	layer->chunkSize = chunkSize;
+	layer->columns = (width+chunkSize-1)/chunkSize;
+	layer->rows = (height+chunkSize-1)/chunkSize;
+	numChunks = (size_t)layer->columns*layer->rows;
+	layer->chunks = calloc(numChunks ? numChunks : 1, sizeof(RS_Sprite *));
+	layer->counts = calloc(numChunks ? numChunks : 1, sizeof(unsigned int));
+	layer->entries = calloc(numChunks ? numChunks : 1, sizeof(RS_StaticEntry *));
+	layer->entryCapacities = calloc(numChunks ? numChunks : 1, sizeof(unsigned int));
+	layer->dirty = calloc(numChunks ? numChunks : 1, 1);
+	// Nothing has been on screen yet.
+	layer->shown[0] = layer->shown[1] = 0;
+	layer->shown[2] = layer->shown[3] = -1;
+	layer->next = staticLayers;
+	staticLayers = layer;
+	return layer;
 }
 
-GLuint RS_getHeight(RS_Sprite * sprite)
+void RS_deleteStaticLayer(RS_StaticLayer * layer)
 {
-	return sprite->height;
+	RS_StaticLayer ** link = &staticLayers;
+	GLuint i;
+	while(*link != layer) link = &(*link)->next;
+	*link = layer->next;
+	for(i = 0; i < layer->columns*layer->rows; i++)
+	{
+		releaseChunk(layer, i);
+		free(layer->entries[i]);
+	}
+	free(layer->chunks);
+	free(layer->counts);
+	free(layer->entries);
+	free(layer->entryCapacities);
+	free(layer->dirty);
+	free(layer->sprites);
+	free(layer->spans);
+	free(layer->orders);
+	free(layer);
 }
 
-GLfloat RS_getRot(RS_Sprite * sprite)
+/*
+	Works out which chunks a sprite touches as it stands, as the
+	first column and row, then the last. Sprites off the layer
+	touch none, and come out with the first past the last.
+*/
+static void staticSpan(RS_StaticLayer * layer, RS_Sprite * sprite, GLint * span)
 {
-	return sprite->rotation;
+	GLfloat bounds[4];
+	GLfloat size = (GLfloat)layer->chunkSize;
+	RS_getSpriteBounds(sprite, bounds);
+	span[0] = (GLint)floorf((bounds[0]-layer->x)/size);
+	span[1] = (GLint)floorf((bounds[1]-layer->y)/size);
+	span[2] = (GLint)floorf((bounds[2]-layer->x)/size);
+	span[3] = (GLint)floorf((bounds[3]-layer->y)/size);
+	if(span[0] < 0) span[0] = 0;
+	if(span[1] < 0) span[1] = 0;
+	if(span[2] >= (GLint)layer->columns) span[2] = (GLint)layer->columns-1;
+	if(span[3] >= (GLint)layer->rows) span[3] = (GLint)layer->rows-1;
 }
 
-GLint RS_getXPos(RS_Sprite * sprite)
+/*
+	Puts a sprite on a chunk's list, behind everything added to
+	the layer after it.
+*/
+static void addChunkEntry(RS_StaticLayer * layer, GLuint chunk, RS_Sprite * sprite, unsigned int order)
 {
-	return sprite->posX;
+	RS_StaticEntry * entries;
+	unsigned int i = layer->counts[chunk];
+	if(i == layer->entryCapacities[chunk])
+	{
+		layer->entryCapacities[chunk] = i ? i*2 : 8;
+		layer->entries[chunk] = realloc(layer->entries[chunk], sizeof(RS_StaticEntry)*layer->entryCapacities[chunk]);
+	}
+	entries = layer->entries[chunk];
+	// New sprites go on the end, so this rarely has to look far.
+	while(i > 0 && entries[i-1].order > order)
+		i--;
+	memmove(&entries[i+1], &entries[i], sizeof(RS_StaticEntry)*(layer->counts[chunk]-i));
+	entries[i].sprite = sprite;
+	entries[i].order = order;
+	++layer->counts[chunk];
 }
 
-GLint RS_getYPos(RS_Sprite * sprite)
-
+/*
+	Takes a sprite off a chunk's list, keeping the rest in order.
+*/
+static void removeChunkEntry(RS_StaticLayer * layer, GLuint chunk, RS_Sprite * sprite)
 {
-	return sprite->posY;
+	RS_StaticEntry * entries = layer->entries[chunk];
+	unsigned int i;
+	for(i = 0; i < layer->counts[chunk]; i++)
+		if(entries[i].sprite == sprite)
+			break;
+	if(i == layer->counts[chunk]) return;
+	--layer->counts[chunk];
+	memmove(&entries[i], &entries[i+1], sizeof(RS_StaticEntry)*(layer->counts[chunk]-i));
 }
 
-GLfloat RS_getXScale(RS_Sprite * sprite)
+/*
+	Adds a sprite to the chunks its span covers, or takes it
+	away, marking them all to be baked again.
+*/
+static void markStaticSpan(RS_StaticLayer * layer, GLint * span, RS_Sprite * sprite, unsigned int order, int add)
 {
-	return sprite->scaleX;
+	GLint column, row;
+	for(row = span[1]; row <= span[3]; row++)
+	{
+		for(column = span[0]; column <= span[2]; column++)
+		{
+			GLuint chunk = row*layer->columns+column;
+			layer->dirty[chunk] = 1;
+			if(add)
+				addChunkEntry(layer, chunk, sprite, order);
+			else
+			{
+				removeChunkEntry(layer, chunk, sprite);
+				// Chunks left with nothing in them aren't drawn,
+				// so there's no sense holding on to them.
+				if(layer->counts[chunk] == 0)
+					releaseChunk(layer, chunk);
+			}
+		}
+	}
 }
 
-GLfloat RS_getYScale(RS_Sprite * sprite)
+/*
+	Returns where a sprite is in a static layer's list, or the
+	number of sprites if it isn't there.
+*/
+static unsigned int findStaticSprite(RS_StaticLayer * layer, RS_Sprite * sprite)
 {
-	return sprite->scaleY;
+	unsigned int i;
+	for(i = 0; i < layer->num; i++)
+		if(layer->sprites[i] == sprite)
+			break;
+	return i;
 }
 
-RS_Color * RS_getTint(RS_Sprite * sprite)
+void RS_addToStaticLayer(RS_StaticLayer * layer, RS_Sprite * sprite)
 {
-	return sprite->tint;
+	if(layer->num == layer->capacity)
+	{
+		layer->capacity = layer->capacity ? layer->capacity*2 : 64;
+		layer->sprites = realloc(layer->sprites, sizeof(RS_Sprite *)*layer->capacity);
+		layer->spans = realloc(layer->spans, sizeof(GLint)*4*layer->capacity);
+		layer->orders = realloc(layer->orders, sizeof(unsigned int)*layer->capacity);
+	}
+	layer->sprites[layer->num] = sprite;
+	layer->orders[layer->num] = layer->nextOrder++;
+	staticSpan(layer, sprite, &layer->spans[layer->num*4]);
+	markStaticSpan(layer, &layer->spans[layer->num*4], sprite, layer->orders[layer->num], 1);
+	++layer->num;
 }
 
-GLfloat * RS_getTexelData(RS_Sprite * sprite)
+void RS_removeFromStaticLayer(RS_StaticLayer * layer, RS_Sprite * sprite)
 {
-	// Allocate data to store what the GPU gives us.
-	GLfloat * data;
-	if(sprite->format == RS_RGB)
-		data = malloc(sizeof(GLfloat)*sprite->width*sprite->height*3);
-	else
-		data = malloc(sizeof(GLfloat)*sprite->width*sprite->height*4);
-		
-	// Make sure that we are reading from the correct framebuffer.
-	glBindFramebufferEXT(GL_FRAMEBUFFER, sprite->fbo);
-	// It's kind of like palm reading, but with VRAM.
-	glReadPixels(0,	// Top left of rectangle to read out. (x)
-				0,	// Top left of rectangle to read out. (y)
-				sprite->width,	// The width of that rectangle.
-				sprite->height,	// The height of that rectangle.
-				sprite->format,	// The format of that data that we're expecting.
-				GL_FLOAT,	// The type of that data.
-				data);	// A container for this frame data.
-	return data;
+	unsigned int i = findStaticSprite(layer, sprite);
+	if(i == layer->num) return;
+	markStaticSpan(layer, &layer->spans[i*4], sprite, layer->orders[i], 0);
+	// Keep the rest in order, since that's the order they're drawn in.
+	--layer->num;
+	memmove(&layer->sprites[i], &layer->sprites[i+1], sizeof(RS_Sprite *)*(layer->num-i));
+	memmove(&layer->spans[i*4], &layer->spans[(i+1)*4], sizeof(GLint)*4*(layer->num-i));
+	memmove(&layer->orders[i], &layer->orders[i+1], sizeof(unsigned int)*(layer->num-i));
 }
 
-GLfloat * RS_getTexelGroup(RS_Sprite * sprite, GLuint x, GLuint y, GLuint width, GLuint height)
+void RS_updateStaticSprite(RS_StaticLayer * layer, RS_Sprite * sprite)
 {
-	GLfloat * data;
-	if(sprite->format == RS_RGB)
-		data = malloc(sizeof(GLfloat)*(width-x)*(height-y)*3);
-	else
-		data = malloc(sizeof(GLfloat)*(width-x)*(height-y)*4);
+	unsigned int i = findStaticSprite(layer, sprite);
+	GLint span[4];
+	if(i == layer->num) return;
+	// Add to the new span before taking the old one away, so a
+	// chunk the sprite stays in isn't released in between. The
+	// two entries such a chunk briefly holds are the same, so it
+	// doesn't matter which one goes.
+	staticSpan(layer, sprite, span);
+	markStaticSpan(layer, span, sprite, layer->orders[i], 1);
+	markStaticSpan(layer, &layer->spans[i*4], sprite, layer->orders[i], 0);
+	memcpy(&layer->spans[i*4], span, sizeof(GLint)*4);
+}
 
+/*
+	Bakes every sprite touching a chunk into its sprite, creating
+	the sprite if this is the chunk's first bake.
+*/
+static void bakeChunk(RS_StaticLayer * layer, GLuint column, GLuint row)
+{
+	GLuint chunk = row*layer->columns+column, i;
+	GLint left = layer->x+(GLint)(column*layer->chunkSize);
+	GLint top = layer->y+(GLint)(row*layer->chunkSize);
+	GLint viewport[4];
+	GLint blendSrcRGB, blendDstRGB, blendSrcAlpha, blendDstAlpha;
+	GLboolean blending;
+	RS_Sprite * sprite = layer->chunks[chunk];
+	
+	if(!sprite)
+	{
+		// Chunks are drawn from but never mix their own image in,
+		// so they can render straight into it.
+		sprite = generateRawSprite();
+		sprite->width = sprite->imageWidth = layer->chunkSize;
+		sprite->height = sprite->imageHeight = layer->chunkSize;
+		sprite->format = RS_RGBA;
+		generateTexture(&sprite->tex, layer->chunkSize, layer->chunkSize, RS_RGBA, NULL);
+		generateFramebuffer(&sprite->fbo, &sprite->tex);
+		attachmentBytes += numTexelBytes(layer->chunkSize, layer->chunkSize, RS_RGBA);
+		layer->chunks[chunk] = sprite;
+	}
+	
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glViewport(0, 0, layer->chunkSize, layer->chunkSize);
 	glBindFramebufferEXT(GL_FRAMEBUFFER, sprite->fbo);
-	// Oh look now you get to specify the parameters to glReadPixels().
-	glReadPixels(x,
-				y,
-				width,
-				height,
-				sprite->format,
-				GL_FLOAT,
-				data);
+	clearToBlack(0.0);
 	glBindFramebufferEXT(GL_FRAMEBUFFER, RS_NULL_FRAMEBUFFER);
-	return data;
+	
+	// Every sprite is laid over the chunk the way
+	// RS_blendSpriteToSprite() does at a full mix, so the blend
+	// state is set once for the lot rather than for each one.
+	blending = glIsEnabled(GL_BLEND);
+	glGetIntegerv(GL_BLEND_SRC_RGB, &blendSrcRGB);
+	glGetIntegerv(GL_BLEND_DST_RGB, &blendDstRGB);
+	glGetIntegerv(GL_BLEND_SRC_ALPHA, &blendSrcAlpha);
+	glGetIntegerv(GL_BLEND_DST_ALPHA, &blendDstAlpha);
+	glEnable(GL_BLEND);
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	
+	// Each sprite is drawn relative to the chunk's corner, in
+	// the order the sprites were added.
+	for(i = 0; i < layer->counts[chunk]; i++)
+	{
+		RS_Sprite * medium = layer->entries[chunk][i].sprite;
+		GLint x = medium->posX, y = medium->posY;
+		medium->posX = x-left;
+		medium->posY = y-top;
+		drawIntoCanvas(sprite, medium, 1.0, 1, 1);
+		medium->posX = x;
+		medium->posY = y;
+	}
+	
+	glBlendFuncSeparate(blendSrcRGB, blendDstRGB, blendSrcAlpha, blendDstAlpha);
+	if(!blending) glDisable(GL_BLEND);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	layer->dirty[chunk] = 0;
 }
 
-void RS_getColorAt(RS_Color * container, RS_Sprite * sprite, GLuint x, GLuint y)
+void RS_renderStaticLayerToScreen(RS_StaticLayer * layer, GLint cameraX, GLint cameraY)
 {
-	// Get a single pixel of color data.
-	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
-	// Stuff it into the container RS_Color.
-	container->r = data[0];
-	container->g = data[1];
-	container->b = data[2];
-	// If the sprite is merely RGB, then we wouldn't have
-	// gotten a fourth term from RS_getPixelData().
-	if(sprite->format == RS_RGBA)
-		container->a = data[3];
-	else
-		container->a = 1.0;
-		
-	// Free that pixel from the wrath of definition.
-	free(data);
+	GLint viewport[4], span[4], column, row;
+	GLint blendSrcRGB, blendDstRGB, blendSrcAlpha, blendDstAlpha;
+	GLboolean blending;
+	GLfloat size = (GLfloat)layer->chunkSize;
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	
+	// Find the chunks under the screen, or the virtual screen
+	// if that's where sprites are going.
+	if(virtualScreen)
+	{
+		viewport[2] = virtualScreen->width;
+		viewport[3] = virtualScreen->height;
+	}
+	span[0] = (GLint)floorf((GLfloat)(cameraX-layer->x)/size);
+	span[1] = (GLint)floorf((GLfloat)(cameraY-layer->y)/size);
+	span[2] = (GLint)floorf((GLfloat)(cameraX+viewport[2]-1-layer->x)/size);
+	span[3] = (GLint)floorf((GLfloat)(cameraY+viewport[3]-1-layer->y)/size);
+	if(span[0] < 0) span[0] = 0;
+	if(span[1] < 0) span[1] = 0;
+	if(span[2] >= (GLint)layer->columns) span[2] = (GLint)layer->columns-1;
+	if(span[3] >= (GLint)layer->rows) span[3] = (GLint)layer->rows-1;
+	// Note what's on screen first, so that keeping to the budget
+	// while baking never takes a chunk that's about to be drawn.
+	memcpy(layer->shown, span, sizeof(span));
+	
+	// Only what's on screen is brought up to date. Everything
+	// else stays dirty until it's seen.
+	for(row = span[1]; row <= span[3]; row++)
+		for(column = span[0]; column <= span[2]; column++)
+		{
+			GLuint chunk = row*layer->columns+column;
+			if(layer->counts[chunk] && (layer->dirty[chunk] || !layer->chunks[chunk]))
+				bakeChunk(layer, column, row);
+		}
+	
+	// The chunks are premultiplied.
+	blending = glIsEnabled(GL_BLEND);
+	glGetIntegerv(GL_BLEND_SRC_RGB, &blendSrcRGB);
+	glGetIntegerv(GL_BLEND_DST_RGB, &blendDstRGB);
+	glGetIntegerv(GL_BLEND_SRC_ALPHA, &blendSrcAlpha);
+	glGetIntegerv(GL_BLEND_DST_ALPHA, &blendDstAlpha);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	for(row = span[1]; row <= span[3]; row++)
+		for(column = span[0]; column <= span[2]; column++)
+		{
+			RS_Sprite * chunk = layer->chunks[row*layer->columns+column];
+			if(!chunk) continue;
+			chunk->posX = layer->x+column*(GLint)layer->chunkSize-cameraX;
+			chunk->posY = layer->y+row*(GLint)layer->chunkSize-cameraY;
+			RS_renderSpriteToScreen(chunk);
+		}
+	glBlendFuncSeparate(blendSrcRGB, blendDstRGB, blendSrcAlpha, blendDstAlpha);
+	if(!blending) glDisable(GL_BLEND);
 }
 
-GLfloat RS_getRedAt(RS_Sprite * sprite, GLuint x, GLuint y)
+/*
+	Copies a sprite's frame-to-frame state into an RS_SpriteState.
+*/
+static void captureState(RS_Sprite * sprite, RS_SpriteState * state)
 {
-	// Get that same single pixel.
-	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
-	// Store its red value.
-	GLfloat red = data[0];
-	// Rid ourselves of this filth.
-	free(data);
-	// Give back to the community.
-	return red;
+	state->posX = sprite->posX;
+	state->posY = sprite->posY;
+	state->rotation = sprite->rotation;
+	state->scaleX = sprite->scaleX;
+	state->scaleY = sprite->scaleY;
+	state->frameOffsetX = sprite->frameOffsetX;
+	state->frameOffsetY = sprite->frameOffsetY;
+	state->tint = sprite->tint;
+	state->paletteA = sprite->paletteA;
+	state->paletteB = sprite->paletteB;
+	state->swapHeight = sprite->swapHeight;
+	state->paletteBands = sprite->paletteBands;
 }
 
-GLfloat RS_getGreenAt(RS_Sprite * sprite, GLuint x, GLuint y)
+/*
+	Copies an RS_SpriteState back onto its sprite.
+*/
+static void applyState(const RS_SpriteState * state, RS_Sprite * sprite)
 {
-	// Hmm.
-	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
-	GLfloat green = data[1];
-	free(data);
-	return green;
+	sprite->posX = state->posX;
+	sprite->posY = state->posY;
+	sprite->rotation = state->rotation;
+	sprite->scaleX = state->scaleX;
+	sprite->scaleY = state->scaleY;
+	sprite->frameOffsetX = state->frameOffsetX;
+	sprite->frameOffsetY = state->frameOffsetY;
+	sprite->tint = state->tint;
+	sprite->paletteA = state->paletteA;
+	sprite->paletteB = state->paletteB;
+	sprite->swapHeight = state->swapHeight;
+	sprite->paletteBands = state->paletteBands;
+}
+
+RS_StateBuffer * RS_mkStateBuffer(RS_Sprite ** sprites, unsigned int num)
+{
+	RS_StateBuffer * buffer = malloc(sizeof(RS_StateBuffer));
+	unsigned int i;
+	int c;
+	buffer->num = num;
+	buffer->sprites = malloc(sizeof(RS_Sprite *)*num);
+	memcpy(buffer->sprites, sprites, sizeof(RS_Sprite *)*num);
+	buffer->back = malloc(sizeof(RS_SpriteState)*num);
+	buffer->backGens = calloc(num, sizeof(unsigned int));
+	for(i = 0; i < num; i++)
+		captureState(sprites[i], &buffer->back[i]);
+	
+	// Every copy starts out the same, as of publish zero.
+	for(c = 0; c < 3; c++)
+	{
+		buffer->copies[c] = malloc(sizeof(RS_SpriteState)*num);
+		memcpy(buffer->copies[c], buffer->back, sizeof(RS_SpriteState)*num);
+		buffer->copyGens[c] = calloc(num, sizeof(unsigned int));
+		buffer->copyGen[c] = 0;
+	}
+	buffer->generation = 0;
+	buffer->front = 0;
+	buffer->spare = 1;
+	buffer->ready = 2;
+	buffer->appliedGen = 0;
+	return buffer;
+}
+
+void RS_deleteStateBuffer(RS_StateBuffer * buffer)
+{
+	int c;
+	for(c = 0; c < 3; c++)
+	{
+		free(buffer->copies[c]);
+		free(buffer->copyGens[c]);
+	}
+	free(buffer->back);
+	free(buffer->backGens);
+	free(buffer->sprites);
+	free(buffer);
+}
+
+RS_SpriteState * RS_editSpriteState(RS_StateBuffer * buffer, unsigned int index)
+{
+	// Stamp it with the publish it'll go out in.
+	buffer->backGens[index] = buffer->generation+1;
+	return &buffer->back[index];
+}
+
+void RS_iterStateFrame(RS_StateBuffer * buffer, unsigned int index)
+{
+	// A sprite's dimensions never change once it's made, so reading
+	// them here is safe.
+	RS_Sprite * sprite = buffer->sprites[index];
+	RS_SpriteState * state = RS_editSpriteState(buffer, index);
+	GLuint sheetWidth, sheetHeight;
+	sheetSize(sprite, &sheetWidth, &sheetHeight);
+	state->frameOffsetX += sprite->width;
+	if(state->frameOffsetX >= sheetWidth)
+	{
+		state->frameOffsetX = 0;
+		state->frameOffsetY += sprite->height;
+	}
+	if(state->frameOffsetY >= sheetHeight)
+	{
+		state->frameOffsetX = 0;
+		state->frameOffsetY = 0;
+	}
 }
+
+void RS_publishSpriteStates(RS_StateBuffer * buffer)
+{
+	int spare = buffer->spare;
+	unsigned int since = buffer->copyGen[spare], i;
+	RS_SpriteState * copy = buffer->copies[spare];
+	unsigned int * gens = buffer->copyGens[spare];
 	
-GLfloat RS_getBlueAt(RS_Sprite * sprite, GLuint x, GLuint y)
+	// The spare copy is current as of the last time it was filled,
+	// so only what's been edited since needs to go into it.
+	++buffer->generation;
+	for(i = 0; i < buffer->num; i++)
+	{
+		if(buffer->backGens[i] > since)
+		{
+			copy[i] = buffer->back[i];
+			gens[i] = buffer->backGens[i];
+		}
+	}
+	buffer->copyGen[spare] = buffer->generation;
+	
+	// Hand it over, and take back whichever copy was waiting, or the
+	// one the drawing thread just let go of.
+	buffer->spare = exchangeAtomic(&buffer->ready, spare | RS_STATES_FRESH) & ~RS_STATES_FRESH;
+}
+
+int RS_acquireSpriteStates(RS_StateBuffer * buffer)
 {
-	// This leaves a familiar taste in my mouth.
-	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
-	GLfloat blue = data[2];
-	free(data);
-	return blue;
+	unsigned int since = buffer->appliedGen, i;
+	const RS_SpriteState * copy;
+	const unsigned int * gens;
+	if(!(loadAtomic(&buffer->ready) & RS_STATES_FRESH))
+		return 0;
+	
+	// Trade our copy for the waiting one. Only the simulating thread
+	// sets the fresh bit, so it can't have been taken in between.
+	buffer->front = exchangeAtomic(&buffer->ready, buffer->front) & ~RS_STATES_FRESH;
+	copy = buffer->copies[buffer->front];
+	gens = buffer->copyGens[buffer->front];
+	
+	// Bring over whatever changed since the copy we last applied,
+	// however many publishes ago that was.
+	for(i = 0; i < buffer->num; i++)
+		if(gens[i] > since)
+			applyState(&copy[i], buffer->sprites[i]);
+	buffer->appliedGen = buffer->copyGen[buffer->front];
+	return 1;
 }
 
-GLfloat RS_getAlphaAt(RS_Sprite * sprite, GLuint x, GLuint y)
+const RS_SpriteState * RS_getSpriteState(RS_StateBuffer * buffer, unsigned int index)
 {
-	// So if the sprite has a strictly RGB format, the fourth
-	// term will be either null or the next red, depending on
-	// how glReadPixels() is implemented. So therefore we
-	// have to check to make sure that 
-	// Things aren't quite so opaque.
-	GLfloat * data = RS_getTexelGroup(sprite, x, y, 1, 1);
-	GLfloat alpha = data[3];
-	free(data);
-	return alpha;
-}
\ No newline at end of file
+	return &buffer->copies[buffer->front][index];
+}
+
+size_t RS_getSpriteMemory(RS_Sprite * sprite)
+{
+	size_t bytes = spriteTextureBytes(sprite)+spriteLODBytes(sprite);
+	if(sprite->fbo != RS_NULL_FBO)
+		bytes += spriteAttachmentBytes(sprite);
+	return bytes;
+}
+
+void RS_setTextureBudget(size_t bytes)
+{
+	textureBudget = bytes;
+	enforceBudget(NULL);
+}
+
+void RS_getMemoryStats(RS_MemoryStats * stats)
+{
+	RS_CachedTexture * entry;
+	unsigned int i;
+	stats->textureBytes = textureBytes;
+	stats->attachmentBytes = attachmentBytes;
+	stats->deferredAttachmentBytes = deferredAttachmentBytes;
+	stats->residentBytes = textureBytes+attachmentBytes+bakedBytes;
+	stats->budget = textureBudget;
+	stats->evictions = evictions;
+	stats->reloads = reloads;
+	stats->cacheHits = cacheHits;
+	stats->cacheMisses = cacheMisses;
+	stats->cacheSavedBytes = cacheSavedBytes;
+	stats->bakeHits = bakeHits;
+	stats->bakeMisses = bakeMisses;
+	stats->bakedBytes = bakedBytes;
+	stats->maskBytes = maskBytes;
+	stats->quadPixels = quadPixels;
+	stats->shadedPixels = shadedPixels;
+	stats->blits = blits;
+	
+	// Tally the cached images by how they're stored.
+	for(i = 0; i < RS_NUM_STORES; i++)
+		stats->storeBytes[i] = 0;
+	for(i = 0; i < RS_TEXTURE_CACHE_BUCKETS; i++)
+		for(entry = textureCache[i]; entry; entry = entry->next)
+		{
+			stats->storeBytes[entry->store] += cachedImageBytes(entry);
+			// LOD levels are always plain RGBA8.
+			stats->storeBytes[RS_STORE_RGBA8] += cachedLODBytes(entry);
+		}
+}
@@ -31,12 +31,31 @@
 #include <GL/glew.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include <lodepng.h>
 
 // Alias a couple of OpenGL's format enumerations for "namespace" homogeneity.
 #define RS_RGB GL_RGB
 #define RS_RGBA GL_RGBA
+// Grayscale PNGs are kept in these.
+#define RS_LUMINANCE GL_LUMINANCE
+#define RS_LUMINANCE_ALPHA GL_LUMINANCE_ALPHA
+
+// How a sprite's image can be kept on the GPU. Native keeps
+// it in the format it was decoded as. The 16-bit formats halve
+// an RGBA image, ALPHA8 keeps nothing but the alpha term, and the
+// compressed ones need S3TC or BPTC support from the driver.
+#define RS_STORE_NATIVE 0
+#define RS_STORE_RGBA8 1
+#define RS_STORE_RGB8 2
+#define RS_STORE_RGB5_A1 3
+#define RS_STORE_RGBA4 4
+#define RS_STORE_ALPHA8 5
+#define RS_STORE_DXT1 6
+#define RS_STORE_DXT5 7
+#define RS_STORE_BPTC 8
+#define RS_NUM_STORES 9
 
 // Just a few readability defines.
 #define RS_NULL_BUFFER 0
@@ -56,6 +75,62 @@
 // The maximum number of palette entries possible.
 #define RS_MAX_PALETTE_ENTRIES 256
 
+// How far apart two color terms can be and still match a palette key.
+// Must agree with SWAP_SENSITIVITY in rendersprite.frag.
+#define RS_SWAP_SENSITIVITY .0001
+
+// How many palettes a band table can hold.
+#define RS_MAX_BAND_PALETTES 16
+// What the lines of a band table count: the rows of the render
+// target, or the rows of the sprite's own frame.
+#define RS_BANDS_TARGET 0
+#define RS_BANDS_SPRITE 1
+// The band index that leaves lines unpaletted.
+#define RS_NO_BAND_PALETTE -1
+
+// How far, in texels, a line offset can shift a line.
+#define RS_MAX_LINE_OFFSET 2047.0
+// Line offsets are stored as 12.4 fixed point plus this bias.
+#define RS_LINE_OFFSET_BIAS 32768
+
+// How many reduced levels a sprite's LOD chain can have.
+#define RS_MAX_LOD_LEVELS 4
+
+// What an exporter writes each frame as: a numbered PNG file,
+// or RGBA8 pixels appended to one stream.
+#define RS_EXPORT_PNG 0
+#define RS_EXPORT_RAW 1
+
+// How RS_blendSpriteToSprite() combines the medium with the
+// canvas: a plain mix, a straight-alpha medium over the canvas,
+// or a premultiplied one over it.
+#define RS_BLEND_MIX 0
+#define RS_BLEND_OVER 1
+#define RS_BLEND_PREMULTIPLIED 2
+
+// How many vertices each frame's hull can have.
+#define RS_MAX_HULL_VERTICES 12
+
+// The parent to give scene nodes that have none.
+#define RS_SCENE_ROOT 0xFFFFFFFF
+
+// Marks a state buffer's waiting copy as not yet taken.
+#define RS_STATES_FRESH 4
+
+// How many baked palette variants are kept around at once.
+#define RS_MAX_BAKED_PALETTES 64
+
+// How many hash buckets the texture cache spreads its entries over.
+#define RS_TEXTURE_CACHE_BUCKETS 256
+
+// Sprite pack file constants. See RS_PackHeader.
+#define RS_PACK_MAGIC "RSPK"
+#define RS_PACK_VERSION 1
+#define RS_PACK_BYTE_ORDER 0x01020304
+#define RS_PACK_NAME_LENGTH 64
+// Pixel data and palettes in a pack start on multiples of this.
+#define RS_PACK_ALIGNMENT 16
+
 /*
 	An RGBA color type that is used to simplify
 	specifying color replacement and tinting.
@@ -76,24 +151,278 @@ typedef struct
 	in a way that frames them as a color palette,
 	e.g., the Genesis VDP.
 	
+	The colors are stored inline, as packed RGBA floats in a single
+	block allocated along with the palette, so building one costs a
+	single allocation and uploading one is a straight copy.
+	
 	Members:
-	keys (RS_Color**): An array of RS_Color pointers
-						that serves as the keys as to
-						whether or not the current fragment
-						needs to be replaced.
-	entries (RS_Color**): An array of RS_Color pointers
-						that serves as the substitutions
-						for the fragments that need to be replaced.
-	num (Unsigned Int): The number of entries--the length of
-						either array.
+	keyTerms (GLfloat*): The key colors, four terms each. A fragment
+						matching a key is replaced.
+	entryTerms (GLfloat*): The entry colors, four terms each, that
+						replace fragments matching the key at the
+						same index.
+	num (Unsigned Int): The number of key-entry pairs in use.
+	capacity (Unsigned Int): How many pairs the palette has room for.
+	version (Unsigned Int): Changes whenever the palette does,
+						so that images with the palette baked
+						in can tell when they're out of date.
+	keys (RS_Color**): Deprecated. The array of key RS_Colors the
+						palette was made from with RS_mkPalette(),
+						or NULL. After editing these, call
+						RS_invalidatePalette() to copy them in.
+	entries (RS_Color**): Deprecated. Likewise, the entry RS_Colors.
+	numColors (Unsigned Int): How many pairs keys and entries hold.
 */
 typedef struct 
 {
+	GLfloat * keyTerms;
+	GLfloat * entryTerms;
 	RS_Color ** keys;
 	RS_Color ** entries;
+	unsigned int numColors;
 	unsigned int num;
+	unsigned int capacity;
+	unsigned int version;
 } RS_Palette;
 
+/*
+	A table of palettes, and which of them applies to each line of
+	whatever is drawn with it. It generalizes the paletteA/paletteB
+	split to any number of bands, for raster effects like water
+	lines and gradient skies, in a single draw. Like RS_Sprite, its
+	members are private; use the RS_*PaletteBand* functions.
+	
+	Members:
+	palettes (RS_Palette*[])	The palettes lines can choose from.
+	versions (unsigned int[])	The version of each palette last uploaded.
+	counts (unsigned int[])	How many pairs of each palette were uploaded.
+	lines (GLuint)			How many lines the table covers. Lines
+							past the end use the last line's palette.
+	space (GLuint)			RS_BANDS_TARGET or RS_BANDS_SPRITE.
+	bands (unsigned char*)	The palette index of each line, or 255
+							for lines without one.
+	tableTex (GLuint)		The palettes' keys and entries, one row
+							per palette.
+	bandTex (GLuint)		Each line's palette index and length.
+	dirty (int)				Whether the bands changed since the last
+							upload.
+*/
+typedef struct
+{
+	RS_Palette * palettes[RS_MAX_BAND_PALETTES];
+	unsigned int versions[RS_MAX_BAND_PALETTES];
+	unsigned int counts[RS_MAX_BAND_PALETTES];
+	GLuint lines;
+	GLuint space;
+	unsigned char * bands;
+	GLuint tableTex, bandTex;
+	int dirty;
+} RS_PaletteBands;
+
+/*
+	Where one frame of a trimmed sprite sheet ended up. Trimming
+	cuts each frame down to the smallest rectangle holding all of
+	its visible texels, and packs those rectangles together into a
+	smaller image.
+	
+	Members:
+	atlasX, atlasY (GLuint)	Where the rectangle sits in the packed image.
+	x, y (GLuint)			Where it sat within its frame.
+	width, height (GLuint)	Its size. Frames with nothing visible
+							are 0x0.
+*/
+typedef struct
+{
+	GLuint atlasX, atlasY;
+	GLuint x, y;
+	GLuint width, height;
+} RS_TrimmedFrame;
+
+/*
+	A sprite's hull meshes: one convex polygon per frame, around
+	the frame's visible texels, drawn in place of the full quad.
+	Like RS_Sprite, its members are private.
+	
+	Members:
+	buffer (GLuint)			The vertex buffer holding every frame's
+							polygon as a triangle fan, in slots of
+							RS_MAX_HULL_VERTICES vertices. Vertices are
+							relative to the stored part of the frame,
+							from 0 to 1, and double as texture
+							coordinates.
+	numFrames (GLuint)		How many frames there are.
+	counts (unsigned char*)	How many vertices each frame's polygon has.
+	coverage (GLfloat*)		How much of the stored part of each frame
+							its polygon covers, from 0 to 1.
+*/
+typedef struct
+{
+	GLuint buffer;
+	GLuint numFrames;
+	unsigned char * counts;
+	GLfloat * coverage;
+} RS_Hull;
+
+/*
+	An image shared through the texture cache. Every sprite loaded
+	from the same file, with the same contents and frame layout,
+	references the same one of these, and with it the same texture.
+	Like RS_Sprite, these fields are private.
+	
+	Members:
+	path (char*)		The file the image was loaded from.
+	hash (unsigned long long)	A hash of the file's contents.
+	frameWidth (GLuint)	The frame width the image was loaded with.
+	frameHeight (GLuint)	The frame height the image was loaded with.
+	tex (GLuint)		The shared texture object, or RS_NULL_TEXTURE
+						while evicted.
+	width (GLuint)		The width of the image.
+	height (GLuint)		The height of the image.
+	format (RS_RGB(A))	The format of the image.
+	store (GLuint)		How the image is kept on the GPU; one of the
+						RS_STORE_ formats.
+	pixels (unsigned char*)	The image's texels inside a mapped sprite
+						pack, which it is reloaded from, or NULL
+						if it was decoded from a PNG.
+	pack (RS_Pack*)		The sprite pack pixels lie in, or NULL.
+	mask (uint64_t*)	One bit per texel, set where the texel isn't fully
+						transparent. Each row starts on a new word, and
+						the leftmost texel of a word is its lowest bit.
+	maskStride (GLuint)	How many words each row of the mask takes.
+	frames (RS_TrimmedFrame*)	Where each frame was packed, left to
+						right then top to bottom, if the image
+						was trimmed, or NULL.
+	sheetWidth (GLuint)	The width of the frame grid the image was
+						loaded as, which is its own width unless
+						it was trimmed.
+	sheetHeight (GLuint)	Likewise, the height.
+	lods (GLuint[])		The image's LOD chain, shared by every sprite
+						using it. Dropped along with the texture
+						when evicted, and built again on reload.
+	numLODs (GLuint)	How many levels are in the chain.
+	readFBO (GLuint)	A framebuffer around tex that copies read
+						through, or RS_NULL_FBO until one is needed.
+	refs (unsigned int)	How many sprites use this image.
+	next (RS_CachedTexture*)	The next entry in the same hash bucket.
+	lruPrev (RS_CachedTexture*)	The more recently drawn neighbour in
+								the library's residency list.
+	lruNext (RS_CachedTexture*)	The less recently drawn neighbour.
+*/
+typedef struct RS_CachedTexture
+{
+	char * path;
+	unsigned long long hash;
+	GLuint frameWidth, frameHeight;
+	
+	GLuint tex;
+	GLuint width, height;
+	GLuint format;
+	GLuint store;
+	unsigned char * pixels;
+	struct RS_Pack * pack;
+	uint64_t * mask;
+	GLuint maskStride;
+	RS_TrimmedFrame * frames;
+	GLuint sheetWidth, sheetHeight;
+	GLuint lods[RS_MAX_LOD_LEVELS];
+	GLuint numLODs;
+	GLuint readFBO;
+	
+	unsigned int refs;
+	struct RS_CachedTexture * next;
+	struct RS_CachedTexture * lruPrev;
+	struct RS_CachedTexture * lruNext;
+} RS_CachedTexture;
+
+/*
+	The header at the start of a sprite pack file. Sprite packs
+	are built offline by the rspack tool from a directory of PNGs,
+	and hold each image's texels already in the layout glTexImage2D()
+	wants, so loading a sprite from one costs no decoding at all.
+	
+	Layout:
+	RS_PackHeader, then numImages RS_PackEntries, then the palettes
+	and pixel data they point to, each starting on a multiple of
+	RS_PACK_ALIGNMENT bytes. Everything is in the byte order of the
+	machine that built the pack.
+	
+	Members:
+	magic (char[4])			RS_PACK_MAGIC, unterminated.
+	byteOrder (GLuint)		RS_PACK_BYTE_ORDER, as written by the
+							building machine.
+	version (GLuint)		RS_PACK_VERSION.
+	numImages (GLuint)		The number of entries in the index.
+*/
+typedef struct
+{
+	char magic[4];
+	GLuint byteOrder;
+	GLuint version;
+	GLuint numImages;
+} RS_PackHeader;
+
+/*
+	A sprite pack index entry, describing one image.
+	
+	Members:
+	name (char[RS_PACK_NAME_LENGTH])	The image's name; the PNG's
+							filename without the frame size suffix
+							or extension. Null-terminated.
+	width (GLuint)			The width of the image.
+	height (GLuint)			The height of the image.
+	frameWidth (GLuint)		The width of a frame of animation, or 0 if
+							the image isn't animated.
+	frameHeight (GLuint)	The height of a frame of animation, or 0.
+	format (RS_RGB(A))		The format of the pixel data. Rows are
+							tightly packed, 8 bits per term, top first.
+	paletteSize (GLuint)	The number of distinct colors in the image,
+							or 0 if there were more than
+							RS_MAX_PALETTE_ENTRIES.
+	paletteOffset (GLuint)	The byte offset of the palette from the
+							start of the file; paletteSize RGBA quads.
+	pixelOffset (GLuint)	The byte offset of the pixel data from the
+							start of the file.
+*/
+typedef struct
+{
+	char name[RS_PACK_NAME_LENGTH];
+	GLuint width, height;
+	GLuint frameWidth, frameHeight;
+	GLuint format;
+	GLuint paletteSize;
+	GLuint paletteOffset;
+	GLuint pixelOffset;
+} RS_PackEntry;
+
+/*
+	An opened sprite pack. The file is mapped into memory and
+	textures are uploaded straight from the mapping.
+	
+	Members:
+	path (char*)			The file the pack was opened from.
+	data (unsigned char*)	The mapped file.
+	size (size_t)			The size of the file.
+	header (RS_PackHeader*)	The header, inside the mapping.
+	entries (RS_PackEntry*)	The index, inside the mapping.
+	stamp (unsigned long long)	Tells this build of the file apart
+							from others at the same path.
+	users (unsigned int)	How many cached images were uploaded
+							from the mapping.
+	closed (int)			Whether RS_closePack() was called while
+							images still used the mapping.
+*/
+typedef struct RS_Pack
+{
+	char * path;
+	unsigned char * data;
+	size_t size;
+	RS_PackHeader * header;
+	RS_PackEntry * entries;
+	unsigned long long stamp;
+	unsigned int users;
+	int closed;
+} RS_Pack;
+
 /*
 	Defines a RenderSprite sprite. Since a lot of these can ruin
 	the functionality of the RenderSprite library, these fields are
@@ -108,7 +437,13 @@ typedef struct
 	att (GLuint)		The texture that serves as the framebuffer's
 						color attachment.
 	fbo (GLuint)		OpenGL's handle to the Sprite's
-						framebuffer object. 
+						framebuffer object. Both this and att are
+						RS_NULL_* until the sprite is first rendered
+						to or read back.
+	readFBO (GLuint)	A framebuffer around tex that RS_copySprite()
+						reads through, or RS_NULL_FBO until one is
+						needed. Sprites with a cached image use its
+						one instead.
 	imageWidth(GLuint)	When a sprite is not animated, the width of
 						the sprite and the image are the same. However,
 						when multiple frames of animation are stored in
@@ -122,8 +457,9 @@ typedef struct
 							shifted to reach the current frame.
 	frameOffsetY(GLuint)	The offset from 0 the Y texture coordinate is
 							shifted to reach the current frame.
-	format (RS_RGB(A))	The format of the image. Either RS_RGB 
-						or RS_RGBA.
+	format (RS_RGB(A))	The format of the image. RS_RGB or RS_RGBA,
+						or for grayscale PNGs, RS_LUMINANCE or
+						RS_LUMINANCE_ALPHA.
 	rotation (GLfloat)	A transform variable that describes how far
 						rotated around its center the sprite is,
 						in radians.
@@ -138,6 +474,25 @@ typedef struct
 	paletteB (RS_Palette*)	The second of two color replacement palettes.
 	swapHeight (GLint)		The Y coordinate above which paletteA is used,
 							and at or below paletteB is used.
+	paletteBands (RS_PaletteBands*)	A band table that, when set, is used
+							in place of both palettes.
+	lineOffsets (GLuint)	A one-row texture holding how far each line
+							of the frame is shifted, or RS_NULL_TEXTURE.
+	numLineOffsets (GLuint)	How many lines lineOffsets covers.
+	lods (GLuint[])			The reduced levels of the image, each half
+							the size of the one before. Sprites with
+							a cached image use its chain instead.
+	numLODs (GLuint)		How many reduced levels there are.
+	hull (RS_Hull*)			The sprite's hull meshes, or NULL to draw
+							whole quads.
+	mask (uint64_t*)		The alpha mask of an image loaded from
+							memory, laid out as RS_CachedTexture's, or
+							NULL. Cached images keep theirs in the cache.
+	maskStride (GLuint)		How many words each row of mask takes.
+	image (RS_CachedTexture*)	The texture cache entry the sprite's
+							image is shared through, or NULL if the
+							sprite wasn't loaded from a file. When
+							set, tex mirrors image->tex.
 							
 	A few notes about how palettes work:
 	
@@ -160,6 +515,7 @@ typedef struct
 {
 	GLuint width, height;
 	GLuint tex, att, fbo;
+	GLuint readFBO;
 	GLuint format;
 	
 	GLuint imageWidth, imageHeight;
@@ -174,8 +530,321 @@ typedef struct
 	RS_Palette * paletteA;
 	RS_Palette * paletteB;
 	GLint swapHeight;	
+	RS_PaletteBands * paletteBands;
+	GLuint lineOffsets;
+	GLuint numLineOffsets;
+	GLuint lods[RS_MAX_LOD_LEVELS];
+	GLuint numLODs;
+	RS_Hull * hull;
+	uint64_t * mask;
+	GLuint maskStride;
+	
+	RS_CachedTexture * image;
 } RS_Sprite;
 
+
+/*
+	A snapshot of how much texture memory RenderSprite is
+	holding on the GPU. Byte counts are estimates derived
+	from sprite dimensions and formats.
+	
+	Members:
+	textureBytes (size_t)		Bytes held by sprite images.
+	attachmentBytes (size_t)	Bytes held by framebuffer color
+								attachments.
+	deferredAttachmentBytes (size_t)	Bytes the color attachments
+								of existing sprites would occupy, had
+								they been allocated up front. This
+								is the VRAM saved by creating them
+								only when needed.
+	residentBytes (size_t)		Everything currently on the GPU,
+								baked palette variants included; the
+								figure held against the budget.
+	budget (size_t)				The texture budget, or 0 if unlimited.
+	evictions (unsigned int)	How many sprite images have been
+								evicted to stay within the budget.
+	reloads (unsigned int)		How many evicted images have been
+								reloaded from file upon being drawn.
+	cacheHits (unsigned int)	How many PNG loads were served from
+								the texture cache.
+	cacheMisses (unsigned int)	How many PNG loads had to decode and
+								upload the image.
+	cacheSavedBytes (size_t)	The texture memory that sharing cached
+								images currently saves.
+	bakeHits (unsigned int)		How many draws used an image with its
+								palette already baked in.
+	bakeMisses (unsigned int)	How many draws of single-palette sprites
+								had no baked image to use.
+	bakedBytes (size_t)			The texture memory held by baked images.
+	maskBytes (size_t)			The system memory held by alpha masks.
+	quadPixels (double)			How many pixels every draw so far would
+								have shaded with whole quads.
+	shadedPixels (double)		How many they did shade, with hulls.
+	blits (unsigned int)		How many copies were done with
+								framebuffer blits.
+	storeBytes (size_t[])		The texture memory held by cached images,
+								by the RS_STORE_ format they're kept in.
+*/
+typedef struct
+{
+	size_t textureBytes;
+	size_t attachmentBytes;
+	size_t deferredAttachmentBytes;
+	size_t residentBytes;
+	size_t budget;
+	unsigned int evictions;
+	unsigned int reloads;
+	unsigned int cacheHits;
+	unsigned int cacheMisses;
+	size_t cacheSavedBytes;
+	unsigned int bakeHits;
+	unsigned int bakeMisses;
+	size_t bakedBytes;
+	size_t maskBytes;
+	double quadPixels;
+	double shadedPixels;
+	unsigned int blits;
+	size_t storeBytes[RS_NUM_STORES];
+} RS_MemoryStats;
+
+/*
+	A hierarchy of sprites, each placed relative to its parent, for
+	rigs made of many parts. Nodes are kept in flat arrays in which
+	every node comes after its parent and every subtree is a single
+	run, so world transforms are brought up to date in one pass over
+	just the runs that changed. Like RS_Sprite, its members are
+	private; use the RS_*Scene* functions.
+	
+	A node's transform places its center in its parent's space: its
+	parent's center is the origin, X and Y are scaled by the parent's
+	scale and turned by its rotation. Rotations add and scales
+	multiply going down the tree, so a non-uniformly scaled parent
+	doesn't shear its rotated children.
+	
+	Members:
+	num (unsigned int)		How many nodes there are.
+	capacity (unsigned int)	How many nodes there's room for.
+	sprites (RS_Sprite**)	The sprite of each node, or NULL for nodes
+							that only group others.
+	parents (int*)			The index of each node's parent, always
+							less than its own, or -1 for roots.
+	sizes (unsigned int*)	How many nodes each subtree holds,
+							counting its root.
+	handles (unsigned int*)	The handle of the node at each index.
+	indices (unsigned int*)	The index of the node with each handle.
+	local (GLfloat*)		Five terms per node: X, Y, rotation,
+							X scale and Y scale, relative to its parent.
+	world (GLfloat*)		The same five terms, relative to the
+							render target.
+	dirty (unsigned char*)	Whether each node's local transform
+							changed since the last update.
+	anyDirty (int)			Whether any node is dirty at all.
+	freeHandles (unsigned int*)	Handles of removed nodes, for reuse.
+	numFreeHandles (unsigned int)	How many there are.
+	numHandles (unsigned int)	How many handles have ever been given out.
+*/
+typedef struct
+{
+	unsigned int num, capacity;
+	RS_Sprite ** sprites;
+	int * parents;
+	unsigned int * sizes;
+	unsigned int * handles;
+	unsigned int * indices;
+	GLfloat * local;
+	GLfloat * world;
+	unsigned char * dirty;
+	int anyDirty;
+	unsigned int * freeHandles;
+	unsigned int numFreeHandles;
+	unsigned int numHandles;
+} RS_Scene;
+
+/*
+	One sprite on a static layer chunk's list. The order it was
+	added to the layer in keeps each list in drawing order.
+	
+	Members:
+	sprite (RS_Sprite*)		The sprite.
+	order (unsigned int)	When it was added to the layer.
+*/
+typedef struct
+{
+	RS_Sprite * sprite;
+	unsigned int order;
+} RS_StaticEntry;
+
+/*
+	A static layer: decorations that never change, baked into a
+	grid of chunk sprites covering the world, so that each frame
+	draws a handful of chunks rather than every decoration. Like
+	RS_Scene, its fields are private; use the RS_*StaticLayer*
+	functions.
+	
+	Members:
+	x (GLint)				The world X of the grid's left edge.
+	y (GLint)				The world Y of the grid's top edge.
+	chunkSize (GLuint)		The width and height of every chunk.
+	columns (GLuint)		How many chunks across the grid is.
+	rows (GLuint)			How many chunks down it is.
+	chunks (RS_Sprite**)	The sprite of each chunk, or NULL until
+							it's first baked.
+	counts (unsigned int*)	How many sprites touch each chunk.
+	entries (RS_StaticEntry**)	The sprites touching each chunk,
+							in the order they're drawn.
+	entryCapacities (unsigned int*)	How many entries each chunk's
+							list has room for.
+	dirty (unsigned char*)	Whether each chunk needs baking again.
+	num (unsigned int)		How many sprites are in the layer.
+	capacity (unsigned int)	How many sprites there's room for.
+	sprites (RS_Sprite**)	The sprites, in the order they're drawn.
+	spans (GLint*)			Four terms per sprite: the first column
+							and row it touches, then the last.
+	orders (unsigned int*)	When each sprite was added.
+	nextOrder (unsigned int)	The order the next sprite added gets.
+	shown (GLint[4])		The chunks on screen the last time the
+							layer was drawn, as a span.
+	next (RS_StaticLayer*)	The next layer in the library's list.
+*/
+typedef struct RS_StaticLayer
+{
+	GLint x, y;
+	GLuint chunkSize;
+	GLuint columns, rows;
+	RS_Sprite ** chunks;
+	unsigned int * counts;
+	RS_StaticEntry ** entries;
+	unsigned int * entryCapacities;
+	unsigned char * dirty;
+	unsigned int num, capacity;
+	RS_Sprite ** sprites;
+	GLint * spans;
+	unsigned int * orders;
+	unsigned int nextOrder;
+	GLint shown[4];
+	struct RS_StaticLayer * next;
+} RS_StaticLayer;
+
+/*
+	The part of a sprite's state that changes from frame to frame,
+	as staged and published through an RS_StateBuffer. Tints,
+	palettes and band tables are shared by pointer, not copied, so
+	to change one mid-flight, point the sprite at a different one.
+	
+	Members:
+	posX, posY (GLint)		The sprite's position.
+	rotation (GLfloat)		Its rotation, in radians.
+	scaleX, scaleY (GLfloat)	Its scale factors.
+	frameOffsetX, frameOffsetY (GLuint)	Where its current frame sits
+							in its image.
+	tint (RS_Color*)		Its tint, or NULL.
+	paletteA, paletteB (RS_Palette*)	Its palettes, or NULL.
+	swapHeight (GLint)		Where paletteB takes over from paletteA.
+	paletteBands (RS_PaletteBands*)	Its band table, or NULL.
+*/
+typedef struct
+{
+	GLint posX, posY;
+	GLfloat rotation;
+	GLfloat scaleX, scaleY;
+	GLuint frameOffsetX, frameOffsetY;
+	RS_Color * tint;
+	RS_Palette * paletteA;
+	RS_Palette * paletteB;
+	GLint swapHeight;
+	RS_PaletteBands * paletteBands;
+} RS_SpriteState;
+
+/*
+	Lets one thread simulate the next frame while another draws the
+	last. The simulating thread edits a private back copy of a fixed
+	set of sprites' states and publishes it all at once; the drawing
+	thread picks up the newest published copy and applies it to the
+	sprites themselves, which only it touches. There are three
+	published copies, one being drawn, one waiting and one being
+	filled, so neither thread ever waits on the other, and handing
+	one over is a single atomic swap. Only states that changed since
+	a copy was last filled are copied into it. Like RS_Sprite, its
+	members are private.
+	
+	Members:
+	num (unsigned int)		How many sprites there are.
+	sprites (RS_Sprite**)	The sprites, in the order they're indexed by.
+	back (RS_SpriteState*)	The simulating thread's copy.
+	backGens (unsigned int*)	The publish each back state was last
+							edited for.
+	copies (RS_SpriteState*[3])	The published copies.
+	copyGens (unsigned int*[3])	The publish each state in each copy
+							was last edited for.
+	copyGen (unsigned int[3])	The publish each copy is current as of.
+	generation (unsigned int)	How many publishes there have been.
+	spare (int)				The copy the simulating thread fills next.
+	ready (int)				The newest copy, ORed with
+							RS_STATES_FRESH until it's taken. Only
+							touched atomically.
+	front (int)				The copy the drawing thread holds.
+	appliedGen (unsigned int)	The publish the sprites are current as of.
+*/
+typedef struct
+{
+	unsigned int num;
+	RS_Sprite ** sprites;
+	RS_SpriteState * back;
+	unsigned int * backGens;
+	RS_SpriteState * copies[3];
+	unsigned int * copyGens[3];
+	unsigned int copyGen[3];
+	unsigned int generation;
+	int spare;
+	int ready;
+	int front;
+	unsigned int appliedGen;
+} RS_StateBuffer;
+
+/*
+	A pair of colliding sprites, as found by RS_findCollisions().
+	
+	Members:
+	a (unsigned int)	The index of one sprite.
+	b (unsigned int)	The index of the other, always greater than a.
+*/
+typedef struct
+{
+	unsigned int a, b;
+} RS_CollisionPair;
+
+/*
+	Writes sprites' contents to disk without holding up rendering,
+	as made by RS_mkExporter(). Its members are private.
+*/
+typedef struct RS_Exporter RS_Exporter;
+
+/*
+	One preview for RS_renderBatch() to draw: a sprite, drawn with a
+	palette at a transform onto a transparent image of its own size,
+	and read back.
+	
+	Members:
+	sprite (RS_Sprite*)		The sprite to draw. Its own transform and
+							palettes are put back afterwards.
+	palette (RS_Palette*)	The palette to draw it with, or NULL.
+	posX, posY (GLint)		Where to draw it in the output.
+	rotation (GLfloat)		Its rotation, in radians.
+	scaleX, scaleY (GLfloat)	Its scale factors.
+	width, height (GLuint)	The output's dimensions.
+	output (unsigned char*)	Receives width*height RGBA8 pixels, top
+							row first.
+*/
+typedef struct
+{
+	RS_Sprite * sprite;
+	RS_Palette * palette;
+	GLint posX, posY;
+	GLfloat rotation;
+	GLfloat scaleX, scaleY;
+	GLuint width, height;
+	unsigned char * output;
+} RS_BatchJob;
 	
 /*
 	Initializes static variables in the RenderSprite
@@ -192,9 +861,42 @@ void RS_init(void);
 */
 void RS_deInit(void);
 
+#ifdef RS_HEADLESS
+/*
+	Initializes the library without a window, for rendering on
+	machines with no display or GPU. An OSMesa context is created
+	and made current, drawing into an offscreen buffer that stands in
+	for the screen, and then RS_init() is run against it. GLEW must
+	be built with GLEW_OSMESA for this. RS_deInit() destroys the
+	context again.
+	
+	Parameters:
+		width (GLuint): The width of the offscreen screen.
+		height (GLuint): Its height.
+	
+	Returns:
+		1 if the context was created, 0 if not.
+*/
+int RS_initHeadless(GLuint width, GLuint height);
+
+/*
+	Returns the pixels of the offscreen screen made by
+	RS_initHeadless(), as RGBA8, bottom row first. Everything drawn
+	so far is finished first.
+	
+	Returns:
+		The offscreen screen's pixels, or NULL without one.
+*/
+unsigned char * RS_getHeadlessPixels(void);
+#endif
+
 /*
 	Creates an empty RS_Sprite; that is, one without an image
-	to begin with.
+	to begin with. Neither its image nor its framebuffer take up
+	texture memory until something is rendered into it. Rendering
+	into it at less than a full mix mixes against transparent
+	black, where earlier versions mixed against an unset 2x2
+	image.
 	
 	Parameters:
 		width (GLuint): The width of this new sprite.
@@ -210,7 +912,9 @@ RS_Sprite * RS_mkEmptySprite(GLuint width, GLuint height, GLuint format);
 
 /*
 	Creates an RS_Sprite, initialized with the PNG loaded from
-	the filename given.
+	the filename given. If a sprite has already been made from
+	the same file with the same contents, the new sprite shares
+	its texture rather than decoding and uploading it again.
 	
 	Parameters:
 		filename (char*): The filename (and path).
@@ -233,9 +937,160 @@ RS_Sprite * RS_mkSpriteFromPNG(char * filename);
 */
 RS_Sprite * RS_mkAnimatedSpriteFromPNG(char * filename, GLuint frameWidth, GLuint frameHeight);
 
+/*
+	Creates an RS_Sprite from a PNG containing multiple frames of
+	animation, trimming the transparent border off every frame and
+	packing what's left together. Each frame still sits at the same
+	spot within the sprite, but only its visible rectangle is stored
+	and drawn, which saves texture memory and fill on sheets with a
+	lot of padding. Picking and collisions work as usual. Trimmed
+	sprites don't get LOD chains.
+	
+	Parameters:
+		filename (char*): The filename (and path).
+		frameWidth (GLuint): The width of a single frame of animation.
+		frameHeight (GLuint): The height of a single frame of animation.
+		
+	Returns:
+		A reference to the new RS_Sprite.
+*/
+RS_Sprite * RS_mkTrimmedSpriteFromPNG(char * filename, GLuint frameWidth, GLuint frameHeight);
+
+/*
+	Creates an RS_Sprite from a PNG, keeping its image on the GPU
+	in the given storage format rather than as decoded. Mostly
+	opaque backgrounds can go to RS_STORE_RGB5_A1 or a compressed
+	format, and shadows and other masks to RS_STORE_ALPHA8, which
+	draws black with the image's alpha. Formats the driver doesn't
+	support fall back to RS_STORE_NATIVE. Images are shared only
+	between sprites that asked for the same storage.
+	
+	Palettes match colors exactly, so they only work on images kept
+	as decoded, in RS_STORE_RGBA8 or in RS_STORE_RGB8. The 16-bit
+	stores round colors off, RS_STORE_ALPHA8 drops them, and the
+	compressed ones approximate them, so keys mostly stop matching;
+	giving such a sprite a palette warns under RS_DB_ERRORS.
+	
+	Parameters:
+		filename (char*): The filename (and path).
+		frameWidth (GLuint): The width of a single frame of animation,
+							or 0 for the whole image.
+		frameHeight (GLuint): The height of a single frame of animation,
+							or 0 for the whole image.
+		store (GLuint): One of the RS_STORE_ formats.
+		
+	Returns:
+		A reference to the new RS_Sprite.
+*/
+RS_Sprite * RS_mkStoredSpriteFromPNG(char * filename, GLuint frameWidth, GLuint frameHeight, GLuint store);
+
+/*
+	Creates an RS_Sprite from a PNG that's already in memory.
+	The image is decoded but not cached, so sprites made this
+	way don't share textures and are never evicted. They get an
+	alpha mask of their own, so picking, collisions and hulls work
+	as they do for sprites loaded from files.
+	
+	Parameters:
+		buffer (unsigned char*): The PNG file's contents.
+		size (size_t): The size of the buffer in bytes.
+	
+	Returns:
+		A reference to the new RS_Sprite, or NULL if the PNG
+		couldn't be decoded.
+*/
+RS_Sprite * RS_mkSpriteFromPNGBuffer(unsigned char * buffer, size_t size);
+
+/*
+	Creates an animated RS_Sprite from a PNG that's already in
+	memory. See RS_mkAnimatedSpriteFromPNG().
+	
+	Parameters:
+		buffer (unsigned char*): The PNG file's contents.
+		size (size_t): The size of the buffer in bytes.
+		frameWidth (GLuint): The width of a single frame of animation.
+		frameHeight (GLuint): The height of a single frame of animation.
+	
+	Returns:
+		A reference to the new RS_Sprite, or NULL if the PNG
+		couldn't be decoded.
+*/
+RS_Sprite * RS_mkAnimatedSpriteFromPNGBuffer(unsigned char * buffer, size_t size, GLuint frameWidth, GLuint frameHeight);
+
+/*
+	PNG files are read into a buffer that each thread keeps and
+	reuses from one load to the next. This frees the calling
+	thread's buffer, for when it's done loading for a while.
+*/
+void RS_releaseLoadBuffer(void);
+
+/*
+	Opens a sprite pack built by the rspack tool, mapping it
+	into memory.
+	
+	Parameters:
+		filename (char*): The filename (and path) of the pack.
+	
+	Returns:
+		A reference to the opened pack, or NULL if it couldn't
+		be opened or wasn't built for this machine.
+*/
+RS_Pack * RS_openPack(char * filename);
+
+/*
+	Creates an RS_Sprite from an image in a sprite pack. The image
+	is uploaded directly from the pack, and animated images come
+	with their frame size already set up. Sprites made from the
+	same image share its texture.
+	
+	NOTE: Evicted images are reloaded from the pack, so it should
+	stay open for as long as any sprite made from it exists. See
+	RS_closePack().
+	
+	Parameters:
+		pack (RS_Pack*): The pack to load from.
+		name (char*): The name of the image.
+	
+	Returns:
+		A reference to the new RS_Sprite, or NULL if the pack has
+		no image by that name.
+*/
+RS_Sprite * RS_mkSpriteFromPack(RS_Pack * pack, char * name);
+
+/*
+	Returns the distinct colors of an image in a sprite pack, as
+	an array of RGBA quads of 8-bit terms. These make ready-made
+	keys for an RS_Palette. The array lives in the pack.
+	
+	Parameters:
+		pack (RS_Pack*): The pack to access.
+		name (char*): The name of the image.
+		num (unsigned int*): Receives the number of colors.
+	
+	Returns:
+		The colors, or NULL if the image has too many colors to
+		have a palette, or doesn't exist.
+*/
+unsigned char * RS_getPackPalette(RS_Pack * pack, char * name, unsigned int * num);
+
+/*
+	Closes a sprite pack, unmapping it.
+	
+	NOTE: Sprites made from the pack are reloaded from it, so it
+	should be closed only after they've all been deleted. If any
+	are left, the mapping is kept until the last of them goes,
+	and with RS_DB_ERRORS defined a warning is printed. The pack
+	can't be used to make sprites after this either way.
+	
+	Parameters:
+		pack (RS_Pack*): The pack to close.
+*/
+void RS_closePack(RS_Pack * pack);
+
 /*
 	Deletes all of a given sprite's memory allocations
-	and clears out its presence from the GPU.
+	and clears out its presence from the GPU. A shared image
+	is only deleted along with the last sprite using it.
 	
 	Parameters:
 		sprite (RS_Sprite*): The sprite to delete.
@@ -288,7 +1143,16 @@ RS_Color * RS_mkColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a);
 void RS_deleteColor(RS_Color * color);
 
 /*
-	Creates an RS_Palette.
+	Creates an RS_Palette from arrays of RS_Colors, with room for
+	RS_MAX_PALETTE_ENTRIES pairs. Deprecated in favor of
+	RS_mkPackedPalette() and RS_setPaletteColors().
+	
+	As before, the palette takes over the RS_Colors, which
+	RS_scrubPalette() frees, and keeps the arrays in its keys and
+	entries members. The arrays themselves stay the caller's. The
+	colors are also copied into the palette's packed terms, which
+	are what's drawn with, so changes made through the RS_Colors
+	take effect at the next RS_invalidatePalette().
 	
 	Parameters:
 		keys (RS_Color**): An array of RS_Color pointers used
@@ -303,9 +1167,48 @@ void RS_deleteColor(RS_Color * color);
 RS_Palette * RS_mkPalette(RS_Color ** keys, RS_Color ** entries, unsigned int numPairs);
 
 /*
-	Deletes all references of RS_Color held in the
-	given RS_Palette. Note that all references to
-	these RS_Colors will become null.
+	Creates an empty RS_Palette with room for a fixed number of
+	pairs, to be filled with RS_setPaletteColors() and friends.
+	
+	Parameters:
+		capacity (unsigned int): How many pairs it can hold, up
+								to RS_MAX_PALETTE_ENTRIES.
+	
+	Returns:
+		The new palette.
+*/
+RS_Palette * RS_mkPackedPalette(unsigned int capacity);
+
+/*
+	Replaces all of a palette's pairs at once from arrays of
+	float color terms, four per color. Pairs past the palette's
+	capacity are dropped.
+	
+	Parameters:
+		palette (RS_Palette*): The palette to operate on.
+		keys (const GLfloat*): The key colors.
+		entries (const GLfloat*): The entry colors.
+		num (unsigned int): How many pairs there are.
+*/
+void RS_setPaletteColors(RS_Palette * palette, const GLfloat * keys, const GLfloat * entries, unsigned int num);
+
+/*
+	Does the same as RS_setPaletteColors(), from 8-bit RGBA colors
+	like those RS_getPackPalette() returns.
+	
+	Parameters:
+		palette (RS_Palette*): The palette to operate on.
+		keys (const unsigned char*): The key colors.
+		entries (const unsigned char*): The entry colors.
+		num (unsigned int): How many pairs there are.
+*/
+void RS_setPaletteColorsRGBA8(RS_Palette * palette, const unsigned char * keys,
+								const unsigned char * entries, unsigned int num);
+
+/*
+	Empties a palette of its color pairs, and deletes the RS_Colors
+	it was made from with RS_mkPalette(), if any. For other palettes
+	this is the same as RS_clearColorReplacements().
 	
 	Parameters:
 		palette (RS_Palette*): The RS_Palette to operate on.
@@ -322,6 +1225,18 @@ void RS_scrubPalette(RS_Palette * palette);
 */
 void RS_deletePalette(RS_Palette * palette);
 
+/*
+	Tells RenderSprite that the colors of the given palette were
+	changed directly in its keyTerms or entryTerms, or through the
+	RS_Colors it was made from, rather than through the functions
+	here. Those RS_Colors are copied in again.
+	Images with the palette's old colors baked in are dropped.
+	
+	Parameters:
+		palette (RS_Palette*): The palette that changed.
+*/
+void RS_invalidatePalette(RS_Palette * palette);
+
 /*
 	Sets the rotation transform on the given
 	RS_Sprite.
@@ -410,32 +1325,191 @@ void RS_setPaletteA(RS_Sprite * sprite, RS_Palette * palette);
 void RS_setPaletteB(RS_Sprite * sprite, RS_Palette * palette);
 
 /*
-	Clears positioning, scaling, rotation, and tint
-	transformations on the given sprite.
+	Shifts lines of a sprite's frame sideways and up or down when
+	it's drawn, for wavy water, heat haze and line scrolling in a
+	single draw. Each line's texels are sampled from that far along
+	the frame, wrapping around its edges. Only the given lines are
+	uploaded, so animating a few lines a frame is cheap.
+	
+	The first call creates the table, with a line for every line
+	of the frame and every offset zero. Offsets are kept to 1/16th
+	of a texel, up to RS_MAX_LINE_OFFSET either way. Picking and
+	collisions don't see them.
 	
 	Parameters:
 		sprite (RS_Sprite*): The sprite to operate on.
+		first (GLuint): The first line to set.
+		count (GLuint): How many lines to set.
+		offsets (const GLfloat*): An X and a Y offset for each line,
+								in texels.
 */
-void RS_clearTransforms(RS_Sprite * sprite);
+void RS_setLineOffsets(RS_Sprite * sprite, GLuint first, GLuint count, const GLfloat * offsets);
 
 /*
-	Adds a color replacement pair to a given palette.
+	Builds reduced copies of a sprite's image, each half the size of
+	the last, for drawing it zoomed out. Draws then pick the smallest
+	level that is still at least as big as the sprite appears, going
+	by the smaller of its scale factors. Each frame of an animation is
+	reduced on its own, so frames never bleed into one another. Each
+	reduced texel takes the most common color of those it covers, so
+	pixel art stays crisp and palettes still apply.
+	
+	The levels are taken from the image as it is now. Sprites with
+	line offsets, or band tables counted in sprite space, are always
+	drawn at full size.
+	
+	Sprites loaded from the same file share one chain, kept with
+	their image, so building levels for one builds them for all. The
+	chain counts against the texture budget with the image.
 	
 	Parameters:
-		palette (RS_Palette*): The palette to operate on.
-		oldColor (RS_Color*): A color to be replaced.
-		oldColor (RS_Color*): A color to replace with.
+		sprite (RS_Sprite*): The sprite to operate on.
+		levels (GLuint): How many levels to build, up to
+						RS_MAX_LOD_LEVELS. 0 removes them.
 */
-void RS_pushColorReplacement(RS_Palette* palette, RS_Color * oldColor, RS_Color * newColor);
+void RS_buildLODs(RS_Sprite * sprite, GLuint levels);
 
 /*
-	Removes the most recent color replacement pair
-	given to an RS_Palette.
+	Removes a sprite's reduced levels and frees their textures. For
+	a sprite loaded from a file, that's the chain it shares with
+	every other sprite using the same image.
 	
 	Parameters:
-		palette (RS_Palette*): The palette to operate on.
+		sprite (RS_Sprite*): The sprite to operate on.
 */
-void RS_popColorReplacement(RS_Palette* palette);
+void RS_clearLODs(RS_Sprite * sprite);
+
+/*
+	Builds a hull mesh for each frame of a sprite from its alpha
+	mask, and draws the sprite with those instead of whole quads.
+	Each hull is the convex hull of the frame's visible texels,
+	loosened as little as possible to fit in RS_MAX_HULL_VERTICES,
+	so it never cuts anything off. Large irregular sprites, like
+	trees and explosions, then skip shading most of their empty
+	corners. Frames whose hulls would cover nearly all of them
+	keep their quads.
+	
+	Hulls aren't used for draws at reduced levels, or while the
+	sprite has line offsets. Sprites not loaded from an image have
+	no mask, and are left alone.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to operate on.
+*/
+void RS_buildHull(RS_Sprite * sprite);
+
+/*
+	Removes a sprite's hull meshes, going back to whole quads.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to operate on.
+*/
+void RS_clearHull(RS_Sprite * sprite);
+
+/*
+	Removes a sprite's line offsets and frees their texture.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to operate on.
+*/
+void RS_clearLineOffsets(RS_Sprite * sprite);
+
+/*
+	Creates a palette band table. Every line starts out without
+	a palette.
+	
+	Parameters:
+		lines (GLuint): How many lines the table covers.
+		space (GLuint): RS_BANDS_TARGET to count lines down the render
+						target the sprite is drawn to, or RS_BANDS_SPRITE
+						to count them down the sprite's own frame.
+	
+	Returns:
+		A new RS_PaletteBands.
+*/
+RS_PaletteBands * RS_mkPaletteBands(GLuint lines, GLuint space);
+
+/*
+	Places a palette in one of a band table's slots. The palette is
+	only referenced, and changes to it are picked up at the next draw.
+	
+	Parameters:
+		bands (RS_PaletteBands*): The band table to operate on.
+		index (GLuint): The slot, below RS_MAX_BAND_PALETTES.
+		palette (RS_Palette*): The palette, or NULL to empty the slot.
+*/
+void RS_setBandPalette(RS_PaletteBands * bands, GLuint index, RS_Palette * palette);
+
+/*
+	Sets which palette a run of lines uses.
+	
+	Parameters:
+		bands (RS_PaletteBands*): The band table to operate on.
+		top (GLuint): The first line of the run.
+		bottom (GLuint): The line after the last of the run.
+		index (GLint): The palette slot to use, or RS_NO_BAND_PALETTE.
+*/
+void RS_setPaletteBand(RS_PaletteBands * bands, GLuint top, GLuint bottom, GLint index);
+
+/*
+	Gives a sprite a band table, which is used in place of its
+	paletteA and paletteB. NULL goes back to using those.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to operate on.
+		bands (RS_PaletteBands*): The band table.
+*/
+void RS_setPaletteBands(RS_Sprite * sprite, RS_PaletteBands * bands);
+
+/*
+	Deletes a band table and its textures. The palettes it refers
+	to are left alone.
+	
+	Parameters:
+		bands (RS_PaletteBands*): The band table to delete.
+*/
+void RS_deletePaletteBands(RS_PaletteBands * bands);
+
+/*
+	Clears positioning, scaling, rotation, and tint
+	transformations on the given sprite.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to operate on.
+*/
+void RS_clearTransforms(RS_Sprite * sprite);
+
+/*
+	Adds a color replacement pair to a given palette. The colors
+	are copied in. Does nothing if the palette is full.
+	
+	Parameters:
+		palette (RS_Palette*): The palette to operate on.
+		oldColor (RS_Color*): A color to be replaced.
+		newColor (RS_Color*): A color to replace with.
+*/
+void RS_pushColorReplacement(RS_Palette* palette, RS_Color * oldColor, RS_Color * newColor);
+
+/*
+	Changes one existing color replacement pair of a palette,
+	say for palette cycling.
+	
+	Parameters:
+		palette (RS_Palette*): The palette to operate on.
+		index (unsigned int): Which pair to change.
+		oldColor (RS_Color*): A color to be replaced.
+		newColor (RS_Color*): A color to replace with.
+*/
+void RS_setColorReplacement(RS_Palette * palette, unsigned int index, RS_Color * oldColor, RS_Color * newColor);
+
+/*
+	Removes the most recent color replacement pair
+	given to an RS_Palette.
+	
+	Parameters:
+		palette (RS_Palette*): The palette to operate on.
+*/
+void RS_popColorReplacement(RS_Palette* palette);
 
 /*
 	Provides alternate functionality to 
@@ -476,6 +1550,51 @@ void RS_iterFrame(RS_Sprite * sprite);
 */
 void RS_renderSpriteToSprite(RS_Sprite * canvas, RS_Sprite * medium, GLfloat blend);
 
+/*
+	Renders one sprite onto another using the GPU's blender in
+	place of the shader. The medium is drawn straight into the
+	canvas's color attachment, so the canvas image is never
+	sampled and successive draws build on one another.
+	Specifics:
+	RS_BLEND_MIX mixes the medium into what's already in the
+	attachment, just as RS_renderSpriteToSprite() mixes it into
+	the canvas image. RS_BLEND_OVER lays a straight-alpha medium
+	over the attachment, and RS_BLEND_PREMULTIPLIED lays a
+	premultiplied one (such as another canvas) over it. Both
+	leave the attachment premultiplied, and both treat mix as the
+	medium's opacity.
+	The caller's blend state is restored afterward.
+	
+	Parameters:
+		canvas (RS_Sprite*): The sprite to draw onto.
+		medium (RS_Sprite*): The sprite to draw onto the other.
+		mix (GLfloat): How much of the medium sprite image to use.
+						Clamped to the range of [0.0 ... 1.0].
+		mode (GLuint): RS_BLEND_MIX, RS_BLEND_OVER or
+						RS_BLEND_PREMULTIPLIED.
+*/
+void RS_blendSpriteToSprite(RS_Sprite * canvas, RS_Sprite * medium, GLfloat mix, GLuint mode);
+
+/*
+	Copies one sprite onto another, as RS_renderSpriteToSprite() at
+	a full mix would, with a framebuffer blit of the medium's
+	current frame where it can. That takes no rotation, no tint,
+	palette, band table, line offsets or hull, a whole number scale,
+	and a color image readable through a framebuffer. Blending has
+	to be off, or the image opaque with a blend state that lets it
+	replace what's there, and trimmed frames need blending on for
+	their padding to be left alone. Anything else is drawn with the
+	shader.
+	
+	Parameters:
+		canvas (RS_Sprite*): The sprite to copy onto.
+		medium (RS_Sprite*): The sprite to copy.
+	
+	Returns:
+		1 if the copy was a blit, 0 if it was shaded.
+*/
+int RS_copySpriteToSprite(RS_Sprite * canvas, RS_Sprite * medium);
+
 /*
 	Renders the given sprite to the window, or
 	the current framebuffer being used.
@@ -485,6 +1604,46 @@ void RS_renderSpriteToSprite(RS_Sprite * canvas, RS_Sprite * medium, GLfloat ble
 */
 void RS_renderSpriteToScreen(RS_Sprite * sprite);
 
+/*
+	Draws a sprite to the screen, or the virtual screen, just as
+	RS_renderSpriteToScreen() does, but as a framebuffer blit where
+	it's a plain copy. The conditions are those of
+	RS_copySpriteToSprite(), with the scale counting the viewport's
+	stretch as well. Meant for large opaque backgrounds, where
+	skipping the shader pays for checking.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to draw to the screen.
+	
+	Returns:
+		1 if the copy was a blit, 0 if it was shaded.
+*/
+int RS_copySprite(RS_Sprite * sprite);
+
+/*
+	Sets a virtual resolution for the screen. From then on,
+	RS_renderSpriteToScreen() draws into an offscreen target of this
+	size, so every sprite is rasterized at the virtual resolution no
+	matter how large the window is. RS_presentVirtualScreen() then
+	puts the whole thing on the window in one draw.
+	
+	Parameters:
+		width (GLuint): The virtual width, in pixels.
+		height (GLuint): The virtual height, in pixels. Passing 0
+						for either goes back to drawing straight
+						to the window.
+*/
+void RS_setVirtualResolution(GLuint width, GLuint height);
+
+/*
+	Draws the virtual screen onto the window, scaled up by the
+	largest whole number that fits the current viewport and centered
+	between black bars, so every virtual pixel becomes an identical
+	square block. The virtual screen is then cleared, ready for the
+	next frame. Does nothing without a virtual resolution.
+*/
+void RS_presentVirtualScreen(void);
+
 /*
 	Binds OpenGL's current framebuffer to that of the sprite,
 	forcing all subsequent drawing calls to be done into
@@ -504,6 +1663,16 @@ void RS_beginRenderToSprite(RS_Sprite * sprite);
 */
 void RS_endRenderToSprite(RS_Sprite * sprite);
 
+/*
+	Frees the sprite's framebuffer and its color attachment,
+	along with anything rendered into them. They will be
+	created again, empty, the next time they are needed.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to operate on.
+*/
+void RS_releaseFramebuffer(RS_Sprite * sprite);
+
 /*
 	Returns the sprite's OpenGL texture object handle.
 	
@@ -517,6 +1686,8 @@ GLuint RS_getTexture(RS_Sprite * sprite);
 
 /*
 	Returns the sprite's OpenGl framebuffer object handle.
+	The framebuffer is created if the sprite doesn't have
+	one yet.
 	
 	Parameters:
 		sprite (RS_Sprite*): The sprite to access.
@@ -640,6 +1811,58 @@ RS_Color * RS_getTint(RS_Sprite * sprite);
 */
 GLfloat * RS_getTexelData(RS_Sprite * sprite);
 
+/*
+	Creates an exporter, which writes sprites' contents to disk in
+	three stages. RS_exportSprite() starts an asynchronous readback
+	of a sprite into a pixel buffer, converted to RGBA8 along the way.
+	One call later, when the GPU has had time to finish, the pixels
+	are mapped and handed to a pool of worker threads, which encode
+	and write them. Only so many frames can be in flight at once;
+	past that, RS_exportSprite() waits for the oldest to be written.
+	
+	Parameters:
+		mode (int): RS_EXPORT_PNG or RS_EXPORT_RAW.
+		path (char*): For PNGs, a printf() pattern that the frame's
+					number is put into, as in "capture/%05u.png". For
+					raw streams, the file to write to.
+		depth (unsigned int): How many frames can be in flight at
+					once. At least 2 are used.
+		workers (unsigned int): How many threads encode frames. Raw
+					streams are always written by just one, so frames
+					stay in order.
+	
+	Returns:
+		A new RS_Exporter, or NULL if the stream couldn't be opened
+		or no worker thread could be started. Fewer workers than
+		asked for may start.
+*/
+RS_Exporter * RS_mkExporter(int mode, char * path, unsigned int depth, unsigned int workers);
+
+/*
+	Queues a sprite's current contents to be written as the next
+	frame. Only waits if the exporter is full.
+	
+	Parameters:
+		exporter (RS_Exporter*): The exporter to use.
+		sprite (RS_Sprite*): The sprite to export.
+	
+	Returns:
+		The frame's number.
+*/
+unsigned int RS_exportSprite(RS_Exporter * exporter, RS_Sprite * sprite);
+
+/*
+	Waits for every queued frame to be written, then deletes the
+	exporter.
+	
+	Parameters:
+		exporter (RS_Exporter*): The exporter to close.
+	
+	Returns:
+		How many frames couldn't be written.
+*/
+unsigned int RS_closeExporter(RS_Exporter * exporter);
+
 /*
 	Operates the same as getTexelData(RS_Sprite*), but allows
 	the querying of a specific rectangle of the sprite image.
@@ -738,4 +1961,425 @@ GLfloat RS_getBlueAt(RS_Sprite * sprite, GLuint x, GLuint y);
 */
 GLfloat RS_getAlphaAt(RS_Sprite * sprite, GLuint x, GLuint y);
 
+/*
+	Works out where a batch of sprites land on their render target,
+	without drawing them. The math is the vertex shader's: positions
+	are the top left corner of the unrotated sprite in pixels, with Y
+	running down, and sprites are scaled and then rotated around their
+	centers. Results agree with the GPU to within float precision.
+	
+	Sprites are done four at a time with SSE where the compiler
+	targets it, and unrotated ones skip the trig. Batches of at
+	least 65536 sprites are split across up to eight threads, one
+	per core.
+	
+	Every array is indexed by sprite, so the i'th sprite's position
+	is positions[i*2] and positions[i*2+1].
+	
+	Parameters:
+		num (unsigned int): How many sprites there are.
+		positions (const GLfloat*): X and Y of each sprite.
+		scales (const GLfloat*): X and Y scale of each sprite.
+		rotations (const GLfloat*): The rotation of each sprite, in radians.
+		frameSizes (const GLfloat*): The frame width and height of each sprite.
+		quads (GLfloat*): Receives eight floats per sprite: the X and Y
+						of its top left, top right, bottom left and
+						bottom right corners.
+*/
+void RS_computeSpriteQuads(unsigned int num, const GLfloat * positions, const GLfloat * scales,
+							const GLfloat * rotations, const GLfloat * frameSizes, GLfloat * quads);
+
+/*
+	Takes the same input as RS_computeSpriteQuads(), but only works
+	out the axis-aligned box around each sprite. This is the one to
+	use for culling and broad phase tests.
+	
+	Parameters:
+		See RS_computeSpriteQuads().
+		bounds (GLfloat*): Receives four floats per sprite: the
+						minimum X and Y, then the maximum X and Y.
+*/
+void RS_computeSpriteBounds(unsigned int num, const GLfloat * positions, const GLfloat * scales,
+							const GLfloat * rotations, const GLfloat * frameSizes, GLfloat * bounds);
+
+/*
+	Works out the axis-aligned box around a single sprite as it
+	would be drawn right now.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to access.
+		bounds (GLfloat*): Receives the minimum X and Y, then the
+						maximum X and Y.
+*/
+void RS_getSpriteBounds(RS_Sprite * sprite, GLfloat * bounds);
+
+/*
+	Tests whether a point lands on an opaque texel of a sprite,
+	as it would be drawn right now. The point is taken back through
+	the sprite's position, scale and rotation and looked up in the
+	alpha mask built when its image was loaded, so nothing is read
+	back from the GPU. Sprites not loaded from an image have no
+	mask, and count as opaque across their whole frame.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to test.
+		x (GLfloat): The X coordinate of the point, in pixels.
+		y (GLfloat): The Y coordinate of the point, in pixels.
+	
+	Returns:
+		1 if the point is over an opaque texel, 0 otherwise.
+*/
+int RS_pickSprite(RS_Sprite * sprite, GLfloat x, GLfloat y);
+
+/*
+	Finds the topmost sprite under a point, assuming the sprites
+	are drawn in the order given, so that later ones cover
+	earlier ones.
+	
+	Parameters:
+		sprites (RS_Sprite**): The sprites to test.
+		num (unsigned int): How many sprites there are.
+		x (GLfloat): The X coordinate of the point, in pixels.
+		y (GLfloat): The Y coordinate of the point, in pixels.
+	
+	Returns:
+		The index of the topmost sprite with an opaque texel
+		under the point, or -1 if there is none.
+*/
+int RS_pickSprites(RS_Sprite ** sprites, unsigned int num, GLfloat x, GLfloat y);
+
+/*
+	Tests whether two sprites overlap on at least one pixel where
+	both are opaque, as they would be drawn right now. Like picking,
+	this works from the alpha masks of the sprites' current frames
+	and reads nothing back from the GPU. A pixel belongs to a sprite
+	if the sprite covers the pixel's center.
+	
+	Sprites that are neither rotated nor scaled are compared a whole
+	row of 64 pixels at a time. Scaled ones are resampled a pixel at
+	a time first, and so are rotated ones, which cost the most.
+	
+	Parameters:
+		a (RS_Sprite*): One sprite.
+		b (RS_Sprite*): The other.
+	
+	Returns:
+		1 if the sprites collide, 0 otherwise.
+*/
+int RS_spritesCollide(RS_Sprite * a, RS_Sprite * b);
+
+/*
+	Finds every colliding pair among an array of sprites. The boxes
+	around the sprites are swept along X to find pairs that might
+	touch, and only those are tested pixel by pixel with
+	RS_spritesCollide().
+	
+	Parameters:
+		sprites (RS_Sprite**): The sprites to test.
+		num (unsigned int): How many sprites there are.
+		pairs (RS_CollisionPair*): Receives the colliding pairs.
+		maxPairs (unsigned int): How many pairs there's room for.
+	
+	Returns:
+		How many pairs collide. If this is more than maxPairs,
+		only the first maxPairs were stored.
+*/
+unsigned int RS_findCollisions(RS_Sprite ** sprites, unsigned int num,
+								RS_CollisionPair * pairs, unsigned int maxPairs);
+
+/*
+	Draws a list of previews, one after another, into a shared
+	offscreen target and reads each back into its output. The target
+	is only remade when a job needs a bigger one than it's seen, and
+	jobs that share a sprite and palette share its baked variant, so
+	runs of similar jobs go quickly.
+	
+	Parameters:
+		jobs (RS_BatchJob*): The jobs to draw.
+		num (unsigned int): How many there are.
+	
+	Returns:
+		How many jobs were finished per second.
+*/
+GLdouble RS_renderBatch(RS_BatchJob * jobs, unsigned int num);
+
+/*
+	Creates an empty scene graph.
+	
+	Returns:
+		A new RS_Scene.
+*/
+RS_Scene * RS_mkScene(void);
+
+/*
+	Deletes a scene graph. Its sprites are left alone.
+	
+	Parameters:
+		scene (RS_Scene*): The scene to delete.
+*/
+void RS_deleteScene(RS_Scene * scene);
+
+/*
+	Adds a node to a scene graph, with an identity transform.
+	
+	Parameters:
+		scene (RS_Scene*): The scene to operate on.
+		sprite (RS_Sprite*): The sprite the node places, or NULL for
+							a node that only groups others.
+		parent (unsigned int): The parent node's handle, or
+							RS_SCENE_ROOT.
+	
+	Returns:
+		The new node's handle, which stays the same until the
+		node is removed.
+*/
+unsigned int RS_addSceneNode(RS_Scene * scene, RS_Sprite * sprite, unsigned int parent);
+
+/*
+	Removes a node and everything attached below it from a scene
+	graph. Their sprites are left alone, where they last were.
+	
+	Parameters:
+		scene (RS_Scene*): The scene to operate on.
+		node (unsigned int): The node's handle.
+*/
+void RS_removeSceneNode(RS_Scene * scene, unsigned int node);
+
+/*
+	Sets a node's transform relative to its parent. Nothing is
+	recomputed until RS_updateScene().
+	
+	Parameters:
+		scene (RS_Scene*): The scene to operate on.
+		node (unsigned int): The node's handle.
+		x (GLfloat): The X position of the node's center.
+		y (GLfloat): The Y position of the node's center.
+		rotation (GLfloat): The rotation, in radians.
+		scaleX (GLfloat): The horizontal scale factor.
+		scaleY (GLfloat): The vertical scale factor.
+*/
+void RS_setNodeTransform(RS_Scene * scene, unsigned int node, GLfloat x, GLfloat y,
+						GLfloat rotation, GLfloat scaleX, GLfloat scaleY);
+
+/*
+	Brings the world transforms of every node whose transform, or
+	whose ancestor's, changed up to date, and places their sprites
+	accordingly. Nodes that didn't move aren't touched, so a scene
+	that's standing still costs nothing.
+	
+	Parameters:
+		scene (RS_Scene*): The scene to update.
+*/
+void RS_updateScene(RS_Scene * scene);
+
+/*
+	Retrieves a node's transform relative to the render target,
+	as of the last RS_updateScene().
+	
+	Parameters:
+		scene (RS_Scene*): The scene to access.
+		node (unsigned int): The node's handle.
+		transform (GLfloat*): Receives X, Y, rotation, X scale and
+							Y scale.
+*/
+void RS_getNodeWorldTransform(RS_Scene * scene, unsigned int node, GLfloat * transform);
+
+/*
+	Draws every sprite in a scene to the screen, parents before
+	their children.
+	
+	Parameters:
+		scene (RS_Scene*): The scene to draw.
+*/
+void RS_renderSceneToScreen(RS_Scene * scene);
+
+/*
+	Creates a static layer covering the given part of the world,
+	split into square chunks. Chunks are only allocated once
+	they're seen with something in them.
+	
+	Parameters:
+		x (GLint): The world X of the layer's left edge.
+		y (GLint): The world Y of the layer's top edge.
+		width (GLuint): The width of the layer, in pixels.
+		height (GLuint): The height of the layer, in pixels.
+		chunkSize (GLuint): The width and height of each chunk.
+	
+	Returns:
+		The new layer.
+*/
+RS_StaticLayer * RS_mkStaticLayer(GLint x, GLint y, GLuint width, GLuint height, GLuint chunkSize);
+
+/*
+	Deletes a static layer and its chunks. Its sprites are left alone.
+	
+	Parameters:
+		layer (RS_StaticLayer*): The layer to delete.
+*/
+void RS_deleteStaticLayer(RS_StaticLayer * layer);
+
+/*
+	Adds a sprite to a static layer, on top of those already in it.
+	The sprite's position is taken to be in world pixels, and it's
+	baked as it is now, transformations, frame and palettes alike.
+	
+	Parameters:
+		layer (RS_StaticLayer*): The layer to operate on.
+		sprite (RS_Sprite*): The sprite to add.
+*/
+void RS_addToStaticLayer(RS_StaticLayer * layer, RS_Sprite * sprite);
+
+/*
+	Takes a sprite back out of a static layer.
+	
+	Parameters:
+		layer (RS_StaticLayer*): The layer to operate on.
+		sprite (RS_Sprite*): The sprite to remove.
+*/
+void RS_removeFromStaticLayer(RS_StaticLayer * layer, RS_Sprite * sprite);
+
+/*
+	Tells a static layer that one of its sprites changed, so the
+	chunks it was and now is in get baked again.
+	
+	Parameters:
+		layer (RS_StaticLayer*): The layer to operate on.
+		sprite (RS_Sprite*): The sprite that changed.
+*/
+void RS_updateStaticSprite(RS_StaticLayer * layer, RS_Sprite * sprite);
+
+/*
+	Draws the chunks of a static layer that are on screen, baking
+	any of them that changed first. Chunks are baked with
+	RS_blendSpriteToSprite(), so they're premultiplied, and they
+	are drawn with premultiplied blending. The caller's blend
+	state is restored afterward.
+	
+	Parameters:
+		layer (RS_StaticLayer*): The layer to draw.
+		cameraX (GLint): The world X that lands on the left edge of
+						the screen.
+		cameraY (GLint): The world Y that lands on the top edge.
+*/
+void RS_renderStaticLayerToScreen(RS_StaticLayer * layer, GLint cameraX, GLint cameraY);
+
+/*
+	Creates a state buffer over a fixed set of sprites, starting
+	from their current states.
+	
+	Parameters:
+		sprites (RS_Sprite**): The sprites. The array is copied.
+		num (unsigned int): How many there are.
+	
+	Returns:
+		A new RS_StateBuffer.
+*/
+RS_StateBuffer * RS_mkStateBuffer(RS_Sprite ** sprites, unsigned int num);
+
+/*
+	Deletes a state buffer. The sprites are left alone.
+	
+	Parameters:
+		buffer (RS_StateBuffer*): The buffer to delete.
+*/
+void RS_deleteStateBuffer(RS_StateBuffer * buffer);
+
+/*
+	Returns the simulating thread's copy of a sprite's state, to be
+	changed as it likes, and marks it as changed. Call this from the
+	simulating thread only.
+	
+	Parameters:
+		buffer (RS_StateBuffer*): The buffer to operate on.
+		index (unsigned int): The sprite's index.
+	
+	Returns:
+		The sprite's back state.
+*/
+RS_SpriteState * RS_editSpriteState(RS_StateBuffer * buffer, unsigned int index);
+
+/*
+	RS_iterFrame() for a sprite's back state. Call this from the
+	simulating thread only.
+	
+	Parameters:
+		buffer (RS_StateBuffer*): The buffer to operate on.
+		index (unsigned int): The sprite's index.
+*/
+void RS_iterStateFrame(RS_StateBuffer * buffer, unsigned int index);
+
+/*
+	Publishes the back states as the newest frame. Call this from
+	the simulating thread only, once a frame's simulation is done.
+	
+	Parameters:
+		buffer (RS_StateBuffer*): The buffer to operate on.
+*/
+void RS_publishSpriteStates(RS_StateBuffer * buffer);
+
+/*
+	Takes the newest published frame, if there's one that hasn't
+	been taken yet, and applies the states in it that changed to the
+	sprites. Call this from the drawing thread only, before drawing.
+	
+	Parameters:
+		buffer (RS_StateBuffer*): The buffer to operate on.
+	
+	Returns:
+		1 if there was a new frame, 0 if not.
+*/
+int RS_acquireSpriteStates(RS_StateBuffer * buffer);
+
+/*
+	Returns a sprite's state as of the frame the drawing thread
+	last took. It won't change until the next
+	RS_acquireSpriteStates().
+	
+	Parameters:
+		buffer (RS_StateBuffer*): The buffer to access.
+		index (unsigned int): The sprite's index.
+	
+	Returns:
+		The sprite's front state.
+*/
+const RS_SpriteState * RS_getSpriteState(RS_StateBuffer * buffer, unsigned int index);
+
+/*
+	Returns how many bytes of texture memory the given sprite
+	currently holds on the GPU, image and attachment alike. An
+	image shared with other sprites is counted in full.
+	
+	Parameters:
+		sprite (RS_Sprite*): The sprite to access.
+	
+	Returns:
+		The sprite's estimated footprint in bytes.
+*/
+size_t RS_getSpriteMemory(RS_Sprite * sprite);
+
+/*
+	Sets how many bytes of texture memory RenderSprite may hold
+	before it starts giving memory up. Baked palette variants go
+	first, then static layer chunks that were off screen when
+	their layer was last drawn, both of which are simply made
+	again when needed. Only then are images loaded from files
+	evicted, least recently drawn first, and they are reloaded
+	the next time they are drawn. Other attachments are never
+	released, since their contents can't be recovered, but they
+	do count against the budget.
+	
+	Parameters:
+		bytes (size_t): The new budget. 0 removes the limit.
+*/
+void RS_setTextureBudget(size_t bytes);
+
+/*
+	Fills in the given RS_MemoryStats with the library-wide
+	texture memory totals.
+	
+	Parameters:
+		stats (RS_MemoryStats*): The container to populate.
+*/
+void RS_getMemoryStats(RS_MemoryStats * stats);
+
 #endif
\ No newline at end of file
@@ -1,25 +1,85 @@
 #version 120
 #define SWAP_SENSITIVITY .0001
-#define MAX_PALETTE_ENTRIES 256
 
+// This source is compiled into several variants, each with only the
+// features a draw needs. The library defines these ahead of it:
+//	CANVAS			Mix the medium into the canvas image, rather than
+//					drawing the medium alone.
+//	NUM_PALETTES	0, 1 or 2. With 2, swapHeight picks between them.
+//	PALETTE_SIZE	The length of each palette array.
+//	TINT			Multiply the result by the tint color.
+//	PALETTE_BANDS	Pick a palette per line from a band table, in place
+//					of NUM_PALETTES. BAND_PALETTES and BAND_ENTRIES give
+//					the table's dimensions.
+//	LINE_OFFSETS	Shift each line of the medium by its entry in the
+//					line offset table.
+#ifndef NUM_PALETTES
+#define NUM_PALETTES 0
+#endif
+#ifndef PALETTE_SIZE
+#define PALETTE_SIZE 1
+#endif
+
+#ifdef TINT
 uniform vec4 tint;
+#endif
+#ifdef CANVAS
 uniform float canvasMediumMix;
 uniform sampler2D canvas;
+// The part of the canvas's frame its image holds, as X, Y, width
+// and height. The rest is clear.
+uniform vec4 canvasTrim;
+#endif
 uniform sampler2D medium;
 
-uniform vec4[MAX_PALETTE_ENTRIES] paletteAKeys;
-uniform vec4[MAX_PALETTE_ENTRIES] paletteAEntries;
+#if NUM_PALETTES > 0
+uniform vec4[PALETTE_SIZE] paletteAKeys;
+uniform vec4[PALETTE_SIZE] paletteAEntries;
 uniform int numPaletteA;
+#endif
 
-uniform vec4[MAX_PALETTE_ENTRIES] paletteBKeys;
-uniform vec4[MAX_PALETTE_ENTRIES] paletteBEntries;
+#if NUM_PALETTES > 1
+uniform vec4[PALETTE_SIZE] paletteBKeys;
+uniform vec4[PALETTE_SIZE] paletteBEntries;
 uniform int numPaletteB;
 
 uniform float swapHeight;
+#endif
+
+#ifdef PALETTE_BANDS
+// Each row holds a palette's keys followed by its entries.
+uniform sampler2D paletteTable;
+// Each texel is a line's palette row and length less one, in the
+// red and green terms. A row of 255 means no palette.
+uniform sampler2D paletteBands;
+uniform float bandLines;
+uniform bool bandsInSprite;
+#endif
+
+#ifdef LINE_OFFSETS
+// Each texel is a line's X and Y offset, as 12.4 fixed point
+// biased by 32768, high byte first.
+uniform sampler2D lineOffsets;
+uniform float offsetLines;
+uniform vec2 mediumFrameSize;
+uniform vec2 mediumFrameOffset;
+uniform vec2 mediumImageSize;
+#endif
+// The part of the medium's frame its image holds. Whatever is
+// drawn outside it is clear.
+uniform vec4 mediumTrim;
 
 varying vec2 canvasUV;
 varying vec2 mediumUV;
+varying vec2 targetPos;
+varying vec2 framePos;
+
+bool inside(in vec2 p, in vec4 rect)
+{
+	return all(greaterThanEqual(p, rect.xy)) && all(lessThan(p, rect.xy+rect.zw));
+}
 
+#if NUM_PALETTES > 0 || defined(PALETTE_BANDS)
 bool compare(vec4 a, vec4 b, float variance)
 {
 	for(int i = 0; i < 4; i++)
@@ -30,9 +90,9 @@ bool compare(vec4 a, vec4 b, float variance)
 	return true;
 }
 
-void attemptSwap(inout vec4 subject, 
-				in vec4 keys[MAX_PALETTE_ENTRIES], 
-				in vec4 entries[MAX_PALETTE_ENTRIES], 
+void attemptSwap(inout vec4 subject,
+				in vec4 keys[PALETTE_SIZE],
+				in vec4 entries[PALETTE_SIZE],
 				in int numEntries)
 {
 	for(int i = 0; i < numEntries; i ++)
@@ -44,24 +104,69 @@ void attemptSwap(inout vec4 subject,
 		}
 	}
 }
+#endif
 
-void main(void)
+#ifdef PALETTE_BANDS
+void bandSwap(inout vec4 subject, in float line)
 {
-	vec4 canvasTexel = texture2D(canvas, canvasUV);
-	vec4 mediumTexel = texture2D(medium, mediumUV);
-	
-	if(numPaletteA > 0 && numPaletteB > 0)
+	// One fetch finds the line's palette.
+	vec4 band = texture2D(paletteBands, vec2((floor(line)+.5)/bandLines, .5));
+	float row = floor(band.r*255.0+.5);
+	if(row > 254.5) return;
+	int numEntries = int(floor(band.g*255.0+.5))+1;
+	float v = (row+.5)/float(BAND_PALETTES);
+	float width = float(BAND_ENTRIES*2);
+	for(int i = 0; i < numEntries; i++)
 	{
-		if(gl_FragCoord.y < swapHeight)
-			attemptSwap(mediumTexel, paletteAKeys, paletteAEntries, numPaletteA);
-		else
-			attemptSwap(mediumTexel, paletteBKeys, paletteBEntries, numPaletteB);
+		vec4 key = texture2D(paletteTable, vec2((float(i)+.5)/width, v));
+		if(compare(subject, key, SWAP_SENSITIVITY))
+		{
+			subject = texture2D(paletteTable, vec2((float(i+BAND_ENTRIES)+.5)/width, v));
+			return;
+		}
 	}
-	else if(numPaletteA > 0)
+}
+#endif
+
+#ifdef LINE_OFFSETS
+vec4 offsetTexel(in vec2 frame)
+{
+	vec4 t = texture2D(lineOffsets, vec2((floor(frame.y)+.5)/offsetLines, .5));
+	vec2 offset = (vec2(t.r, t.b)*65280.0 + vec2(t.g, t.a)*255.0)/16.0 - 2048.0;
+	// Wrap around the frame so neighbouring frames don't show.
+	frame = mod(frame+offset, mediumFrameSize);
+	// Nor should whatever was packed next to a trimmed one.
+	if(!inside(frame, mediumTrim)) return vec4(0.0);
+	return texture2D(medium, (frame+mediumFrameOffset)/mediumImageSize);
+}
+#endif
+
+void main(void)
+{
+#ifdef LINE_OFFSETS
+	vec4 mediumTexel = offsetTexel(framePos);
+#else
+	vec4 mediumTexel = inside(framePos, mediumTrim) ? texture2D(medium, mediumUV) : vec4(0.0);
+#endif
+
+#ifdef PALETTE_BANDS
+	bandSwap(mediumTexel, bandsInSprite ? framePos.y : targetPos.y);
+#elif NUM_PALETTES > 1
+	if(targetPos.y < swapHeight)
 		attemptSwap(mediumTexel, paletteAKeys, paletteAEntries, numPaletteA);
-	else if(numPaletteB > 0)
+	else
 		attemptSwap(mediumTexel, paletteBKeys, paletteBEntries, numPaletteB);
-		
+#elif NUM_PALETTES > 0
+	attemptSwap(mediumTexel, paletteAKeys, paletteAEntries, numPaletteA);
+#endif
+
+#ifdef CANVAS
+	vec4 canvasTexel = inside(targetPos, canvasTrim) ? texture2D(canvas, canvasUV) : vec4(0.0);
 	gl_FragColor = mix(canvasTexel, mediumTexel, canvasMediumMix);
+#else
+	gl_FragColor = mediumTexel;
+#endif
+#ifdef TINT
 	gl_FragColor *= tint;
-}
\ No newline at end of file
+#endif
+}
@@ -16,26 +16,40 @@ uniform vec2 position;
 uniform vec2 canvasFrameSize;
 uniform vec2 mediumFrameSize;
 // The integer texture coordinate offset to reach the current
-// frame of animation for both surfaces.
+// frame of animation for both surfaces. For the medium, this is
+// where the frame's top left corner would be, which is outside
+// the image when the frame was trimmed.
 uniform vec2 canvasFrameOffset;
 uniform vec2 mediumFrameOffset;
+// The part of the medium's frame to draw, as X, Y, width and
+// height in pixels of the frame. This is the whole frame, unless
+// it was trimmed.
+uniform vec4 mediumQuad;
 // The dimensions of each texture image.
 uniform vec2 canvasImageSize;
 uniform vec2 mediumImageSize;
+// Whether the render target is the screen, whose rows run
+// bottom to top, rather than a sprite, whose rows run top to bottom.
+uniform bool toScreen;
 // The 2D vector texture coordinates we pass through the rasterizer
 // and interpolator to the fragment shader.
 varying vec2 canvasUV, mediumUV; 
+// Where the fragment lies in pixels, on the render target and
+// within the sprite's frame, both with Y running down.
+varying vec2 targetPos, framePos;
 
 /* 
-	Rotates a coordinate around a center point
-	by the amount of radians specified.
+	Rotates a coordinate around the origin by the amount
+	of radians specified. RS_computeSpriteQuads() in
+	rendersprite.c does the same on the CPU; keep them
+	in step.
 */
-void rotate(inout vec2 subject, in vec2 center, in float amount)
+void rotate(inout vec2 subject, in float amount)
 {
-	subject -= center;
-	subject.x *= cos(amount);
-	subject.y *= sin(amount);
-	subject += center;
+	float c = cos(amount);
+	float s = sin(amount);
+	subject = vec2(c*subject.x - s*subject.y,
+					s*subject.x + c*subject.y);
 }
 
 /*
@@ -43,28 +57,31 @@ void rotate(inout vec2 subject, in vec2 center, in float amount)
 */
 void main(void)
 {
-	// Send over the current vertex' UV coordinate.
-	canvasUV = vertUV;
-	mediumUV = vertUV;
-	// But not before we transform it to rest at the
-	// proper frame in a multi frame texture image.
-	canvasUV = (canvasFrameSize/canvasImageSize) + (canvasFrameOffset/canvasImageSize);
-	mediumUV = (mediumFrameSize/mediumImageSize) + (mediumFrameOffset/mediumImageSize);
-	
-	// Create a local copy of the read-only
-	// vertex position attribute.
-	vec2 vert = vec2(vertPosition);
+	// Work in pixels, with Y running down the render target.
+	// Stretch the unit square over the part of the frame being
+	// drawn, scale it to the sprite's size and center it on the
+	// origin, so that it rotates around its middle.
+	vec2 size = mediumFrameSize*scale;
+	vec2 local = mediumQuad.xy + vertPosition*mediumQuad.zw;
+	vec2 vert = (local-mediumFrameSize*.5)*scale;
 	// Rotate that position.
-	rotate(vert, vec2(.5), rotation);
-	// Scale the vertex to be the original
-	// size of the sprite.
-	vert *= mediumFrameSize/canvasFrameSize;
-	// Apply secondary scaling.
-	vert *= scale;
-	// Move the vertex to the sprite's
-	// intended position.
-	vert += position/canvasFrameSize;
-	// Give the finished product over to the
-	// rest of the pipeline.
-	gl_Position = vec4(vert, 0.0, 1.0);
+	rotate(vert, rotation);
+	// Move the vertex to the sprite's intended position,
+	// which is the top left corner of the unrotated sprite.
+	vert += size*.5 + position;
+	
+	// The medium is sampled across the current frame of
+	// its multi frame texture image.
+	local = mediumQuad.xy + vertUV*mediumQuad.zw;
+	mediumUV = (local + mediumFrameOffset)/mediumImageSize;
+	// The canvas is sampled right under the vertex.
+	canvasUV = (vert + canvasFrameOffset)/canvasImageSize;
+	targetPos = vert;
+	framePos = local;
+	
+	// Give the finished product over to the rest of the
+	// pipeline in clip space.
+	vec2 clip = vert/canvasFrameSize*2.0 - vec2(1.0);
+	if(toScreen) clip.y = -clip.y;
+	gl_Position = vec4(clip, 0.0, 1.0);
 }
@@ -0,0 +1,469 @@
+/*	The MIT License (MIT)
+*
+*	Copyright (c) 2014 Gerard Geer
+*
+*	Permission is hereby granted, free of charge, to any person obtaining a copy
+*	of this software and associated documentation files (the "Software"), to deal
+*	in the Software without restriction, including without limitation the rights
+*	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*	copies of the Software, and to permit persons to whom the Software is
+*	furnished to do so, subject to the following conditions:
+*
+*	The above copyright notice and this permission notice shall be included in
+*	all copies or substantial portions of the Software.
+*
+*	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+*	THE SOFTWARE.
+*/
+
+/*
+	rsbench: Times parts of RenderSprite against an offscreen screen.
+	
+	By default it draws a sprite many times over, first as quads
+	and then with its hull, and reports the frame time and the
+	pixels shaded each way. Then it times working out the corners
+	and boxes of TRANSFORMS sprites on the CPU.
+	
+	The other modes:
+		pack	Loads an image LOADS times from its PNG, then as
+				many times from a sprite pack built by rspack.
+		pairs	Moves sprites about the screen for FRAMES frames
+				and finds the colliding pairs each frame.
+		palette	Builds PALETTES full palettes from RS_Colors and
+				as many from packed terms, then draws a sprite
+				with a palette that changes before every draw.
+		copy	Fills the screen with a sprite for FRAMES frames
+				as a blit, then as many frames through the shader.
+
+	Usage:
+		rsbench <png> [<frame width> <frame height>] [<sprites per frame>]
+		rsbench pack <png> <pack> <name in pack>
+		rsbench pairs <png> [<sprites>]
+		rsbench palette <png> [<sprites per frame>]
+		rsbench copy <png>
+
+	Build it headless, with GLEW built for OSMesa:
+		cc -I. -DRS_HEADLESS tools/rsbench.c rendersprite.c lodepng.c \
+			-lGLEW -lOSMesa -lpthread -lm -o rsbench
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#include "../rendersprite.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SCREEN_WIDTH 1280
+#define SCREEN_HEIGHT 720
+#define FRAMES 60
+#define TRANSFORMS 1000000
+#define LOADS 200
+#define PAIR_SPRITES 10000
+#define PALETTES 1000
+
+/*
+	Draws the given number of sprites a frame for FRAMES frames,
+	always in the same spots, and prints how it went.
+*/
+static void run(const char * label, RS_Sprite * sprite, unsigned int count)
+{
+	RS_MemoryStats before, after;
+	struct timespec start, end;
+	unsigned int frame, i, seed;
+	double seconds;
+
+	RS_getMemoryStats(&before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(frame = 0; frame < FRAMES; frame++)
+	{
+		glClear(GL_COLOR_BUFFER_BIT);
+		seed = 1;
+		for(i = 0; i < count; i++)
+		{
+			seed = seed*1103515245+12345;
+			RS_setPosition(sprite, (GLint)(seed>>8)%SCREEN_WIDTH-(GLint)RS_getWidth(sprite)/2,
+							(GLint)(seed>>20)%SCREEN_HEIGHT-(GLint)RS_getHeight(sprite)/2);
+			RS_renderSpriteToScreen(sprite);
+		}
+		glFinish();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	RS_getMemoryStats(&after);
+
+	seconds = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+	printf("%-6s %8.3f ms/frame  %14.0f px shaded of %14.0f\n", label, seconds*1000.0/FRAMES,
+			after.shadedPixels-before.shadedPixels, after.quadPixels-before.quadPixels);
+}
+
+/*
+	Returns the seconds elapsed since start.
+*/
+static double since(struct timespec * start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec-start->tv_sec)+(now.tv_nsec-start->tv_nsec)/1e9;
+}
+
+/*
+	Times RS_computeSpriteQuads() and RS_computeSpriteBounds() over
+	num rotated sprites scattered about the screen.
+*/
+static void runTransforms(unsigned int num)
+{
+	GLfloat * positions = malloc(sizeof(GLfloat)*num*2);
+	GLfloat * scales = malloc(sizeof(GLfloat)*num*2);
+	GLfloat * rotations = malloc(sizeof(GLfloat)*num);
+	GLfloat * frameSizes = malloc(sizeof(GLfloat)*num*2);
+	GLfloat * out = malloc(sizeof(GLfloat)*num*8);
+	struct timespec start;
+	unsigned int i, seed = 1;
+
+	for(i = 0; i < num; i++)
+	{
+		seed = seed*1103515245+12345;
+		positions[i*2+0] = (GLfloat)((seed>>8)%SCREEN_WIDTH);
+		positions[i*2+1] = (GLfloat)((seed>>20)%SCREEN_HEIGHT);
+		scales[i*2+0] = scales[i*2+1] = 1.0f+(seed&7)*.25f;
+		rotations[i] = (seed>>4&1023)/163.0f;
+		frameSizes[i*2+0] = frameSizes[i*2+1] = 32.0f;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	RS_computeSpriteQuads(num, positions, scales, rotations, frameSizes, out);
+	printf("quads  %8.3f ms for %u sprites\n", since(&start)*1000.0, num);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	RS_computeSpriteBounds(num, positions, scales, rotations, frameSizes, out);
+	printf("bounds %8.3f ms for %u sprites\n", since(&start)*1000.0, num);
+
+	free(positions);
+	free(scales);
+	free(rotations);
+	free(frameSizes);
+	free(out);
+}
+
+/*
+	Loads an image LOADS times over from its PNG, and then from a
+	sprite pack, deleting it each time so that nothing is served
+	from the texture cache. Pack loads include opening and closing
+	the pack.
+*/
+static int runLoads(char * png, char * packPath, char * name)
+{
+	RS_Sprite * sprite;
+	RS_Pack * pack;
+	struct timespec start;
+	unsigned int i;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < LOADS; i++)
+	{
+		sprite = RS_mkSpriteFromPNG(png);
+		if(!sprite)
+		{
+			fprintf(stderr, "rsbench: could not load %s\n", png);
+			return 1;
+		}
+		glFinish();
+		RS_deleteSprite(sprite);
+	}
+	printf("png    %8.3f ms/load\n", since(&start)*1000.0/LOADS);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < LOADS; i++)
+	{
+		pack = RS_openPack(packPath);
+		sprite = pack ? RS_mkSpriteFromPack(pack, name) : NULL;
+		if(!sprite)
+		{
+			fprintf(stderr, "rsbench: could not load %s from %s\n", name, packPath);
+			if(pack) RS_closePack(pack);
+			return 1;
+		}
+		glFinish();
+		RS_deleteSprite(sprite);
+		RS_closePack(pack);
+	}
+	printf("pack   %8.3f ms/load\n", since(&start)*1000.0/LOADS);
+	return 0;
+}
+
+/*
+	Scatters num sprites of the same image about the screen, each
+	drifting its own way, and times RS_findCollisions() over them
+	every frame for FRAMES frames. Moving them isn't timed.
+*/
+static int runPairs(char * png, unsigned int num)
+{
+	RS_Sprite ** sprites = malloc(sizeof(RS_Sprite *)*num);
+	GLint * motion = malloc(sizeof(GLint)*num*4);
+	RS_CollisionPair * pairs = malloc(sizeof(RS_CollisionPair)*num*4);
+	struct timespec start;
+	unsigned int frame, i, made, seed = 1, found = 0;
+	double seconds = 0.0;
+	
+	for(made = 0; made < num; made++)
+	{
+		// Sprites made from the same file share its texture and
+		// mask, so this is cheap after the first.
+		sprites[made] = RS_mkSpriteFromPNG(png);
+		if(!sprites[made]) break;
+		seed = seed*1103515245+12345;
+		motion[made*4+0] = (GLint)((seed>>8)%SCREEN_WIDTH);
+		motion[made*4+1] = (GLint)((seed>>20)%SCREEN_HEIGHT);
+		motion[made*4+2] = (GLint)(seed>>4&7)-3;
+		motion[made*4+3] = (GLint)(seed>>12&7)-3;
+	}
+	
+	if(made < num)
+		fprintf(stderr, "rsbench: could not load %s\n", png);
+	else
+	{
+		for(frame = 0; frame < FRAMES; frame++)
+		{
+			for(i = 0; i < num; i++)
+			{
+				// Drift, wrapping around the edges.
+				motion[i*4+0] = (motion[i*4+0]+motion[i*4+2]+SCREEN_WIDTH)%SCREEN_WIDTH;
+				motion[i*4+1] = (motion[i*4+1]+motion[i*4+3]+SCREEN_HEIGHT)%SCREEN_HEIGHT;
+				RS_setPosition(sprites[i], motion[i*4+0], motion[i*4+1]);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			found += RS_findCollisions(sprites, num, pairs, num*4);
+			seconds += since(&start);
+		}
+		printf("pairs  %8.3f ms/frame for %u sprites, %u colliding pairs a frame\n",
+				seconds*1000.0/FRAMES, num, found/FRAMES);
+	}
+	
+	for(i = 0; i < made; i++)
+		RS_deleteSprite(sprites[i]);
+	free(sprites);
+	free(motion);
+	free(pairs);
+	return made < num;
+}
+
+/*
+	Times building full palettes the old way, from arrays of
+	RS_Colors, and from packed terms, then times drawing count
+	sprites a frame with a palette that is changed before every
+	draw, so that each draw uploads it afresh.
+*/
+static int runPalettes(char * png, unsigned int count)
+{
+	RS_Color * keys[RS_MAX_PALETTE_ENTRIES];
+	RS_Color * entries[RS_MAX_PALETTE_ENTRIES];
+	GLfloat keyTerms[RS_MAX_PALETTE_ENTRIES*4], entryTerms[RS_MAX_PALETTE_ENTRIES*4];
+	RS_Color * from, * to[2];
+	RS_Palette * palette;
+	RS_Sprite * sprite;
+	struct timespec start;
+	unsigned int n, i, frame, seed;
+	
+	for(i = 0; i < RS_MAX_PALETTE_ENTRIES*4; i++)
+	{
+		keyTerms[i] = (i%4 == 3) ? 1.0f : (GLfloat)(i/4)/255.0f;
+		entryTerms[i] = 1.0f-keyTerms[i];
+	}
+	
+	// The colors are part of what the old way costs, so they're
+	// made and freed inside the timing.
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(n = 0; n < PALETTES; n++)
+	{
+		for(i = 0; i < RS_MAX_PALETTE_ENTRIES; i++)
+		{
+			keys[i] = RS_mkColor(keyTerms[i*4], keyTerms[i*4+1], keyTerms[i*4+2], keyTerms[i*4+3]);
+			entries[i] = RS_mkColor(entryTerms[i*4], entryTerms[i*4+1], entryTerms[i*4+2], entryTerms[i*4+3]);
+		}
+		palette = RS_mkPalette(keys, entries, RS_MAX_PALETTE_ENTRIES);
+		RS_scrubPalette(palette);
+		RS_deletePalette(palette);
+	}
+	printf("colors %8.3f us/palette\n", since(&start)*1e6/PALETTES);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(n = 0; n < PALETTES; n++)
+	{
+		palette = RS_mkPackedPalette(RS_MAX_PALETTE_ENTRIES);
+		RS_setPaletteColors(palette, keyTerms, entryTerms, RS_MAX_PALETTE_ENTRIES);
+		RS_deletePalette(palette);
+	}
+	printf("packed %8.3f us/palette\n", since(&start)*1e6/PALETTES);
+	
+	sprite = RS_mkSpriteFromPNG(png);
+	if(!sprite)
+	{
+		fprintf(stderr, "rsbench: could not load %s\n", png);
+		return 1;
+	}
+	palette = RS_mkPackedPalette(RS_MAX_PALETTE_ENTRIES);
+	RS_setPaletteColors(palette, keyTerms, entryTerms, RS_MAX_PALETTE_ENTRIES);
+	RS_setPaletteA(sprite, palette);
+	from = RS_mkColor(0.0f, 0.0f, 0.0f, 1.0f);
+	to[0] = RS_mkColor(1.0f, 0.0f, 0.0f, 1.0f);
+	to[1] = RS_mkColor(0.0f, 0.0f, 1.0f, 1.0f);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(frame = 0; frame < FRAMES; frame++)
+	{
+		glClear(GL_COLOR_BUFFER_BIT);
+		seed = 1;
+		for(i = 0; i < count; i++)
+		{
+			// A new version each time, so nothing is ever baked.
+			RS_setColorReplacement(palette, 0, from, to[i&1]);
+			seed = seed*1103515245+12345;
+			RS_setPosition(sprite, (GLint)(seed>>8)%SCREEN_WIDTH-(GLint)RS_getWidth(sprite)/2,
+							(GLint)(seed>>20)%SCREEN_HEIGHT-(GLint)RS_getHeight(sprite)/2);
+			RS_renderSpriteToScreen(sprite);
+		}
+		glFinish();
+	}
+	printf("upload %8.3f ms/frame for %u draws with %d-entry palettes\n",
+			since(&start)*1000.0/FRAMES, count, RS_MAX_PALETTE_ENTRIES);
+	
+	RS_deleteSprite(sprite);
+	RS_deletePalette(palette);
+	RS_deleteColor(from);
+	RS_deleteColor(to[0]);
+	RS_deleteColor(to[1]);
+	return 0;
+}
+
+/*
+	Scales a sprite up by a whole factor until it covers the
+	screen, and draws it FRAMES times with RS_copySprite(), then
+	FRAMES times with RS_renderSpriteToScreen(). Blending is off,
+	as it would be for a background.
+*/
+static int runCopies(char * png)
+{
+	RS_Sprite * sprite = RS_mkSpriteFromPNG(png);
+	struct timespec start;
+	unsigned int frame, blits = 0;
+	GLuint scale, scaleY;
+	
+	if(!sprite)
+	{
+		fprintf(stderr, "rsbench: could not load %s\n", png);
+		return 1;
+	}
+	scale = (SCREEN_WIDTH+RS_getWidth(sprite)-1)/RS_getWidth(sprite);
+	scaleY = (SCREEN_HEIGHT+RS_getHeight(sprite)-1)/RS_getHeight(sprite);
+	if(scaleY > scale) scale = scaleY;
+	RS_setScale(sprite, (GLfloat)scale, (GLfloat)scale);
+	RS_setPosition(sprite, 0, 0);
+	glDisable(GL_BLEND);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(frame = 0; frame < FRAMES; frame++)
+	{
+		blits += RS_copySprite(sprite);
+		glFinish();
+	}
+	printf("blit   %8.3f ms/frame, %u of %d frames blitted\n", since(&start)*1000.0/FRAMES, blits, FRAMES);
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(frame = 0; frame < FRAMES; frame++)
+	{
+		RS_renderSpriteToScreen(sprite);
+		glFinish();
+	}
+	printf("shader %8.3f ms/frame\n", since(&start)*1000.0/FRAMES);
+	
+	RS_deleteSprite(sprite);
+	return 0;
+}
+
+/*
+	The default mode: hulls against quads, then transforms.
+*/
+static int runHulls(int argc, char ** argv)
+{
+	RS_Sprite * sprite;
+	GLuint frameWidth = 0, frameHeight = 0;
+	unsigned int count = 2000;
+
+	if(argc >= 4)
+	{
+		frameWidth = (GLuint)atoi(argv[2]);
+		frameHeight = (GLuint)atoi(argv[3]);
+	}
+	if(argc == 3 || argc == 5)
+		count = (unsigned int)atoi(argv[argc-1]);
+
+	sprite = RS_mkAnimatedSpriteFromPNG(argv[1], frameWidth, frameHeight);
+	if(!sprite)
+	{
+		fprintf(stderr, "rsbench: could not load %s\n", argv[1]);
+		return 1;
+	}
+
+	// Hulls only apply where transparent texels change nothing.
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	printf("rsbench: %u sprites a frame, %d frames\n", count, FRAMES);
+	run("quads", sprite, count);
+	RS_buildHull(sprite);
+	run("hulls", sprite, count);
+	runTransforms(TRANSFORMS);
+
+	RS_deleteSprite(sprite);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: rsbench <png> [<frame width> <frame height>] [<sprites per frame>]\n"
+					"       rsbench pack <png> <pack> <name in pack>\n"
+					"       rsbench pairs <png> [<sprites>]\n"
+					"       rsbench palette <png> [<sprites per frame>]\n"
+					"       rsbench copy <png>\n");
+}
+
+int main(int argc, char ** argv)
+{
+	int result;
+
+	if(argc < 2)
+	{
+		usage();
+		return 1;
+	}
+	if(!RS_initHeadless(SCREEN_WIDTH, SCREEN_HEIGHT))
+	{
+		fprintf(stderr, "rsbench: could not create an offscreen context\n");
+		return 1;
+	}
+
+	// Each mode returns -1 if it was given the wrong arguments.
+	if(strcmp(argv[1], "pack") == 0)
+		result = argc == 5 ? runLoads(argv[2], argv[3], argv[4]) : -1;
+	else if(strcmp(argv[1], "pairs") == 0)
+		result = argc == 3 || argc == 4 ?
+				runPairs(argv[2], argc == 4 ? (unsigned int)atoi(argv[3]) : PAIR_SPRITES) : -1;
+	else if(strcmp(argv[1], "palette") == 0)
+		result = argc == 3 || argc == 4 ?
+				runPalettes(argv[2], argc == 4 ? (unsigned int)atoi(argv[3]) : 2000) : -1;
+	else if(strcmp(argv[1], "copy") == 0)
+		result = argc == 3 ? runCopies(argv[2]) : -1;
+	else
+		result = argc <= 5 ? runHulls(argc, argv) : -1;
+	if(result < 0)
+	{
+		usage();
+		result = 1;
+	}
+
+	RS_deInit();
+	return result;
+}
@@ -0,0 +1,261 @@
+/*	The MIT License (MIT)
+*
+*	Copyright (c) 2014 Gerard Geer
+*
+*	Permission is hereby granted, free of charge, to any person obtaining a copy
+*	of this software and associated documentation files (the "Software"), to deal
+*	in the Software without restriction, including without limitation the rights
+*	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*	copies of the Software, and to permit persons to whom the Software is
+*	furnished to do so, subject to the following conditions:
+*
+*	The above copyright notice and this permission notice shall be included in
+*	all copies or substantial portions of the Software.
+*
+*	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+*	THE SOFTWARE.
+*/
+
+/*
+	rspack: Bakes a directory of PNGs into a single RenderSprite
+	sprite pack, which RS_openPack() maps and uploads from without
+	decoding anything.
+
+	Usage:
+		rspack <directory> <output file>
+
+	Animated images declare their frame size in their filename,
+	as in "walk@32x48.png". The image is then stored under the
+	name "walk" with 32x48 frames. Other images are stored under
+	their filename without the extension.
+
+	Fully opaque images are stored as RGB, everything else as RGBA.
+*/
+
+#include "../rendersprite.h"
+#include <string.h>
+#include <dirent.h>
+
+/*
+	Everything we need to know about an image between loading
+	it and writing it out.
+*/
+typedef struct
+{
+	RS_PackEntry entry;
+	unsigned char * pixels;
+	unsigned char * palette;
+} PackImage;
+
+/*
+	Rounds an offset up to the next multiple of RS_PACK_ALIGNMENT.
+*/
+static GLuint align(GLuint offset)
+{
+	return (offset+RS_PACK_ALIGNMENT-1)/RS_PACK_ALIGNMENT*RS_PACK_ALIGNMENT;
+}
+
+/*
+	Returns 1 if the filename ends in ".png", in any case.
+*/
+static int isPNG(char * filename)
+{
+	size_t length = strlen(filename);
+	if(length < 4) return 0;
+	filename += length-4;
+	return filename[0] == '.' &&
+		(filename[1] == 'p' || filename[1] == 'P') &&
+		(filename[2] == 'n' || filename[2] == 'N') &&
+		(filename[3] == 'g' || filename[3] == 'G');
+}
+
+/*
+	Works out an image's name and frame size from its filename.
+	Returns 0 if the name is too long to store.
+*/
+static int parseName(char * filename, PackImage * image)
+{
+	char * at;
+	size_t length = strlen(filename)-4;
+	if(length >= RS_PACK_NAME_LENGTH) return 0;
+
+	memset(image->entry.name, 0, RS_PACK_NAME_LENGTH);
+	memcpy(image->entry.name, filename, length);
+	image->entry.frameWidth = 0;
+	image->entry.frameHeight = 0;
+
+	// Look for a frame size suffix.
+	at = strrchr(image->entry.name, '@');
+	if(at && sscanf(at+1, "%ux%u", &image->entry.frameWidth, &image->entry.frameHeight) == 2)
+		memset(at, 0, RS_PACK_NAME_LENGTH-(at-image->entry.name));
+	else
+	{
+		image->entry.frameWidth = 0;
+		image->entry.frameHeight = 0;
+	}
+	return 1;
+}
+
+/*
+	Gathers the distinct colors of an RGBA image into a palette.
+	Gives up, leaving the image without one, once there are more
+	than RS_MAX_PALETTE_ENTRIES.
+*/
+static void buildPalette(unsigned char * rgba, PackImage * image)
+{
+	size_t i, n = (size_t)image->entry.width*image->entry.height;
+	GLuint num = 0, j;
+	image->palette = malloc(RS_MAX_PALETTE_ENTRIES*4);
+	for(i = 0; i < n; i++)
+	{
+		for(j = 0; j < num; j++)
+			if(memcmp(&image->palette[j*4], &rgba[i*4], 4) == 0)
+				break;
+		if(j < num) continue;
+		if(num == RS_MAX_PALETTE_ENTRIES)
+		{
+			num = 0;
+			break;
+		}
+		memcpy(&image->palette[(num++)*4], &rgba[i*4], 4);
+	}
+	image->entry.paletteSize = num;
+}
+
+/*
+	Loads a PNG, converting it to the layout it'll be stored in.
+	Returns 0 if the PNG couldn't be loaded.
+*/
+static int loadImage(char * path, PackImage * image)
+{
+	unsigned char * rgba;
+	size_t i, n;
+	int opaque = 1;
+	unsigned error = lodepng_decode32_file(&rgba, &image->entry.width, &image->entry.height, path);
+	if(error)
+	{
+		fprintf(stderr, "rspack: %s: %s\n", path, lodepng_error_text(error));
+		return 0;
+	}
+
+	n = (size_t)image->entry.width*image->entry.height;
+	for(i = 0; i < n && opaque; i++)
+		opaque = rgba[i*4+3] == 255;
+	buildPalette(rgba, image);
+
+	if(opaque)
+	{
+		// Drop the alpha terms in place.
+		for(i = 0; i < n; i++)
+		{
+			rgba[i*3+0] = rgba[i*4+0];
+			rgba[i*3+1] = rgba[i*4+1];
+			rgba[i*3+2] = rgba[i*4+2];
+		}
+		image->entry.format = RS_RGB;
+	}
+	else
+		image->entry.format = RS_RGBA;
+	image->pixels = rgba;
+	return 1;
+}
+
+/*
+	Writes zeros to pad the file out to the given offset.
+*/
+static void padTo(FILE * out, GLuint offset)
+{
+	while((GLuint)ftell(out) < offset)
+		fputc(0, out);
+}
+
+int main(int argc, char ** argv)
+{
+	DIR * dir;
+	struct dirent * file;
+	PackImage * images = NULL;
+	RS_PackHeader header;
+	GLuint num = 0, offset, i;
+	FILE * out;
+
+	if(argc != 3)
+	{
+		fprintf(stderr, "usage: rspack <directory> <output file>\n");
+		return 1;
+	}
+	dir = opendir(argv[1]);
+	if(!dir)
+	{
+		fprintf(stderr, "rspack: could not open %s\n", argv[1]);
+		return 1;
+	}
+
+	// Load every PNG in the directory.
+	while((file = readdir(dir)) != NULL)
+	{
+		char * path;
+		if(!isPNG(file->d_name)) continue;
+		images = realloc(images, sizeof(PackImage)*(num+1));
+		if(!parseName(file->d_name, &images[num]))
+		{
+			fprintf(stderr, "rspack: %s: name too long, skipped\n", file->d_name);
+			continue;
+		}
+		path = malloc(strlen(argv[1])+strlen(file->d_name)+2);
+		sprintf(path, "%s/%s", argv[1], file->d_name);
+		if(loadImage(path, &images[num]))
+			++num;
+		free(path);
+	}
+	closedir(dir);
+
+	// Lay out the data section after the header and index.
+	offset = sizeof(RS_PackHeader)+num*sizeof(RS_PackEntry);
+	for(i = 0; i < num; i++)
+	{
+		RS_PackEntry * entry = &images[i].entry;
+		offset = align(offset);
+		entry->paletteOffset = entry->paletteSize ? offset : 0;
+		offset += entry->paletteSize*4;
+		offset = align(offset);
+		entry->pixelOffset = offset;
+		offset += entry->width*entry->height*(entry->format == RS_RGB ? 3 : 4);
+	}
+
+	out = fopen(argv[2], "wb");
+	if(!out)
+	{
+		fprintf(stderr, "rspack: could not write %s\n", argv[2]);
+		return 1;
+	}
+	memcpy(header.magic, RS_PACK_MAGIC, 4);
+	header.byteOrder = RS_PACK_BYTE_ORDER;
+	header.version = RS_PACK_VERSION;
+	header.numImages = num;
+	fwrite(&header, sizeof(RS_PackHeader), 1, out);
+	for(i = 0; i < num; i++)
+		fwrite(&images[i].entry, sizeof(RS_PackEntry), 1, out);
+	for(i = 0; i < num; i++)
+	{
+		RS_PackEntry * entry = &images[i].entry;
+		if(entry->paletteSize)
+		{
+			padTo(out, entry->paletteOffset);
+			fwrite(images[i].palette, 4, entry->paletteSize, out);
+		}
+		padTo(out, entry->pixelOffset);
+		fwrite(images[i].pixels, entry->format == RS_RGB ? 3 : 4, entry->width*entry->height, out);
+		free(images[i].palette);
+		free(images[i].pixels);
+	}
+	fclose(out);
+	free(images);
+
+	printf("rspack: packed %u images into %s\n", num, argv[2]);
+	return 0;
+}